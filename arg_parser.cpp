@@ -6,6 +6,8 @@
 **************************/
 
 #include "arg_parser.h"
+#include <charconv>
+#include <iostream>
 
 // Constructor that automatically parses the arguments
 ArgumentParser::ArgumentParser(int argc, char *argv[]) {
@@ -20,6 +22,21 @@ string ArgumentParser::getOption(const string &option) const {
     return "";
 }
 
+// Retrieve a numeric option within [minValue, maxValue], defaultValue if it is missing; false (with an error) if invalid
+bool ArgumentParser::getNumber(const string &option, long long defaultValue, long long minValue, long long maxValue, long long &value) const {
+    string text = getOption(option);
+    if (text.empty()) {
+        value = defaultValue;
+        return true;
+    }
+    auto [end, ec] = from_chars(text.data(), text.data() + text.size(), value);
+    if (ec != errc() || end != text.data() + text.size() || value < minValue || value > maxValue) {
+        cerr << "Error: invalid value for " << option << ": " << text << " (expected a number from " << minValue << " to " << maxValue << ")." << endl;
+        return false;
+    }
+    return true;
+}
+
 // Check if a flag (e.g., "-T") is present
 bool ArgumentParser::hasFlag(const string &flag) const {
     return flags.count(flag) > 0;
@@ -37,8 +54,10 @@ bool ArgumentParser::hasUnexpectedArgs() const {
 
 // Function to parse command-line arguments
 void ArgumentParser::parseArguments(int argc, char *argv[]) {
-    const vector<string> validOptions = {"-p", "-a", "-o", "-b", "-c", "-C"};
-    const vector<string> validFlags = {"-T", "-n", "-h", "-help"};
+    const vector<string> validOptions = {"-p", "-a", "-o", "-b", "-c", "-C", "--max-size", "--partial-size", "--connect-timeout", "--read-timeout", "--pipeline-memory", "--order", "--weights", "--time-budget", "--eol",
+                                         "--listen", "--sync-interval", "--record", "--replay", "--replay-speed", "--search"};
+    const vector<string> validFlags = {"-T", "-n", "-h", "-help", "--finish-partial", "--lazy-attachments",
+                                       "--extract-attachments", "--index", "--stats", "--mem-stats", "--ktls", "--bulk-headers", "--fast-startup"};
 
     for (int i = 1; i < argc; ++i) {
         string arg = argv[i];
@@ -23,6 +23,9 @@ public:
     // Retrieve a value for an option (e.g., "-a" returns "auth_file")
     string getOption(const string &option) const;
 
+    // Retrieve a numeric option within [minValue, maxValue], defaultValue if it is missing; false (with an error) if invalid
+    bool getNumber(const string &option, long long defaultValue, long long minValue, long long maxValue, long long &value) const;
+
     // Check if a flag (e.g., "-T") is present
     bool hasFlag(const string &flag) const;
 
@@ -0,0 +1,360 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#include "codec.h"
+#include <cstring>
+#include <cstdint>
+#include <array>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CODEC_X86 1
+#endif
+
+// Sextet value of every base64 character, 0xFF for characters outside the alphabet
+static const uint8_t *base64Table() {
+    static const array<uint8_t, 256> table = [] {
+        const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        array<uint8_t, 256> values;
+        values.fill(0xFF);
+        for (int i = 0; i < 64; i++) {
+            values[static_cast<uint8_t>(alphabet[i])] = i;
+        }
+        return values;
+    }();
+    return table.data();
+}
+
+// Decodes from pos until at least `stop` is reached on a quad boundary, the input ends or padding is found.
+// Returns false once the end of the data was reached, so the caller stops decoding.
+static bool decodeBase64Run(const uint8_t *src, size_t length, size_t &pos, size_t stop, uint8_t *&dst) {
+    const uint8_t *table = base64Table();
+    uint32_t quad = 0;
+    int count = 0;
+    bool padded = false;
+
+    while (pos < length && !(pos >= stop && count == 0)) {
+        uint8_t c = src[pos++];
+        if (c == '=') {
+            padded = true;
+            break;
+        }
+        uint8_t value = table[c];
+        if (value == 0xFF) {
+            continue;   // Line breaks and other noise
+        }
+        quad = (quad << 6) | value;
+        if (++count == 4) {
+            *dst++ = quad >> 16;
+            *dst++ = quad >> 8;
+            *dst++ = quad;
+            quad = 0;
+            count = 0;
+        }
+    }
+
+    // Unpadded or padded tail of one or two bytes
+    if (count == 3) {
+        *dst++ = quad >> 10;
+        *dst++ = quad >> 2;
+    } else if (count == 2) {
+        *dst++ = quad >> 4;
+    }
+    return !padded && count == 0;
+}
+
+#ifdef CODEC_X86
+// Translates blocks of 16 characters to sextets and packs them to 12 bytes (16 bytes are stored).
+// Stops at the first block containing a character outside the alphabet and returns the number of characters consumed.
+__attribute__((target("ssse3")))
+static size_t decodeBase64SSSE3(const uint8_t *src, size_t length, uint8_t *dst) {
+    const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask2F = _mm_set1_epi8(0x2F);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t pos = 0;
+
+    while (length - pos >= 16) {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + pos));
+        __m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask2F);
+        __m128i loNibbles = _mm_and_si128(in, mask2F);
+        __m128i hi = _mm_shuffle_epi8(lutHi, hiNibbles);
+        __m128i lo = _mm_shuffle_epi8(lutLo, loNibbles);
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0) {
+            break;
+        }
+        __m128i eq2F = _mm_cmpeq_epi8(in, mask2F);
+        __m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(eq2F, hiNibbles));
+        __m128i values = _mm_add_epi8(in, roll);
+
+        // Merge four 6-bit values into three bytes per 32-bit lane
+        __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+        merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_shuffle_epi8(merged, pack));
+
+        pos += 16;
+        dst += 12;
+    }
+    return pos;
+}
+
+// Same as the SSSE3 kernel with 32 characters per step
+__attribute__((target("avx2")))
+static size_t decodeBase64AVX2(const uint8_t *src, size_t length, uint8_t *dst) {
+    const __m256i lutLo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                           0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lutHi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                           0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lutRoll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                             0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask2F = _mm256_set1_epi8(0x2F);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t pos = 0;
+
+    while (length - pos >= 32) {
+        __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + pos));
+        __m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask2F);
+        __m256i loNibbles = _mm256_and_si256(in, mask2F);
+        __m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+        __m256i lo = _mm256_shuffle_epi8(lutLo, loNibbles);
+        if (!_mm256_testz_si256(lo, hi)) {
+            break;
+        }
+        __m256i eq2F = _mm256_cmpeq_epi8(in, mask2F);
+        __m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(eq2F, hiNibbles));
+        __m256i values = _mm256_add_epi8(in, roll);
+
+        __m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        merged = _mm256_shuffle_epi8(merged, pack);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), _mm256_permutevar8x32_epi32(merged, lanes));
+
+        pos += 32;
+        dst += 24;
+    }
+    return pos;
+}
+#endif
+
+void decodeBase64Scalar(string_view input, string &output) {
+    size_t start = output.size();
+    output.resize(start + input.size() / 4 * 3 + 3);
+    uint8_t *dst = reinterpret_cast<uint8_t *>(output.data()) + start;
+    size_t pos = 0;
+
+    decodeBase64Run(reinterpret_cast<const uint8_t *>(input.data()), input.size(), pos, input.size(), dst);
+    output.resize(dst - reinterpret_cast<uint8_t *>(output.data()));
+}
+
+void decodeBase64(string_view input, string &output) {
+#ifdef CODEC_X86
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+    static const bool hasSSSE3 = __builtin_cpu_supports("ssse3");
+
+    if (!hasAVX2 && !hasSSSE3) {
+        decodeBase64Scalar(input, output);
+        return;
+    }
+
+    // Drop the line breaks first, so the kernels see long runs of alphabet characters.
+    // The scratch buffer is kept between calls, large fresh allocations would pay for page faults every time.
+    thread_local string compact;
+    if (compact.size() < input.size()) {
+        compact.resize(input.size());
+    }
+    size_t compactLength = 0;
+    size_t lineLength = 0;
+    for (size_t pos = 0; pos < input.size();) {
+        // Encoders use a fixed line length, so the next line break is usually where the previous one was.
+        // A wrong guess only leaves a stray character in the buffer, which the scalar decoder skips.
+        size_t lineEnd;
+        if (lineLength > 0 && pos + lineLength + 1 < input.size() &&
+            input[pos + lineLength] == '\r' && input[pos + lineLength + 1] == '\n') {
+            lineEnd = pos + lineLength + 1;
+        } else {
+            const char *newline = static_cast<const char *>(memchr(input.data() + pos, '\n', input.size() - pos));
+            lineEnd = newline ? newline - input.data() : input.size();
+        }
+        size_t copyEnd = (lineEnd > pos && input[lineEnd - 1] == '\r') ? lineEnd - 1 : lineEnd;
+        memcpy(compact.data() + compactLength, input.data() + pos, copyEnd - pos);
+        compactLength += copyEnd - pos;
+        lineLength = copyEnd - pos;
+        pos = lineEnd + 1;
+    }
+
+    const uint8_t *src = reinterpret_cast<const uint8_t *>(compact.data());
+    size_t start = output.size();
+    output.resize(start + compactLength / 4 * 3 + 32);   // Kernels store a few bytes past the decoded data
+    uint8_t *dst = reinterpret_cast<uint8_t *>(output.data()) + start;
+    size_t pos = 0;
+
+    while (pos < compactLength) {
+        size_t decoded = hasAVX2 ? decodeBase64AVX2(src + pos, compactLength - pos, dst)
+                                 : decodeBase64SSSE3(src + pos, compactLength - pos, dst);
+        pos += decoded;
+        dst += decoded / 4 * 3;
+
+        // The scalar decoder handles the block the kernel stopped at and realigns to a full quad
+        if (!decodeBase64Run(src, compactLength, pos, pos + 32, dst)) {
+            break;
+        }
+    }
+    output.resize(dst - reinterpret_cast<uint8_t *>(output.data()));
+#else
+    decodeBase64Scalar(input, output);
+#endif
+}
+
+#ifdef CODEC_X86
+// Scans 32 bytes at a time for findByte, returns the position of the first block with a match or the last full block
+__attribute__((target("avx2")))
+static size_t findByteAVX2(string_view input, size_t pos, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    while (input.size() - pos >= 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input.data() + pos));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 32;
+    }
+    return pos;
+}
+#endif
+
+void encodeBase64(string_view input, string &output) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const uint8_t *src = reinterpret_cast<const uint8_t *>(input.data());
+    size_t pos = 0;
+    output.reserve(output.size() + (input.size() + 2) / 3 * 4);
+
+    for (; pos + 3 <= input.size(); pos += 3) {
+        uint32_t triple = src[pos] << 16 | src[pos + 1] << 8 | src[pos + 2];
+        output += alphabet[triple >> 18];
+        output += alphabet[triple >> 12 & 0x3F];
+        output += alphabet[triple >> 6 & 0x3F];
+        output += alphabet[triple & 0x3F];
+    }
+    if (pos < input.size()) {
+        uint32_t triple = src[pos] << 16 | (pos + 1 < input.size() ? src[pos + 1] << 8 : 0);
+        output += alphabet[triple >> 18];
+        output += alphabet[triple >> 12 & 0x3F];
+        output += pos + 1 < input.size() ? alphabet[triple >> 6 & 0x3F] : '=';
+        output += '=';
+    }
+}
+
+// Finds the next occurrence of c at or after pos, returns the input size if there is none
+static size_t findByte(string_view input, size_t pos, char c) {
+#ifdef CODEC_X86
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+    if (hasAVX2) {
+        pos = findByteAVX2(input, pos, c);
+        if (pos < input.size() && input[pos] == c) {
+            return pos;
+        }
+    }
+    const __m128i needle = _mm_set1_epi8(c);
+    while (input.size() - pos >= 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input.data() + pos));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+    }
+#endif
+    for (; pos < input.size(); ++pos) {
+        if (input[pos] == c) {
+            return pos;
+        }
+    }
+    return input.size();
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+void decodeQuotedPrintable(string_view input, string &output) {
+    output.reserve(output.size() + input.size());
+    size_t pos = 0;
+
+    while (pos < input.size()) {
+        size_t escape = findByte(input, pos, '=');
+        output.append(input.data() + pos, escape - pos);
+        if (escape == input.size()) {
+            break;
+        }
+
+        // Soft line break "=\r\n" (or "=\n"), escaped byte "=XX", or a stray '=' kept as is
+        if (escape + 1 < input.size() && input[escape + 1] == '\n') {
+            pos = escape + 2;
+        } else if (escape + 2 < input.size() && input[escape + 1] == '\r' && input[escape + 2] == '\n') {
+            pos = escape + 3;
+        } else if (escape + 2 < input.size() && hexValue(input[escape + 1]) >= 0 && hexValue(input[escape + 2]) >= 0) {
+            output += static_cast<char>(hexValue(input[escape + 1]) * 16 + hexValue(input[escape + 2]));
+            pos = escape + 3;
+        } else {
+            output += '=';
+            pos = escape + 1;
+        }
+    }
+}
+
+void convertLineEndings(string_view input, string &output, LineEnding eol, char &previous) {
+    if (input.empty()) {
+        return;
+    }
+    if (eol == LineEnding::Keep) {
+        output.append(input);
+    } else if (eol == LineEnding::LF) {
+        // A '\r' that ended the previous piece belongs to this line break
+        if (previous == '\r' && input[0] == '\n' && !output.empty() && output.back() == '\r') {
+            output.pop_back();
+        }
+        output.reserve(output.size() + input.size());
+        size_t pos = 0;
+        while (pos < input.size()) {
+            size_t cr = findByte(input, pos, '\r');
+            bool lineBreak = cr + 1 < input.size() && input[cr + 1] == '\n';
+            // Copy the run up to the '\r', which is dropped before a '\n' and kept otherwise
+            size_t runEnd = lineBreak ? cr : min(cr + 1, input.size());
+            output.append(input.data() + pos, runEnd - pos);
+            pos = cr + 1;
+        }
+    } else {
+        // Lines are usually short, leave room for a '\r' per line
+        output.reserve(output.size() + input.size() + input.size() / 32);
+        size_t pos = 0;
+        while (pos < input.size()) {
+            size_t lf = findByte(input, pos, '\n');
+            output.append(input.data() + pos, lf - pos);
+            if (lf == input.size()) {
+                break;
+            }
+            if ((lf > 0 ? input[lf - 1] : previous) != '\r') {
+                output += '\r';
+            }
+            output += '\n';
+            pos = lf + 1;
+        }
+    }
+    previous = input.back();
+}
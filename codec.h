@@ -0,0 +1,66 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+/**
+ * Decodes base64 data (RFC 2045) and appends the result to the output string.
+ * Line breaks and other characters outside the alphabet are skipped, decoding stops at the first '='.
+ * Uses AVX2 or SSSE3 kernels when the CPU supports them and the scalar decoder otherwise.
+ * @param input - The encoded data.
+ * @param output - The string the decoded bytes are appended to.
+ */
+void decodeBase64(string_view input, string &output);
+
+/**
+ * Scalar reference implementation of decodeBase64, also used for the tail and for irregular input.
+ * @param input - The encoded data.
+ * @param output - The string the decoded bytes are appended to.
+ */
+void decodeBase64Scalar(string_view input, string &output);
+
+/**
+ * Encodes data in base64 (RFC 4648) without line breaks and appends the result to the output string.
+ * @param input - The data to encode.
+ * @param output - The string the encoded characters are appended to.
+ */
+void encodeBase64(string_view input, string &output);
+
+/**
+ * Decodes quoted-printable data (RFC 2045) and appends the result to the output string.
+ * Soft line breaks are removed and "=XX" escapes are decoded, runs of plain text are copied in bulk.
+ * @param input - The encoded data.
+ * @param output - The string the decoded bytes are appended to.
+ */
+void decodeQuotedPrintable(string_view input, string &output);
+
+// Line endings of the saved messages
+enum class LineEnding {
+    Keep,       // As sent by the server, mixed with the CRLF written by the client
+    LF,         // "\n" (Unix)
+    CRLF        // "\r\n" (RFC 5322)
+};
+
+/**
+ * Appends the input to the output with its line endings converted. With LF every "\r\n" becomes "\n",
+ * with CRLF every "\n" without a preceding '\r' becomes "\r\n"; other bytes are copied unchanged.
+ * The line breaks are found with AVX2 or SSE2 when the CPU supports them, the runs between them are copied in bulk.
+ * Data may be converted in pieces appended to the same output, a "\r\n" split between pieces is recognized.
+ * @param input - The data to convert.
+ * @param output - The string the converted data is appended to.
+ * @param eol - The line ending to convert to.
+ * @param previous - The last byte of the previous piece (0 for the first), updated to the last byte of the input.
+ */
+void convertLineEndings(string_view input, string &output, LineEnding eol, char &previous);
+
+#endif // CODEC_H
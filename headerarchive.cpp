@@ -0,0 +1,357 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#include "headerarchive.h"
+#include "net.h"
+#include <fcntl.h>
+
+// Header fields stored in the records, with their JSON keys
+static constexpr string_view ARCHIVE_FIELDS[] = {"date", "from", "to", "subject", "message-id"};
+
+// Writes the whole buffer, retrying after short writes
+static bool writeAll(int fd, const string &data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t chunk = write(fd, data.data() + written, data.size() - written);
+        if (chunk <= 0) {
+            return false;
+        }
+        written += chunk;
+    }
+    return true;
+}
+
+// Length of the valid UTF-8 sequence at pos, 0 if the bytes there are not valid UTF-8 (RFC 3629)
+static size_t utf8SequenceLength(string_view value, size_t pos) {
+    unsigned char lead = value[pos];
+    size_t length = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2;
+    if (lead < 0xc2 || lead > 0xf4 || pos + length > value.size()) {
+        return 0;
+    }
+    for (size_t i = 1; i < length; i++) {
+        if ((static_cast<unsigned char>(value[pos + i]) & 0xc0) != 0x80) {
+            return 0;
+        }
+    }
+    // Overlong forms, surrogates and code points above U+10FFFF
+    unsigned char second = value[pos + 1];
+    if ((lead == 0xe0 && second < 0xa0) || (lead == 0xed && second >= 0xa0) || (lead == 0xf0 && second < 0x90) ||
+        (lead == 0xf4 && second >= 0x90)) {
+        return 0;
+    }
+    return length;
+}
+
+// Appends a JSON string literal, control characters are escaped; header fields may carry raw 8-bit bytes in
+// another charset, bytes that are not valid UTF-8 are taken as Latin-1 and escaped, so the records stay valid JSON
+static void appendJsonString(string &out, string_view value) {
+    out += '"';
+    for (size_t pos = 0; pos < value.size();) {
+        unsigned char c = value[pos];
+        size_t length = c >= 0x80 ? utf8SequenceLength(value, pos) : 1;
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20 || length == 0) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += value.substr(pos, length);
+        }
+        pos += max<size_t>(length, 1);
+    }
+    out += '"';
+}
+
+HeaderArchive::HeaderArchive(const string &dir, int uidvalidity) : dir(dir) {
+    string recordsPath = dir + "/headers.jsonl";
+    string indexPath = dir + "/headers.idx";
+
+    // Only complete lines of the index count, a torn last entry is written again
+    ifstream indexFile(indexPath, ios::binary);
+    string content((istreambuf_iterator<char>(indexFile)), istreambuf_iterator<char>());
+    string header = "UIDVALIDITY: " + to_string(uidvalidity) + "\n";
+    bool valid = content.starts_with(header);
+    if (valid) {
+        size_t lineStart = header.size();
+        for (size_t eol; (eol = content.find('\n', lineStart)) != string::npos; lineStart = eol + 1) {
+            istringstream entry(content.substr(lineStart, eol - lineStart));
+            int uid;
+            size_t offset, length;
+            if (entry >> uid >> offset >> length) {
+                stored.insert(uid);
+            }
+        }
+        content.resize(lineStart);
+    }
+
+    int flags = O_WRONLY | O_CREAT | (valid ? 0 : O_TRUNC);
+    recordsFd = open(recordsPath.c_str(), flags | O_APPEND, 0644);
+    indexFd = open(indexPath.c_str(), flags, 0644);
+    if (!isOpen()) {
+        return;
+    }
+    if (valid) {
+        // Drop the torn entry, if any, so the new entries start on a line of their own
+        if (ftruncate(indexFd, content.size()) != 0 || lseek(indexFd, 0, SEEK_END) < 0) {
+            close(indexFd);
+            indexFd = -1;
+        }
+    } else if (!writeAll(indexFd, header)) {
+        close(indexFd);
+        indexFd = -1;
+    }
+    recordsEnd = isOpen() ? lseek(recordsFd, 0, SEEK_END) : 0;
+}
+
+HeaderArchive::~HeaderArchive() {
+    if (recordsFd >= 0) {
+        close(recordsFd);
+    }
+    if (indexFd >= 0) {
+        close(indexFd);
+    }
+}
+
+void HeaderArchive::add(int uid, long messageSize, string_view header) {
+    size_t recordStart = records.size();
+    records += "{\"uid\":" + to_string(uid);
+    if (messageSize >= 0) {
+        records += ",\"size\":" + to_string(messageSize);
+    }
+
+    // Unfold the fields and keep the first occurrence of each
+    string values[size(ARCHIVE_FIELDS)];
+    bool found[size(ARCHIVE_FIELDS)] = {};
+    int current = -1;
+    size_t lineStart = 0;
+    while (lineStart < header.size()) {
+        size_t eol = header.find('\n', lineStart);
+        size_t lineEnd = eol == string_view::npos ? header.size() : eol;
+        string_view line = header.substr(lineStart, lineEnd - lineStart);
+        if (line.ends_with('\r')) {
+            line.remove_suffix(1);
+        }
+        lineStart = lineEnd + 1;
+
+        if (!line.empty() && (line[0] == ' ' || line[0] == '\t')) {
+            if (current >= 0) {
+                values[current] += line;
+            }
+            continue;
+        }
+        current = -1;
+        size_t colon = line.find(':');
+        if (colon == string_view::npos) {
+            continue;
+        }
+        string name(line.substr(0, colon));
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        for (size_t i = 0; i < size(ARCHIVE_FIELDS); i++) {
+            if (name == ARCHIVE_FIELDS[i] && !found[i]) {
+                found[i] = true;
+                current = i;
+                string_view value = line.substr(colon + 1);
+                values[i] = value.substr(min(value.find_first_not_of(" \t"), value.size()));
+            }
+        }
+    }
+    for (size_t i = 0; i < size(ARCHIVE_FIELDS); i++) {
+        if (found[i]) {
+            records += ",\"";
+            records += ARCHIVE_FIELDS[i];
+            records += "\":";
+            appendJsonString(records, values[i]);
+        }
+    }
+    records += "}\n";
+
+    size_t length = records.size() - recordStart;
+    indexEntries += to_string(uid) + " " + to_string(recordsEnd) + " " + to_string(length) + "\n";
+    recordsEnd += length;
+    stored.insert(uid);
+}
+
+bool HeaderArchive::flush() {
+    // The index is written after the records are on disk, so it never points past them
+    if (!isOpen() || !writeAll(recordsFd, records) || fsync(recordsFd) != 0 ||
+        !writeAll(indexFd, indexEntries) || fsync(indexFd) != 0) {
+        return false;
+    }
+    records.clear();
+    indexEntries.clear();
+    return true;
+}
+
+HeaderFetchParser::HeaderFetchParser(const string &tag, MessageCallback callback) : tag(tag), callback(move(callback)) {}
+
+// Finds the value of a numeric FETCH item such as "UID 12" in the text outside the literals
+static bool findNumberItem(string_view items, string_view name, long &value) {
+    for (size_t pos = items.find(name); pos != string_view::npos; pos = items.find(name, pos + 1)) {
+        size_t valueStart = pos + name.size();
+        if ((pos == 0 || items[pos - 1] == ' ' || items[pos - 1] == '(') && valueStart < items.size() && items[valueStart] == ' ' &&
+            from_chars(items.data() + valueStart + 1, items.data() + items.size(), value).ec == errc()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads the header fields sent as a quoted string or NIL instead of a literal, e.g. by servers answering with ""
+// for a message that has none of the fields
+static bool findQuotedSection(string_view line, string &header) {
+    size_t section = line.find("BODY[HEADER.FIELDS");
+    size_t valueStart = section == string_view::npos ? string_view::npos : line.find("] ", section);
+    if (valueStart == string_view::npos) {
+        return false;
+    }
+    string_view value = line.substr(valueStart + 2);
+    header.clear();
+    if (value.starts_with("NIL")) {
+        return true;
+    }
+    if (!value.starts_with('"')) {
+        return false;
+    }
+    for (size_t pos = 1; pos < value.size(); pos++) {
+        if (value[pos] == '"') {
+            return true;
+        }
+        if (value[pos] == '\\' && pos + 1 < value.size()) {
+            pos++;
+        }
+        header += value[pos];
+    }
+    return false;
+}
+
+void HeaderFetchParser::handleResponse(string_view response) {
+    if (response.starts_with(tag) && response.size() > tag.size() && response[tag.size()] == ' ') {
+        string_view rest = response.substr(tag.size() + 1);
+        status = string(rest.substr(0, rest.find_first_of(" \r")));
+        return;
+    }
+    if (!response.starts_with("* ")) {
+        return;
+    }
+
+    // "* 12 FETCH (UID 34 RFC822.SIZE 567 BODY[HEADER.FIELDS (...)] {89}\r\n<literal> ...)"; the items may come in any order
+    size_t literalOffset, literalLength;
+    size_t firstLineEnd = response.find("\r\n");
+    string_view firstLine = response.substr(0, firstLineEnd);
+    if (firstLine.find(" FETCH (") == string_view::npos) {
+        return;
+    }
+    string items, header;
+    if (findFetchLiteralStart(response, literalOffset, literalLength)) {
+        items = firstLine;
+        items += ' ';
+        items += response.substr(literalOffset + literalLength);
+        header = response.substr(literalOffset, literalLength);
+    } else if (!findQuotedSection(firstLine, header)) {
+        return;
+    } else {
+        items = firstLine;
+    }
+
+    long uid, size = -1;
+    if (!findNumberItem(items, "UID", uid)) {
+        return;
+    }
+    findNumberItem(items, "RFC822.SIZE", size);
+    callback(static_cast<int>(uid), size, header);
+}
+
+bool HeaderFetchParser::feed(const char *data, size_t length) {
+    pending.append(data, length);
+    size_t responseStart = 0;
+
+    // Hand over every complete response, a response continues after each literal it contains
+    while (status.empty()) {
+        size_t pos = responseStart;
+        bool complete = false;
+        while (pos < pending.size()) {
+            size_t eol = pending.find("\r\n", pos);
+            if (eol == string::npos) {
+                break;
+            }
+            string_view line(pending.data() + pos, eol - pos);
+            size_t open = line.rfind('{');
+            size_t literalLength;
+            if (line.ends_with('}') && open != string_view::npos &&
+                from_chars(line.data() + open + 1, line.data() + line.size() - 1, literalLength).ec == errc()) {
+                pos = eol + 2 + literalLength;
+                continue;
+            }
+            pos = eol + 2;
+            complete = true;
+            break;
+        }
+        if (!complete) {
+            break;
+        }
+        handleResponse(string_view(pending.data() + responseStart, pos - responseStart));
+        responseStart = pos;
+    }
+    pending.erase(0, responseStart);
+    return !status.empty();
+}
+
+bool fetchHeaderArchive(HeaderArchive &archive, const vector<int> &uids, const function<int(const string &)> &send,
+                        const function<int(char *, size_t)> &receive, chrono::steady_clock::time_point deadline,
+                        const function<void(int uid, string_view header)> &onMessage) {
+    vector<int> missing;
+    for (int uid : uids) {
+        if (!archive.contains(uid)) {
+            missing.push_back(uid);
+        }
+    }
+
+    char buffer[65536];
+    for (size_t batchStart = 0; batchStart < missing.size(); batchStart += HEADER_BATCH_UIDS) {
+        if (chrono::steady_clock::now() >= deadline) {
+            return true;
+        }
+        vector<int> batch(missing.begin() + batchStart, missing.begin() + min(batchStart + HEADER_BATCH_UIDS, missing.size()));
+
+        for (const string &uidSet : buildSequenceSets(batch)) {
+            string tag = generateTag();
+            string command = tag + " UID FETCH " + uidSet + " (UID RFC822.SIZE BODY.PEEK[HEADER.FIELDS (DATE FROM TO SUBJECT MESSAGE-ID)])\r\n";
+            if (send(command) <= 0) {
+                cerr << "Error: Failed to send UID FETCH command for message headers." << endl;
+                return false;
+            }
+
+            HeaderFetchParser parser(tag, [&](int uid, long size, string_view header) {
+                archive.add(uid, size, header);
+                onMessage(uid, header);
+            });
+            bool complete = false;
+            while (!complete) {
+                int bytesReceived = receive(buffer, sizeof(buffer));
+                if (bytesReceived <= 0) {
+                    cerr << "Error: Could not receive message headers from server." << endl;
+                    archive.flush();
+                    return false;
+                }
+                complete = parser.feed(buffer, bytesReceived);
+            }
+            if (!parser.succeeded()) {
+                cerr << "Error: Server returned NO response for UID FETCH command." << endl;
+                archive.flush();
+                return false;
+            }
+        }
+
+        if (!archive.flush()) {
+            cerr << "Error: Could not write the header archive." << endl;
+            return false;
+        }
+    }
+    return true;
+}
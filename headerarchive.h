@@ -0,0 +1,92 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#ifndef HEADERARCHIVE_H
+#define HEADERARCHIVE_H
+
+#include "utils.h"
+#include <chrono>
+#include <functional>
+
+// Number of UIDs requested by one bulk command, the archive is flushed after each of them
+const size_t HEADER_BATCH_UIDS = 10000;
+
+/**
+ * Consolidated headers of one mailbox for the bulk headers-only mode: headers.jsonl holds one JSON record
+ * per message and is only ever appended to, headers.idx maps every UID to the offset and length of its record.
+ * The index starts with the UIDVALIDITY; if it changed, both files are started anew.
+ */
+class HeaderArchive {
+public:
+    // Opens the archive of a mailbox directory and loads the UIDs already stored
+    HeaderArchive(const string &dir, int uidvalidity);
+    ~HeaderArchive();
+
+    // True if the files could be opened
+    bool isOpen() const { return recordsFd >= 0 && indexFd >= 0; }
+
+    // True if the headers of the message are already stored
+    bool contains(int uid) const { return stored.count(uid) > 0; }
+
+    // Formats the record of a message from its raw header fields and queues it for writing
+    void add(int uid, long messageSize, string_view header);
+
+    // Writes the queued records, then their index entries, and flushes both to disk
+    bool flush();
+
+private:
+    string dir;
+    int recordsFd = -1;
+    int indexFd = -1;
+    size_t recordsEnd = 0;                  // Size of headers.jsonl including the queued records
+    string records;                         // Queued records
+    string indexEntries;                    // Queued index entries
+    unordered_set<int> stored;
+};
+
+/**
+ * Incremental parser for the responses of a bulk UID FETCH of header fields. Chunks are fed as they are
+ * received and every complete FETCH response is handed over, so the mailbox is never held in memory.
+ */
+class HeaderFetchParser {
+public:
+    // Called with the UID, RFC822.SIZE (-1 if missing) and header literal of every FETCH response
+    using MessageCallback = function<void(int uid, long size, string_view header)>;
+
+    HeaderFetchParser(const string &tag, MessageCallback callback);
+
+    // Feeds the next received chunk, returns true once the tagged completion line has been parsed
+    bool feed(const char *data, size_t length);
+
+    // True if the server completed the command with OK
+    bool succeeded() const { return status == "OK"; }
+
+private:
+    void handleResponse(string_view response);
+
+    string tag;
+    MessageCallback callback;
+    string status;
+    string pending;                         // Unparsed tail of the previous chunks
+};
+
+/**
+ * Fetches the header fields and sizes of the messages with as few UID FETCH commands as possible
+ * (BODY.PEEK, so the messages stay unseen) and appends them to the archive.
+ * @param archive - The header archive of the mailbox.
+ * @param uids - The UIDs of the messages, those already in the archive are skipped.
+ * @param send - Sends a complete command (plain or TLS connection).
+ * @param receive - Receives the next chunk of data.
+ * @param deadline - No further commands are sent after the deadline.
+ * @param onMessage - Called for every stored message with its UID and header, e.g. to index it.
+ * @return - Returns true if all commands completed, false on a connection or server error.
+ */
+bool fetchHeaderArchive(HeaderArchive &archive, const vector<int> &uids, const function<int(const string &)> &send,
+                        const function<int(char *, size_t)> &receive, chrono::steady_clock::time_point deadline,
+                        const function<void(int uid, string_view header)> &onMessage);
+
+#endif // HEADERARCHIVE_H
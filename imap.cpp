@@ -6,90 +6,81 @@
 **************************/
 
 #include "imap.h"
-
-bool connectToServer(int &sockfd, const string &server, int port) {
-    // Create a socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+#include "mime.h"
+#include "pipeline.h"
+#include "session.h"
+#include "transcript.h"
+
+bool connectToServer(int &sockfd, const string &server, int port, int connectTimeoutMs, int commandTimeoutMs) {
+    // Race the IPv6 and IPv4 addresses of the server
+    sockfd = connectHappyEyeballs(server, port, connectTimeoutMs);
     if (sockfd < 0) {
-        cerr << "Error: Could not create socket" << endl;
-        return 1;
-    }
-
-    // Prepare hints for getaddrinfo
-    struct addrinfo hints, *res;
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;         // Use IPv4
-    hints.ai_socktype = SOCK_STREAM;   // Use TCP
-
-    string portStr = to_string(port);
-
-    // Get the server address info
-    if (getaddrinfo(server.c_str(), portStr.c_str(), &hints, &res) != 0) {
-        cerr << "Není možné ověřit identitu serveru " << server << endl;
         return false;
     }
 
-    // Connect to the server
-    if (connect(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
-        cerr << "Není možné se připojit k serveru " << server << " na portu " << port << endl;
-        freeaddrinfo(res);
-        return false;
-    }
-    
-    freeaddrinfo(res);
+    // The greeting is the first response that has to arrive in time
+    setCommandTimeout(commandTimeoutMs);
+    armCommandDeadline();
     return true;
 }
 
-bool authenticate(int sockfd, const string &username, const string &password) {
-    // Buffer to receive the server response
-    char buffer[1024];
-    memset(buffer, 0, sizeof(buffer));
-
-    // Read and check the initial server greeting
-    int bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived < 0) {
-        cerr << "Error: Unable to read server greeting." << endl;
-        return false;
+int sendCommand(int sockfd, const string &command) {
+    recordSent(command);
+    if (replaying()) {
+        return replaySend(command) ? static_cast<int>(command.length()) : -1;
     }
-
-    // Confirm that the server sent an "OK" in the greeting
-    if (strstr(buffer, "OK") == NULL) {
-        cerr << "Error: Server does not support IMAP or is not ready." << endl;
-        return false;
+    armCommandDeadline();
+    size_t sent = 0;
+    while (sent < command.length()) {
+        ssize_t bytesSent = send(sockfd, command.data() + sent, command.length() - sent, 0);
+        if (bytesSent >= 0) {
+            sent += bytesSent;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            int ready = waitForSocket(sockfd, POLLOUT);
+            if (ready <= 0) {
+                return ready == IO_TIMEOUT ? IO_TIMEOUT : -1;
+            }
+        } else if (errno != EINTR) {
+            return -1;
+        }
     }
+    return sent;
+}
 
-    // Send the LOGIN command
-    string tag = generateTag();
-    string loginCommand = tag + " LOGIN" + username + password + "\r\n";
-
-    if (send(sockfd, loginCommand.c_str(), loginCommand.length(), 0) < 0) {
-        cerr << "Error: Failed to send authentication command." << endl;
-        return false;
+int receiveData(int sockfd, char *buffer, size_t length) {
+    if (replaying()) {
+        return replayReceive(buffer, length);
     }
-
-    // Receive the server response for authentication
-    memset(buffer, 0, sizeof(buffer));
-    bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived < 0) {
-        cerr << "Error: Unable to receive server response after LOGIN." << endl;
-        return false;
+    while (true) {
+        ssize_t bytesReceived = recv(sockfd, buffer, length, 0);
+        if (bytesReceived >= 0) {
+            // The deadline bounds the silence of the server, a long response keeps it going
+            armCommandDeadline();
+            recordReceived(buffer, bytesReceived);
+            return bytesReceived;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            int ready = waitForSocket(sockfd, POLLIN);
+            if (ready <= 0) {
+                return ready == IO_TIMEOUT ? IO_TIMEOUT : -1;
+            }
+        } else if (errno != EINTR) {
+            return -1;
+        }
     }
+}
 
-
-    // Check for the "OK" response
-    if (strstr(buffer, "OK") != NULL) {
-        return true;
-    } else {
-        cerr << "Authentification of user" << username << " was NOT succesful." << endl;
-        return false;
-    }
+bool authenticate(int sockfd, const string &username, const string &password, string &capabilities) {
+    return authenticateSession([&](const string &command) { return sendCommand(sockfd, command); },
+                               [&](char *buffer, size_t length) { return receiveData(sockfd, buffer, length); },
+                               username, password, capabilities);
 }
 
 bool logout(int sockfd) {
     string tag = generateTag();
     string logoutCommand = tag + " LOGOUT\r\n";
 
-    if (send(sockfd, logoutCommand.c_str(), logoutCommand.length(), 0) < 0) {
+    if (sendCommand(sockfd, logoutCommand) < 0) {
         cerr << "Error: Failed to send LOGOUT command to the server." << endl;
         return false;
     }
@@ -98,7 +89,7 @@ bool logout(int sockfd) {
     memset(buffer, 0, sizeof(buffer));
 
     // Receive the server's response to LOGOUT
-    int bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
+    int bytesReceived = receiveData(sockfd, buffer, sizeof(buffer) - 1);
     if (bytesReceived < 0) {
         cerr << "Error: Could not receive server response for LOGOUT." << endl;
         return false;
@@ -112,12 +103,12 @@ bool logout(int sockfd) {
     }
 }
 
-int selectMailbox(int sockfd, const string &mailbox) {
+int selectMailbox(int sockfd, const string &mailbox, long &messageCount) {
     string tag = generateTag();
     string selectCommand = tag + " SELECT " + mailbox + "\r\n";
 
     // Send the SELECT command to choose the mailbox
-    int bytesSent = send(sockfd, selectCommand.c_str(), selectCommand.length(), 0);
+    int bytesSent = sendCommand(sockfd, selectCommand);
     if (bytesSent < 0) {
         cerr << "Error: Failed to send SELECT command." << endl;
         return -1;
@@ -127,7 +118,7 @@ int selectMailbox(int sockfd, const string &mailbox) {
     memset(buffer, 0, sizeof(buffer));
 
     // Read the response from the server
-    int bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
+    int bytesReceived = receiveData(sockfd, buffer, sizeof(buffer) - 1);
     if (bytesReceived < 0) {
         cerr << "Error: Could not receive SELECT response from server." << endl;
         return -1;
@@ -140,6 +131,7 @@ int selectMailbox(int sockfd, const string &mailbox) {
 
     string response;
     response.assign(buffer, bytesReceived);
+    messageCount = parseMessageCount(response);
 
     regex uidvalidity_regex(R"(UIDVALIDITY (\d+))");
     smatch match;
@@ -156,120 +148,228 @@ int selectMailbox(int sockfd, const string &mailbox) {
     return -1;
 }
 
-vector<int> searchMessages(int sockfd, bool newMessagesOnly) {
+bool searchMessages(int sockfd, const string &criteria, vector<int> &uids, bool useESearch, long messageCount) {
     string tag = generateTag();
-    string searchCommand = tag + " UID SEARCH " + (newMessagesOnly ? "UNSEEN" : "ALL") + "\r\n";
+    string searchCommand = tag + " UID SEARCH " + (useESearch ? "RETURN (ALL) " : "") + criteria + "\r\n";
 
     // Send the UID SEARCH command to the server
-    if (send(sockfd, searchCommand.c_str(), searchCommand.length(), 0) < 0) {
+    if (sendCommand(sockfd, searchCommand) < 0) {
         cerr << "Error: Could not send SEARCH command." << endl;
-        return {};
+        return false;
     }
 
-    // Buffer to receive the search results
-    char buffer[8192];
-    memset(buffer, 0, sizeof(buffer));
+    // Parse the UIDs chunk by chunk until the tagged completion line arrives
+    SearchResponseParser parser(tag, messageCount);
+    char buffer[65536];
+    bool complete = false;
 
-    // Read the response from the server
-    int bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived < 0) {
-        cerr << "Error: Could not receive response for SEARCH command." << endl;
-        return {};
+    while (!complete) {
+        int bytesReceived = receiveData(sockfd, buffer, sizeof(buffer));
+        if (bytesReceived <= 0) {
+            cerr << "Error: Could not receive response for SEARCH command." << endl;
+            return false;
+        }
+        complete = parser.feed(buffer, bytesReceived);
     }
 
-    string response(buffer);
-    vector<int> messageUIDs;
-    size_t searchPos = response.find("* SEARCH");
+    if (!parser.succeeded()) {
+        if (!parser.resultInvalid()) {
+            cerr << "Error: Server returned NO response for SEARCH command." << endl;
+        }
+        return false;
+    }
+    uids = move(parser.uids);
+    return true;
+}
 
-    if (searchPos != string::npos) {
-        // Locate the start and end of the UIDs list
-        size_t start = searchPos + 8;  // Skip "* SEARCH "
-        size_t end = response.find("\r\n", start);
+bool getMailboxStatus(int sockfd, const string &mailbox, const string &capabilities, MailboxStatus &status) {
+    string tag = generateTag();
+    string statusCommand = buildStatusCommand(tag, mailbox, capabilities);
+    if (statusCommand.empty()) {
+        return false;
+    }
+    if (sendCommand(sockfd, statusCommand) <= 0) {
+        cerr << "Error: Failed to send STATUS command." << endl;
+        return false;
+    }
 
-        // Extract the UIDs as a single string
-        if (start < end) {
-            string uidsStr = response.substr(start, end - start);
+    string response;
+    if (!readIMAPResponse(sockfd, response, tag)) {
+        cerr << "Error: Could not receive STATUS response from server." << endl;
+        return false;
+    }
+    // A mailbox that does not exist is reported by SELECT
+    return parseMailboxStatus(response, status);
+}
 
-            // Split the UIDs string into individual UIDs
-            istringstream uidStream(uidsStr);
-            int uid;
-            while (uidStream >> uid) {
-                messageUIDs.push_back(uid);
-            }
+string getCapabilities(int sockfd) {
+    string tag = generateTag();
+    string capabilityCommand = tag + " CAPABILITY\r\n";
+
+    if (sendCommand(sockfd, capabilityCommand) < 0) {
+        cerr << "Error: Failed to send CAPABILITY command." << endl;
+        return "";
+    }
+
+    string response;
+    if (!readIMAPResponse(sockfd, response, tag)) {
+        cerr << "Error: Could not receive CAPABILITY response from server." << endl;
+        return "";
+    }
+    return parseCapabilities(response);
+}
+
+bool readIMAPResponse(int sockfd, string &response, const string &tag) {
+    char buffer[4096];
+    size_t scanPos = 0;
+    response.clear();
+
+    while (!hasTaggedCompletion(response, tag, scanPos)) {
+        int bytesReceived = receiveData(sockfd, buffer, sizeof(buffer));
+        if (bytesReceived <= 0) {
+            return false;
         }
-    } else {
-        cerr << "Error: '* SEARCH' not found in the response." << endl;
+        response.append(buffer, bytesReceived);
+    }
+    return true;
+}
+
+bool fetchAndSaveMessage(int sockfd, int messageUID, const string &outDir, bool headersOnly, string mailbox, string server, long partialBytes,
+                         bool saveAttachments) {
+    // The same commands and saving as in the pipeline, one command at a time
+    vector<string> responses;
+    for (size_t command = 0; command < messageFetchCommandCount(headersOnly); command++) {
+        string tag = generateTag();
+        string fetchCommand = tag + " ";
+        appendMessageFetchCommand(fetchCommand, messageUID, command, partialBytes, saveAttachments);
+        if (sendCommand(sockfd, fetchCommand + "\r\n") < 0) {
+            cerr << "Error: Failed to send UID FETCH command for message " << messageUID << "." << endl;
+            return false;
+        }
+
+        string response;
+        if (!readIMAPResponse(sockfd, response, tag)) {
+            cerr << "Error: Could not receive response for message " << messageUID << " from server." << endl;
+            return false;
+        }
+        responses.push_back(move(response));
+    }
+    MessagePaths paths(outDir + "/" + server + "/" + mailbox);
+    return saveFetchedMessage(messageUID, vector<string_view>(responses.begin(), responses.end()), paths, headersOnly, partialBytes, saveAttachments);
+}
+
+unordered_map<int, long> fetchMessageSizes(int sockfd, const vector<int> &uids) {
+    unordered_map<int, long> sizes;
+
+    // One UID FETCH per sequence-set, so the size of the whole batch costs a single round trip
+    for (const string &uidSet : buildSequenceSets(uids)) {
+        string tag = generateTag();
+        string sizeCommand = tag + " UID FETCH " + uidSet + " (RFC822.SIZE)\r\n";
+
+        if (sendCommand(sockfd, sizeCommand) < 0) {
+            cerr << "Error: Failed to send UID FETCH command for message sizes." << endl;
+            return sizes;
+        }
+
+        string response;
+        if (!readIMAPResponse(sockfd, response, tag)) {
+            cerr << "Error: Could not receive message sizes from server." << endl;
+            return sizes;
+        }
+        parseMessageSizes(response, sizes);
     }
-    return messageUIDs;
+    return sizes;
 }
 
-bool fetchAndSaveMessage(int sockfd, int messageUID, const string &outDir, bool headersOnly, string mailbox, string server) {
+bool fetchAndSaveMessageText(int sockfd, int messageUID, const string &outDir, const string &mailbox, const string &server) {
     string tag = generateTag();
 
-    // Buffer to receive the message
-    char buffer[16384];
-    memset(buffer, 0, sizeof(buffer));
+    // Fetch the structure together with the header, so skipping the attachments costs no extra round trip
+    string fetchStructureCommand = tag + " UID FETCH " + to_string(messageUID) +
+                                   " (BODYSTRUCTURE BODY[HEADER.FIELDS (DATE FROM TO SUBJECT MESSAGE-ID)])\r\n";
 
-    string fetchHeaderCommand = tag + " UID FETCH " + to_string(messageUID) + 
-                                " BODY[HEADER.FIELDS (DATE FROM TO SUBJECT MESSAGE-ID)]\r\n";
+    if (sendCommand(sockfd, fetchStructureCommand) < 0) {
+        cerr << "Error: Failed to send UID FETCH command for structure of message " << messageUID << "." << endl;
+        return false;
+    }
 
-    if (send(sockfd, fetchHeaderCommand.c_str(), fetchHeaderCommand.length(), 0) < 0) {
-        cerr << "Error: Failed to send UID FETCH command for headers of message " << messageUID << "." << endl;
+    string headerResponse;
+    if (!readIMAPResponse(sockfd, headerResponse, tag)) {
+        cerr << "Error: Could not receive structure of message " << messageUID << " from server." << endl;
         return false;
     }
 
-    // Read the header response from the server
-    int bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived < 0) {
-        cerr << "Error: Could not receive header response for message " << messageUID << " from server." << endl;
+    vector<MimePart> parts = parseBodyStructure(headerResponse);
+    if (parts.empty()) {
+        cerr << "Error: Could not parse BODYSTRUCTURE of message " << messageUID << "." << endl;
         return false;
     }
 
-    // Save the header response as a string
-    string headerResponse;
-    headerResponse.assign(buffer, bytesReceived);
+    // Download only the text/plain and text/html parts
+    string textResponse;
+    string textItems = buildTextFetchItems(parts);
+    if (!textItems.empty()) {
+        tag = generateTag();
+        string fetchTextCommand = tag + " UID FETCH " + to_string(messageUID) + " " + textItems + "\r\n";
 
-    // If only headers are requested, save and return
-    if (headersOnly) {
-        ofstream outFile(outDir + "/" + server + "/" + mailbox + "/message_uid_" + to_string(messageUID) + ".eml");
-        if (!outFile) {
-            cerr << "Error: Could not open file to save message " << messageUID << "." << endl;
+        if (sendCommand(sockfd, fetchTextCommand) < 0) {
+            cerr << "Error: Failed to send UID FETCH command for text of message " << messageUID << "." << endl;
+            return false;
+        }
+        if (!readIMAPResponse(sockfd, textResponse, tag)) {
+            cerr << "Error: Could not receive text of message " << messageUID << " from server." << endl;
             return false;
         }
-        outFile << formatToRFC5322(headerResponse, true);
-        outFile.close();
-        return true;
     }
 
-    // Fetch the body text separately
-    tag = generateTag();
-    string fetchBodyCommand = tag + " UID FETCH " + to_string(messageUID) + " BODY[1]\r\n";
-
-    if (send(sockfd, fetchBodyCommand.c_str(), fetchBodyCommand.length(), 0) < 0) {
-        cerr << "Error: Failed to send UID FETCH command for body of message " << messageUID << "." << endl;
+    if (!saveTextAndStubs(outDir + "/" + server + "/" + mailbox + "/message_uid_" + to_string(messageUID), headerResponse, textResponse, parts)) {
+        cerr << "Error: Could not open file to save message " << messageUID << "." << endl;
         return false;
     }
+    return true;
+}
 
-    // Read the body response from the server
-    bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived < 0) {
-        cerr << "Error: Could not receive body response for message " << messageUID << " from server." << endl;
+bool fetchAndSavePart(int sockfd, int messageUID, const string &section, const string &outDir, const string &mailbox, const string &server,
+                      bool decode, bool binary) {
+    string dir = outDir + "/" + server + "/" + mailbox + "/";
+    MimePart stub = readStub(dir + "message_uid_" + to_string(messageUID), section);
+    string partPath = dir + partFileName(messageUID, section, stub.name);
+
+    // A server with BINARY decodes the part itself, so it does not travel base64-encoded
+    if (decode && binary) {
+        auto send = [sockfd](const string &command) { return sendCommand(sockfd, command); };
+        auto receive = [sockfd](char *buffer, size_t length) { return receiveData(sockfd, buffer, length); };
+        BinaryFetchResult result = fetchBinaryPart(send, receive, messageUID, section, partPath);
+        if (result != BinaryFetchResult::Unsupported) {
+            return result == BinaryFetchResult::Saved;
+        }
+    }
+
+    string tag = generateTag();
+    string fetchPartCommand = tag + " UID FETCH " + to_string(messageUID) + " BODY.PEEK[" + section + "]\r\n";
+
+    if (sendCommand(sockfd, fetchPartCommand) < 0) {
+        cerr << "Error: Failed to send UID FETCH command for part " << section << " of message " << messageUID << "." << endl;
         return false;
     }
 
-    // Save the body response as a string
-    string bodyResponse;
-    bodyResponse.assign(buffer, bytesReceived);
+    string response, data;
+    if (!readIMAPResponse(sockfd, response, tag)) {
+        cerr << "Error: Could not receive part " << section << " of message " << messageUID << " from server." << endl;
+        return false;
+    }
+    if (!extractFetchLiteral(response, "BODY[" + section + "]", data)) {
+        cerr << "Error: Part " << section << " of message " << messageUID << " not found." << endl;
+        return false;
+    }
 
-    // Save the message to a file in the specified directory
-    ofstream outFile(outDir + "/" + server + "/" + mailbox + "/message_uid_" + to_string(messageUID) + ".eml");
+    ofstream outFile(partPath, ios::binary);
     if (!outFile) {
-        cerr << "Error: Could not open file to save message " << messageUID << "." << endl;
+        cerr << "Error: Could not open file to save part " << section << " of message " << messageUID << "." << endl;
         return false;
     }
-
-    outFile << "\r\n" + formatToRFC5322(headerResponse, true) + "\r\n" + formatToRFC5322(bodyResponse, false);
+    // The transfer encoding is known from the stub written in the lazy attachment mode
+    outFile << (decode ? decodeTransferEncoding(data, stub.encoding) : data);
     outFile.close();
-
     return true;
 }
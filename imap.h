@@ -17,6 +17,7 @@
 #include <iomanip>
 #include <map>
 #include "utils.h"
+#include "net.h"
 
 using namespace std;
 
@@ -25,18 +26,39 @@ using namespace std;
  * @param sockfd - Reference to the socket file descriptor.
  * @param server - The domain name or IP address of the server.
  * @param port - The port number to connect to.
+ * @param connectTimeoutMs - Deadline for connecting in milliseconds; IPv6 and IPv4 addresses are raced (happy eyeballs).
+ * @param commandTimeoutMs - Time the server has to complete each command in milliseconds, 0 disables it.
  * @return - Returns true if the connection is successful, false otherwise.
  */
-bool connectToServer(int &sockfd, const string &server, int port);
+bool connectToServer(int &sockfd, const string &server, int port, int connectTimeoutMs = DEFAULT_CONNECT_TIMEOUT_MS, int commandTimeoutMs = 0);
 
 /**
- * Authenticates the user by sending an IMAP LOGIN command to the server.
+ * Sends a command over the non-blocking socket and starts its deadline.
+ * @param sockfd - The socket file descriptor.
+ * @param command - The complete command including the CRLF.
+ * @return - The number of bytes sent, IO_TIMEOUT if the deadline passed, or -1 on error.
+ */
+int sendCommand(int sockfd, const string &command);
+
+/**
+ * Receives data from the non-blocking socket, waiting at most until the deadline of the current command.
+ * @param sockfd - The socket file descriptor.
+ * @param buffer - The buffer to store the data.
+ * @param length - The size of the buffer.
+ * @return - The number of bytes received, 0 if the server closed the connection, IO_TIMEOUT if the deadline passed, or -1 on error.
+ */
+int receiveData(int sockfd, char *buffer, size_t length);
+
+/**
+ * Authenticates the user with AUTHENTICATE PLAIN (with the initial response if the server supports SASL-IR)
+ * or LOGIN, see authenticateSession.
  * @param sockfd - The socket file descriptor for the connection.
  * @param username - The username to authenticate with.
  * @param password - The password for the specified username.
+ * @param capabilities - The capabilities announced with the result, empty if the server did not announce them.
  * @return - Returns true if authentication is successful, false otherwise.
  */
-bool authenticate(int sockfd, const string &username, const string &password);
+bool authenticate(int sockfd, const string &username, const string &password, string &capabilities);
 
 /**
  * Logs out the user from the IMAP server by sending a LOGOUT command.
@@ -49,17 +71,48 @@ bool logout(int sockfd);
  * Selects a specific mailbox on the server using the IMAP SELECT command.
  * @param sockfd - The socket file descriptor for the connection.
  * @param mailbox - The name of the mailbox to select (e.g., "INBOX").
+ * @param messageCount - Set to the number of messages from the EXISTS response, -1 if the response has none.
  * @return - Returns UIDVALIDITY number, -1 otherwise.
  */
-int selectMailbox(int sockfd, const string &mailbox);
+int selectMailbox(int sockfd, const string &mailbox, long &messageCount);
 
 /**
  * Searches for email messages in the currently selected mailbox based on the specified criteria.
+ * The result is parsed while it is being received, so there is no limit on the number of UIDs.
+ * @param sockfd - The socket file descriptor for the connection.
+ * @param criteria - The search criteria built by buildSearchCriteria (e.g. "ALL" or "UNSEEN SINCE 1-Jan-2024").
+ * @param uids - The UIDs of the messages that match the search criteria.
+ * @param useESearch - If true, requests the compact ESEARCH result form (RFC 4731).
+ * @param messageCount - The number of messages in the mailbox that bounds the result, -1 if not known.
+ * @return - Returns true if the search succeeded, false otherwise.
+ */
+bool searchMessages(int sockfd, const string &criteria, vector<int> &uids, bool useESearch = false, long messageCount = -1);
+
+/**
+ * Asks for the counters of a mailbox with STATUS, without selecting it.
+ * @param sockfd - The socket file descriptor for the connection.
+ * @param mailbox - The mailbox name.
+ * @param capabilities - The capabilities of the server, they decide the form of the name and the counters asked for.
+ * @param status - The counters of the mailbox.
+ * @return - Returns true if the status was received, false otherwise (also if the name needs a synchronizing literal).
+ */
+bool getMailboxStatus(int sockfd, const string &mailbox, const string &capabilities, MailboxStatus &status);
+
+/**
+ * Asks the server for its capabilities using the CAPABILITY command.
+ * @param sockfd - The socket file descriptor for the connection.
+ * @return - The space separated capability list, or an empty string on failure.
+ */
+string getCapabilities(int sockfd);
+
+/**
+ * Reads the server response until the tagged completion line of the given command is received.
  * @param sockfd - The socket file descriptor for the connection.
- * @param newMessagesOnly - If true, only searches for new (unread) messages.
- * @return - A vector of integers representing the IDs of the messages that match the search criteria.
+ * @param response - The string to store the server response.
+ * @param tag - The tag of the command the response belongs to.
+ * @return - Returns true if successful, false otherwise.
  */
-vector<int> searchMessages(int sockfd, bool newMessagesOnly);
+bool readIMAPResponse(int sockfd, string &response, const string &tag);
 
 /**
  * Fetches and saves a specific email message to a file in the specified output directory.
@@ -67,8 +120,46 @@ vector<int> searchMessages(int sockfd, bool newMessagesOnly);
  * @param messageID - The unique ID of the message to fetch.
  * @param outDir - The output directory where the message should be saved.
  * @param headersOnly - If true, only fetches and saves the headers of the message.
+ * @param partialBytes - If positive, only the first partialBytes of the body are saved (BODY.PEEK[1]<0.N>, or BODY.PEEK[TEXT]<0.N> with attachments).
+ * @param saveAttachments - If true, the complete message is saved and its attachments are decoded next to it.
+ * @return - Returns true if the message is fetched and saved successfully, false otherwise.
+ */
+bool fetchAndSaveMessage(int sockfd, int messageID, const string &outDir, bool headersOnly, string mailbox, string server, long partialBytes = 0,
+                         bool saveAttachments = false);
+
+/**
+ * Fetches RFC822.SIZE of the given messages using as few UID FETCH commands as possible.
+ * @param sockfd - The socket file descriptor for the connection.
+ * @param uids - The UIDs of the messages.
+ * @return - A map of message sizes in bytes keyed by UID.
+ */
+unordered_map<int, long> fetchMessageSizes(int sockfd, const vector<int> &uids);
+
+/**
+ * Fetches the BODYSTRUCTURE of a message and saves only its header and text/plain and text/html parts.
+ * Attachments are described in a stub file next to the message and can be fetched later with fetchAndSavePart.
+ * @param sockfd - The socket file descriptor for the connection.
+ * @param messageUID - The UID of the message to fetch.
+ * @param outDir - The output directory where the message should be saved.
+ * @param mailbox - The mailbox name.
+ * @param server - The server name.
  * @return - Returns true if the message is fetched and saved successfully, false otherwise.
  */
-bool fetchAndSaveMessage(int sockfd, int messageID, const string &outDir, bool headersOnly, string mailbox, string server);
+bool fetchAndSaveMessageText(int sockfd, int messageUID, const string &outDir, const string &mailbox, const string &server);
+
+/**
+ * Fetches a single part of a message (e.g. an attachment skipped by fetchAndSaveMessageText) and saves it.
+ * @param sockfd - The socket file descriptor for the connection.
+ * @param messageUID - The UID of the message.
+ * @param section - The part specifier, e.g. "2" or "1.3".
+ * @param outDir - The output directory where the part should be saved.
+ * @param mailbox - The mailbox name.
+ * @param server - The server name.
+ * @param decode - If true, the part is decoded using the transfer encoding recorded in its stub.
+ * @param binary - If true (the server supports BINARY), a part to be decoded is fetched decoded by the server.
+ * @return - Returns true if the part is fetched and saved successfully, false otherwise.
+ */
+bool fetchAndSavePart(int sockfd, int messageUID, const string &section, const string &outDir, const string &mailbox, const string &server,
+                      bool decode = false, bool binary = false);
 
 #endif // IMAP_H
\ No newline at end of file
@@ -6,6 +6,12 @@
 **************************/
 
 #include "imaps.h"
+#include "mime.h"
+#include "pipeline.h"
+#include "session.h"
+#include "transcript.h"
+#include <fcntl.h>
+#include <sys/uio.h>
 
 SSL_CTX *initializeSSL(const string &certFile, const string &certDir) {
     SSL_CTX *ctx = nullptr;
@@ -55,12 +61,19 @@ SSL_CTX *initializeSSL(const string &certFile, const string &certDir) {
     return ctx;
 }
 
-BIO* connectToServerBIO(SSL_CTX *ctx, const string &server, int port) {
-    string serverPort = server + ":" + to_string(port);
+BIO* connectToServerBIO(SSL_CTX *ctx, const string &server, int port, int connectTimeoutMs, int commandTimeoutMs, bool kernelTls) {
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(connectTimeoutMs);
 
-    BIO *bio = BIO_new_ssl_connect(ctx);
+    // Race the IPv6 and IPv4 addresses of the server, TLS is negotiated on the winning socket
+    int sockfd = connectHappyEyeballs(server, port, connectTimeoutMs);
+    if (sockfd < 0) {
+        return nullptr;
+    }
+
+    BIO *bio = BIO_new_ssl(ctx, 1);
     if (!bio) {
         cerr << "Error: Could not create BIO object." << endl;
+        close(sockfd);
         return nullptr;
     }
     SSL *ssl = nullptr;
@@ -69,85 +82,125 @@ BIO* connectToServerBIO(SSL_CTX *ctx, const string &server, int port) {
     if (!ssl) {
         cerr << "Error: Could not retrieve SSL object from BIO." << endl;
         BIO_free_all(bio);
+        close(sockfd);
         return nullptr;
     }
     SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
+#ifdef SSL_OP_ENABLE_KTLS
+    // Let the kernel take over the record layer after the handshake if it supports the negotiated cipher
+    if (kernelTls) {
+        SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+
+    // Send the hostname (SNI) so that virtual hosts present the right certificate
+    SSL_set_tlsext_host_name(ssl, server.c_str());
+
+    BIO *socketBio = BIO_new_socket(sockfd, BIO_CLOSE);
+    if (!socketBio) {
+        cerr << "Error: Could not create BIO object." << endl;
+        BIO_free_all(bio);
+        close(sockfd);
+        return nullptr;
+    }
+    BIO_push(bio, socketBio);
 
-    // Set the hostname and port
-    BIO_set_conn_hostname(bio, serverPort.c_str());
-    
     long certVerificationResult = SSL_get_verify_result(ssl);
     if (certVerificationResult != X509_V_OK) {
         cerr << "Warning: Certificate verification failed: " << X509_verify_cert_error_string(certVerificationResult) << endl;
     }
 
-    // Attempt to connect to the server and establish an SSL/TLS session
-    if (BIO_do_connect(bio) <= 0) {
-        cerr << "Error: Could not connect to server at " << serverPort << "." << endl;
-        ERR_print_errors_fp(stderr);
-        BIO_free_all(bio);
-        return nullptr;
+    // Run the handshake on the non-blocking socket so it shares the connect deadline
+    int result;
+    while ((result = SSL_connect(ssl)) <= 0) {
+        int error = SSL_get_error(ssl, result);
+        if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+            cerr << "Error: Could not connect to server at " << server << ":" << port << "." << endl;
+            ERR_print_errors_fp(stderr);
+            BIO_free_all(bio);
+            return nullptr;
+        }
+        pollfd handshake = {sockfd, static_cast<short>(error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT), 0};
+        if (poll(&handshake, 1, remainingMs(deadline)) <= 0) {
+            cerr << "Error: TLS handshake with " << server << ":" << port << " timed out after " << connectTimeoutMs << " ms." << endl;
+            BIO_free_all(bio);
+            return nullptr;
+        }
     }
 
+    // The greeting is the first response that has to arrive in time
+    setCommandTimeout(commandTimeoutMs);
+    armCommandDeadline();
     return bio;
 }
 
-bool authenticateBIO(BIO *bio, const string &username, const string &password) {
-    // Buffer to receive the server response
-    char buffer[1024];
-    memset(buffer, 0, sizeof(buffer));
-
+// Waits until a BIO that asked for a retry can make progress, in the direction the TLS layer needs
+static int waitForBIO(BIO *bio) {
+    return waitForSocket(BIO_get_fd(bio, nullptr), BIO_should_write(bio) ? POLLOUT : POLLIN);
+}
 
-    // Read and check the initial server greeting using BIO_read
-    int bytesReceived = BIO_read(bio, buffer, sizeof(buffer) - 1);
-    if (bytesReceived <= 0) {
-        cerr << "Error: Unable to read server greeting." << endl;
-        ERR_print_errors_fp(stderr);
-        return false;
+int sendCommandBIO(BIO *bio, const string &command) {
+    recordSent(command);
+    if (replaying()) {
+        return replaySend(command) ? static_cast<int>(command.length()) : -1;
     }
-
-    // Confirm that the server sent an "OK" in the greeting
-    if (strstr(buffer, "OK") == NULL) {
-        cerr << "Error: Server does not support IMAP or is not ready." << endl;
-        return false;
+    armCommandDeadline();
+    size_t sent = 0;
+    while (sent < command.length()) {
+        int bytesSent = BIO_write(bio, command.data() + sent, command.length() - sent);
+        if (bytesSent > 0) {
+            sent += bytesSent;
+            continue;
+        }
+        if (!BIO_should_retry(bio)) {
+            return -1;
+        }
+        int ready = waitForBIO(bio);
+        if (ready <= 0) {
+            return ready;
+        }
     }
+    return sent;
+}
 
-    // Generate the login command using a unique tag
-    string tag = generateTag();
-    string loginCommand = tag + " LOGIN " + username + " " + password + "\r\n";
-
-    // Send the LOGIN command using BIO_write
-    int bytesSent = BIO_write(bio, loginCommand.c_str(), loginCommand.length());
-    if (bytesSent <= 0) {
-        cerr << "Error: Failed to send authentication command." << endl;
-        ERR_print_errors_fp(stderr);
-        return false;
+int receiveDataBIO(BIO *bio, char *buffer, int length) {
+    if (replaying()) {
+        return replayReceive(buffer, length);
     }
-
-    // Receive the server response for authentication using BIO_read
-    memset(buffer, 0, sizeof(buffer));
-    bytesReceived = BIO_read(bio, buffer, sizeof(buffer) - 1);
-    if (bytesReceived <= 0) {
-        cerr << "Error: Unable to receive server response after LOGIN." << endl;
-        ERR_print_errors_fp(stderr);
-        return false;
+    while (true) {
+        int bytesRead = BIO_read(bio, buffer, length);
+        if (bytesRead > 0) {
+            // The deadline bounds the silence of the server, a long response keeps it going
+            armCommandDeadline();
+            recordReceived(buffer, bytesRead);
+            return bytesRead;
+        }
+        if (!BIO_should_retry(bio)) {
+            return bytesRead;
+        }
+        int ready = waitForBIO(bio);
+        if (ready <= 0) {
+            return ready;
+        }
     }
+}
 
-    // Check for the "OK" response in the received data
-    if (strstr(buffer, "OK LOGIN Authentication succeeded") != NULL) {
-        return true;
-    } else {
-        cerr << "Ověření uživatele" << username << " se nezdařilo." << endl;
-        return false;
+bool authenticateBIO(BIO *bio, const string &username, const string &password, string &capabilities) {
+    bool authenticated = authenticateSession([&](const string &command) { return sendCommandBIO(bio, command); },
+                                             [&](char *buffer, size_t length) { return receiveDataBIO(bio, buffer, length); },
+                                             username, password, capabilities);
+    if (!authenticated) {
+        ERR_print_errors_fp(stderr);
     }
+    return authenticated;
 }
 
-int selectMailboxBIO(BIO *bio, const string &mailbox) {
+int selectMailboxBIO(BIO *bio, const string &mailbox, long &messageCount) {
     string tag = generateTag();
     string selectCommand = tag + " SELECT " + mailbox + "\r\n";
 
     // Send the SELECT command using `BIO_write` for secure IMAPS connections
-    int bytesSent = BIO_write(bio, selectCommand.c_str(), selectCommand.length());
+    int bytesSent = sendCommandBIO(bio, selectCommand);
     if (bytesSent <= 0) {
         cerr << "Error: Failed to send SELECT command." << endl;
         ERR_print_errors_fp(stderr);
@@ -160,6 +213,7 @@ int selectMailboxBIO(BIO *bio, const string &mailbox) {
         ERR_print_errors_fp(stderr);
         return -1;
     }
+    messageCount = parseMessageCount(response);
 
     // Extract the UIDVALIDITY using regex
     regex uidvalidity_regex(R"(UIDVALIDITY (\d+))");
@@ -179,74 +233,106 @@ int selectMailboxBIO(BIO *bio, const string &mailbox) {
 }
 
 
-vector<int> searchMessagesBIO(BIO *bio, bool newMessagesOnly) {
+bool searchMessagesBIO(BIO *bio, const string &criteria, vector<int> &uids, bool useESearch, long messageCount) {
     string tag = generateTag();
-    string searchCommand = tag + " UID SEARCH " + (newMessagesOnly ? "UNSEEN" : "ALL") + "\r\n";
+    string searchCommand = tag + " UID SEARCH " + (useESearch ? "RETURN (ALL) " : "") + criteria + "\r\n";
 
     // Send the UID SEARCH command to the server using BIO_write
-    int bytesSent = BIO_write(bio, searchCommand.c_str(), searchCommand.length());
+    int bytesSent = sendCommandBIO(bio, searchCommand);
     if (bytesSent <= 0) {
         cerr << "Error: Could not send SEARCH command." << endl;
         ERR_print_errors_fp(stderr);
-        return {};
+        return false;
     }
 
-    string response;
+    // Parse the UIDs chunk by chunk until the tagged completion line arrives
+    SearchResponseParser parser(tag, messageCount);
+    char buffer[65536];
+    bool complete = false;
 
-    if (!readIMAPSResponse(bio, response)) {
-        cerr << "Error: Could not receive response for SEARCH command." << endl;
-        ERR_print_errors_fp(stderr);
-        return {};
+    while (!complete) {
+        int bytesRead = receiveDataBIO(bio, buffer, sizeof(buffer));
+        if (bytesRead <= 0) {
+            cerr << "Error: Could not receive response for SEARCH command." << endl;
+            ERR_print_errors_fp(stderr);
+            return false;
+        }
+        complete = parser.feed(buffer, bytesRead);
     }
 
-    if (response.find("NO") != string::npos) {
-        cerr << "Error: Server returned NO response for SEARCH command." << endl;
-        return {};
+    if (!parser.succeeded()) {
+        if (!parser.resultInvalid()) {
+            cerr << "Error: Server returned NO response for SEARCH command." << endl;
+        }
+        return false;
     }
+    uids = move(parser.uids);
+    return true;
+}
 
-    vector<int> messageUIDs;
-    size_t searchPos = response.find("* SEARCH");
-    if (searchPos != string::npos) {
-        // Locate the start and end of the UIDs list
-        size_t start = searchPos + 8;  // Skip "* SEARCH "
-        size_t end = response.find("\r\n", start);
+bool getMailboxStatusBIO(BIO *bio, const string &mailbox, const string &capabilities, MailboxStatus &status) {
+    string tag = generateTag();
+    string statusCommand = buildStatusCommand(tag, mailbox, capabilities);
+    if (statusCommand.empty()) {
+        return false;
+    }
+    if (sendCommandBIO(bio, statusCommand) <= 0) {
+        cerr << "Error: Failed to send STATUS command." << endl;
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
 
-        // Extract the UIDs as a single string
-        if (start < end) {
-            string uidsStr = response.substr(start, end - start);
+    string response;
+    if (!readIMAPSResponse(bio, response, tag)) {
+        cerr << "Error: Could not receive STATUS response from server." << endl;
+        return false;
+    }
+    // A mailbox that does not exist is reported by SELECT
+    return parseMailboxStatus(response, status);
+}
 
-            // Split the UIDs string into individual UIDs
-            istringstream uidStream(uidsStr);
-            int uid;
-            while (uidStream >> uid) {
-                messageUIDs.push_back(uid);
-            }
-        }
-    } else {
-        cerr << "Error: '* SEARCH' not found in the response." << endl;
+string getCapabilitiesBIO(BIO *bio) {
+    string tag = generateTag();
+    string capabilityCommand = tag + " CAPABILITY\r\n";
+
+    if (sendCommandBIO(bio, capabilityCommand) <= 0) {
+        cerr << "Error: Failed to send CAPABILITY command." << endl;
+        ERR_print_errors_fp(stderr);
+        return "";
     }
 
-    return messageUIDs;
+    string response;
+    if (!readIMAPSResponse(bio, response, tag)) {
+        cerr << "Error: Could not receive CAPABILITY response from server." << endl;
+        ERR_print_errors_fp(stderr);
+        return "";
+    }
+    return parseCapabilities(response);
 }
 
-bool readIMAPSResponse(BIO *bio, string &response) {
+bool readIMAPSResponse(BIO *bio, string &response, const string &tag) {
     char buffer[4096];
     int bytesRead = 0;
+    size_t scanPos = 0;
     response.clear();
 
     while (true) {
         // Read the server response incrementally
-        bytesRead = BIO_read(bio, buffer, sizeof(buffer) - 1);
+        bytesRead = receiveDataBIO(bio, buffer, sizeof(buffer) - 1);
         if (bytesRead <= 0) {
-            if (!BIO_should_retry(bio)) {
-                return false;
-            }
-            continue;
+            return false;
         }
 
         // Null-terminate the received data and append to response string
         buffer[bytesRead] = '\0';
         response += buffer;
+        // With a known tag, only the newly received data has to be scanned for the completion line
+        if (!tag.empty()) {
+            if (hasTaggedCompletion(response, tag, scanPos)) {
+                break;
+            }
+            continue;
+        }
         // Check if we've received a complete IMAP response, indicated by the presence of an "OK" or similar status
         if (regex_search(response, regex(R"(\r\n[a-zA-Z0-9]+\s(OK|NO|BAD)\s.*\r\n)"))) {
             break;
@@ -255,64 +341,198 @@ bool readIMAPSResponse(BIO *bio, string &response) {
     return true;
 }
 
-bool fetchAndSaveMessageBIO(BIO *bio, int messageUID, const string &outDir, bool headersOnly, const string &mailbox, const string &server) {
-    string tag = generateTag();
+bool fetchAndSaveMessageBIO(BIO *bio, int messageUID, const string &outDir, bool headersOnly, const string &mailbox, const string &server,
+                            long partialBytes, bool saveAttachments) {
+    // The same commands and saving as in the pipeline, one command at a time
+    vector<string> responses;
+    for (size_t command = 0; command < messageFetchCommandCount(headersOnly); command++) {
+        string tag = generateTag();
+        string fetchCommand = tag + " ";
+        appendMessageFetchCommand(fetchCommand, messageUID, command, partialBytes, saveAttachments);
+        if (sendCommandBIO(bio, fetchCommand + "\r\n") <= 0) {
+            cerr << "Error: Failed to send UID FETCH command for message " << messageUID << "." << endl;
+            ERR_print_errors_fp(stderr);
+            return false;
+        }
 
-    // Send command to fetch headers
-    string fetchHeaderCommand = tag + " UID FETCH " + to_string(messageUID) + 
-                                " BODY[HEADER.FIELDS (DATE FROM TO SUBJECT MESSAGE-ID)]\r\n";
-    if (BIO_write(bio, fetchHeaderCommand.c_str(), fetchHeaderCommand.length()) <= 0) {
-        cerr << "Error: Failed to send UID FETCH command for headers of message " << messageUID << "." << endl;
-        ERR_print_errors_fp(stderr);
-        return false;
+        string response;
+        if (!readIMAPSResponse(bio, response, tag)) {
+            cerr << "Error: Could not receive response for message " << messageUID << " from server." << endl;
+            return false;
+        }
+        responses.push_back(move(response));
     }
+    MessagePaths paths(outDir + "/" + server + "/" + mailbox);
+    return saveFetchedMessage(messageUID, vector<string_view>(responses.begin(), responses.end()), paths, headersOnly, partialBytes, saveAttachments);
+}
 
-    // Read the header response from the server
-    string headerResponse;
-    if (!readIMAPSResponse(bio, headerResponse)) {
-        cerr << "Error: Could not receive header response for message " << messageUID << " from server." << endl;
-        return false;
+bool kernelTlsReceiveBIO(BIO *bio) {
+#ifndef OPENSSL_NO_KTLS
+    SSL *ssl = nullptr;
+    BIO_get_ssl(bio, &ssl);
+    return ssl && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+    return false;
+#endif
+}
+
+SpliceFetchResult fetchAndSaveMessageSpliceBIO(BIO *bio, int messageUID, MessagePaths &paths, long partialBytes) {
+    // Both commands are sent at once, like fetchAndSaveMessageBIO without attachments
+    string headerTag = generateTag();
+    string bodyTag = generateTag();
+    string commands = headerTag + " ";
+    appendMessageFetchCommand(commands, messageUID, 0, partialBytes, false);
+    commands += "\r\n" + bodyTag + " ";
+    appendMessageFetchCommand(commands, messageUID, 1, partialBytes, false);
+    commands += "\r\n";
+    if (sendCommandBIO(bio, commands) <= 0) {
+        cerr << "Error: Failed to send UID FETCH command for message " << messageUID << "." << endl;
+        ERR_print_errors_fp(stderr);
+        return SpliceFetchResult::ConnectionLost;
     }
 
-    // If only headers are requested, save and return
-    if (headersOnly) {
-        ofstream outFile(outDir + "/" + server + "/" + mailbox + "/message_uid_" + to_string(messageUID) + ".eml");
-        if (!outFile) {
-            cerr << "Error: Could not open file to save message " << messageUID << "." << endl;
+    string response;
+    char buffer[65536];
+    auto receiveMore = [&]() {
+        int bytesReceived = receiveDataBIO(bio, buffer, sizeof(buffer));
+        if (bytesReceived <= 0) {
+            cerr << "Error: Could not receive response for message " << messageUID << " from server." << endl;
             return false;
         }
-        outFile << formatToRFC5322(headerResponse, true);
-        outFile.close();
+        response.append(buffer, bytesReceived);
         return true;
+    };
+
+    // The header response is small and read through the TLS library as usual
+    size_t headerEnd = 0;
+    while (!hasTaggedCompletion(response, headerTag, headerEnd)) {
+        if (!receiveMore()) {
+            return SpliceFetchResult::ConnectionLost;
+        }
     }
 
-    // Fetch the body text separately
-    tag = generateTag();
-    string fetchBodyCommand = tag + " UID FETCH " + to_string(messageUID) + " BODY[1]\r\n";
-    if (BIO_write(bio, fetchBodyCommand.c_str(), fetchBodyCommand.length()) <= 0) {
-        cerr << "Error: Failed to send UID FETCH command for body of message " << messageUID << "." << endl;
-        ERR_print_errors_fp(stderr);
-        return false;
+    // Read the body response only up to the announcement of its literal ("{123}")
+    size_t literalOffset = 0, literalLength = 0, bodyEnd = headerEnd;
+    bool announced;
+    while (!(announced = findFetchLiteralStart(string_view(response).substr(headerEnd), literalOffset, literalLength)) &&
+           !hasTaggedCompletion(response, bodyTag, bodyEnd)) {
+        if (!receiveMore()) {
+            return SpliceFetchResult::ConnectionLost;
+        }
+    }
+    literalOffset += headerEnd;
+
+    string_view header(response.data(), headerEnd), headerLiteral;
+    if (!announced || !findFetchLiteral(header, headerLiteral)) {
+        // Unusual responses are completed and saved the usual way
+        while (!hasTaggedCompletion(response, bodyTag, bodyEnd)) {
+            if (!receiveMore()) {
+                return SpliceFetchResult::ConnectionLost;
+            }
+        }
+        vector<string_view> responses = {string_view(response.data(), headerEnd),
+                                         string_view(response.data() + headerEnd, bodyEnd - headerEnd)};
+        return saveFetchedMessage(messageUID, responses, paths, false, partialBytes, false) ? SpliceFetchResult::Saved
+                                                                                             : SpliceFetchResult::Failed;
     }
 
-    // Read the body response from the server
-    string bodyResponse;
-    if (!readIMAPSResponse(bio, bodyResponse)) {
-        cerr << "Error: Could not receive body response for message " << messageUID << " from server." << endl;
-        return false;
+    // A file that cannot be written does not stop reading the responses, the stream has to stay in order
+    const string &path = paths.message(messageUID);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool saved = fd >= 0;
+
+    // The header fields and the part of the body that was already received
+    array<string_view, RFC5322_HEADER_FIELDS> fields;
+    int fieldCount = selectHeaderFields(headerLiteral, fields);
+    size_t received = min(literalLength, response.size() - literalOffset);
+    struct iovec pieces[RFC5322_HEADER_FIELDS + 3];
+    int count = 0;
+    size_t total = 0;
+    auto add = [&](string_view piece) {
+        pieces[count].iov_base = const_cast<char *>(piece.data());
+        pieces[count++].iov_len = piece.size();
+        total += piece.size();
+    };
+    add("\r\n");
+    for (int i = 0; i < fieldCount; i++) {
+        add(fields[i]);
     }
+    add("\r\n");
+    add(string_view(response.data() + literalOffset, received));
+    saved = saved && writev(fd, pieces, count) == static_cast<ssize_t>(total);
 
-    // Save the message to a file in the specified directory
-    ofstream outFile(outDir + "/" + server + "/" + mailbox + "/message_uid_" + to_string(messageUID) + ".eml");
-    if (!outFile) {
-        cerr << "Error: Could not open file to save message " << messageUID << "." << endl;
-        return false;
+    // Data the TLS library has already decrypted is taken from it, the rest is spliced from the socket
+    SSL *ssl = nullptr;
+    BIO_get_ssl(bio, &ssl);
+    while (received < literalLength && SSL_pending(ssl) > 0) {
+        int bytesReceived = receiveDataBIO(bio, buffer, min(sizeof(buffer), literalLength - received));
+        if (bytesReceived <= 0) {
+            if (fd >= 0) close(fd);
+            return SpliceFetchResult::ConnectionLost;
+        }
+        saved = saved && write(fd, buffer, bytesReceived) == bytesReceived;
+        received += bytesReceived;
+    }
+    if (received < literalLength && saved) {
+        // A failed splice leaves an unknown part of the literal unread
+        if (spliceToFile(BIO_get_fd(bio, nullptr), fd, literalLength - received) != static_cast<long>(literalLength - received)) {
+            close(fd);
+            cerr << "Error: Could not receive message " << messageUID << " from server." << endl;
+            return SpliceFetchResult::ConnectionLost;
+        }
+        received = literalLength;
+    }
+    while (received < literalLength) {
+        // The rest of the literal of a message that cannot be saved is read and dropped
+        int bytesReceived = receiveDataBIO(bio, buffer, min(sizeof(buffer), literalLength - received));
+        if (bytesReceived <= 0) {
+            if (fd >= 0) close(fd);
+            return SpliceFetchResult::ConnectionLost;
+        }
+        received += bytesReceived;
+    }
+    if (fd >= 0 && close(fd) != 0) {
+        saved = false;
     }
 
-    outFile << "\r\n" + formatToRFC5322(headerResponse, true) + "\r\n" + formatToRFC5322(bodyResponse, false);
-    outFile.close();
+    // The rest of the body response follows the literal
+    response.erase(0, min(literalOffset + literalLength, response.size()));
+    size_t scanPos = 0;
+    while (!hasTaggedCompletion(response, bodyTag, scanPos)) {
+        if (!receiveMore()) {
+            return SpliceFetchResult::ConnectionLost;
+        }
+    }
+    if (!saved) {
+        cerr << "Error: Could not save message " << messageUID << "." << endl;
+        return SpliceFetchResult::Failed;
+    }
+    return SpliceFetchResult::Saved;
+}
 
-    return true;
+unordered_map<int, long> fetchMessageSizesBIO(BIO *bio, const vector<int> &uids) {
+    unordered_map<int, long> sizes;
+
+    // One UID FETCH per sequence-set, so the size of the whole batch costs a single round trip
+    for (const string &uidSet : buildSequenceSets(uids)) {
+        string tag = generateTag();
+        string sizeCommand = tag + " UID FETCH " + uidSet + " (RFC822.SIZE)\r\n";
+
+        if (sendCommandBIO(bio, sizeCommand) <= 0) {
+            cerr << "Error: Failed to send UID FETCH command for message sizes." << endl;
+            ERR_print_errors_fp(stderr);
+            return sizes;
+        }
+
+        string response;
+        if (!readIMAPSResponse(bio, response, tag)) {
+            cerr << "Error: Could not receive message sizes from server." << endl;
+            ERR_print_errors_fp(stderr);
+            return sizes;
+        }
+        parseMessageSizes(response, sizes);
+    }
+    return sizes;
 }
 
 bool logoutBIO(BIO *bio) {
@@ -320,7 +540,7 @@ bool logoutBIO(BIO *bio) {
     string logoutCommand = tag + " LOGOUT\r\n";
 
     // Use BIO_write to send the LOGOUT command over the secure connection
-    int bytesSent = BIO_write(bio, logoutCommand.c_str(), logoutCommand.length());
+    int bytesSent = sendCommandBIO(bio, logoutCommand);
     if (bytesSent <= 0) {
         cerr << "Error: Failed to send LOGOUT command to the server." << endl;
         ERR_print_errors_fp(stderr);  // Print detailed OpenSSL errors if any
@@ -331,7 +551,7 @@ bool logoutBIO(BIO *bio) {
     memset(buffer, 0, sizeof(buffer));
 
     // Receive the server's response to the LOGOUT command using BIO_read
-    int bytesReceived = BIO_read(bio, buffer, sizeof(buffer) - 1);
+    int bytesReceived = receiveDataBIO(bio, buffer, sizeof(buffer) - 1);
     if (bytesReceived <= 0) {
         cerr << "Error: Could not receive server response for LOGOUT." << endl;
         ERR_print_errors_fp(stderr);
@@ -345,3 +565,97 @@ bool logoutBIO(BIO *bio) {
         return false;
     }
 }
+
+bool fetchAndSaveMessageTextBIO(BIO *bio, int messageUID, const string &outDir, const string &mailbox, const string &server) {
+    string tag = generateTag();
+
+    // Fetch the structure together with the header, so skipping the attachments costs no extra round trip
+    string fetchStructureCommand = tag + " UID FETCH " + to_string(messageUID) +
+                                   " (BODYSTRUCTURE BODY[HEADER.FIELDS (DATE FROM TO SUBJECT MESSAGE-ID)])\r\n";
+    if (sendCommandBIO(bio, fetchStructureCommand) <= 0) {
+        cerr << "Error: Failed to send UID FETCH command for structure of message " << messageUID << "." << endl;
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+
+    string headerResponse;
+    if (!readIMAPSResponse(bio, headerResponse, tag)) {
+        cerr << "Error: Could not receive structure of message " << messageUID << " from server." << endl;
+        return false;
+    }
+
+    vector<MimePart> parts = parseBodyStructure(headerResponse);
+    if (parts.empty()) {
+        cerr << "Error: Could not parse BODYSTRUCTURE of message " << messageUID << "." << endl;
+        return false;
+    }
+
+    // Download only the text/plain and text/html parts
+    string textResponse;
+    string textItems = buildTextFetchItems(parts);
+    if (!textItems.empty()) {
+        tag = generateTag();
+        string fetchTextCommand = tag + " UID FETCH " + to_string(messageUID) + " " + textItems + "\r\n";
+        if (sendCommandBIO(bio, fetchTextCommand) <= 0) {
+            cerr << "Error: Failed to send UID FETCH command for text of message " << messageUID << "." << endl;
+            ERR_print_errors_fp(stderr);
+            return false;
+        }
+        if (!readIMAPSResponse(bio, textResponse, tag)) {
+            cerr << "Error: Could not receive text of message " << messageUID << " from server." << endl;
+            return false;
+        }
+    }
+
+    if (!saveTextAndStubs(outDir + "/" + server + "/" + mailbox + "/message_uid_" + to_string(messageUID), headerResponse, textResponse, parts)) {
+        cerr << "Error: Could not open file to save message " << messageUID << "." << endl;
+        return false;
+    }
+    return true;
+}
+
+bool fetchAndSavePartBIO(BIO *bio, int messageUID, const string &section, const string &outDir, const string &mailbox, const string &server,
+                         bool decode, bool binary) {
+    string dir = outDir + "/" + server + "/" + mailbox + "/";
+    MimePart stub = readStub(dir + "message_uid_" + to_string(messageUID), section);
+    string partPath = dir + partFileName(messageUID, section, stub.name);
+
+    // A server with BINARY decodes the part itself, so it does not travel base64-encoded
+    if (decode && binary) {
+        auto send = [bio](const string &command) { return sendCommandBIO(bio, command); };
+        auto receive = [bio](char *buffer, size_t length) { return receiveDataBIO(bio, buffer, length); };
+        BinaryFetchResult result = fetchBinaryPart(send, receive, messageUID, section, partPath);
+        if (result != BinaryFetchResult::Unsupported) {
+            return result == BinaryFetchResult::Saved;
+        }
+    }
+
+    string tag = generateTag();
+    string fetchPartCommand = tag + " UID FETCH " + to_string(messageUID) + " BODY.PEEK[" + section + "]\r\n";
+
+    if (sendCommandBIO(bio, fetchPartCommand) <= 0) {
+        cerr << "Error: Failed to send UID FETCH command for part " << section << " of message " << messageUID << "." << endl;
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+
+    string response, data;
+    if (!readIMAPSResponse(bio, response, tag)) {
+        cerr << "Error: Could not receive part " << section << " of message " << messageUID << " from server." << endl;
+        return false;
+    }
+    if (!extractFetchLiteral(response, "BODY[" + section + "]", data)) {
+        cerr << "Error: Part " << section << " of message " << messageUID << " not found." << endl;
+        return false;
+    }
+
+    ofstream outFile(partPath, ios::binary);
+    if (!outFile) {
+        cerr << "Error: Could not open file to save part " << section << " of message " << messageUID << "." << endl;
+        return false;
+    }
+    // The transfer encoding is known from the stub written in the lazy attachment mode
+    outFile << (decode ? decodeTransferEncoding(data, stub.encoding) : data);
+    outFile.close();
+    return true;
+}
@@ -14,6 +14,7 @@
 #include <arpa/inet.h>
 #include <cstring>
 #include "utils.h"
+#include "net.h"
 
 using namespace std;
 
@@ -31,34 +32,85 @@ SSL_CTX *initializeSSL(const string &certFile = "", const string &certDir = "");
  * @param ctx - The SSL context to be used for the connection.
  * @param server - The server address.
  * @param port - The port number to connect to.
+ * @param connectTimeoutMs - Deadline for connecting and the TLS handshake in milliseconds; IPv6 and IPv4 addresses are raced (happy eyeballs).
+ * @param commandTimeoutMs - Time the server has to complete each command in milliseconds, 0 disables it.
+ * @param kernelTls - If true, OpenSSL hands the encryption over to the kernel (kTLS) after the handshake when it can.
  * @return A pointer to a connected BIO object on success, or nullptr on failure.
  */
-BIO* connectToServerBIO(SSL_CTX *ctx, const string &server, int port);
+BIO* connectToServerBIO(SSL_CTX *ctx, const string &server, int port, int connectTimeoutMs = DEFAULT_CONNECT_TIMEOUT_MS, int commandTimeoutMs = 0,
+                        bool kernelTls = false);
 
 /**
- * Authenticates a user over a secure IMAP connection using BIO.
+ * Tells whether the kernel decrypts the data received on the connection (kTLS).
+ * @param bio - The BIO object for the secure IMAPS connection.
+ * @return - Returns true if kernel TLS is active for receiving, false otherwise.
+ */
+bool kernelTlsReceiveBIO(BIO *bio);
+
+/**
+ * Sends a command over the secure connection and starts its deadline.
+ * @param bio - The BIO object for the secure IMAPS connection.
+ * @param command - The complete command including the CRLF.
+ * @return - The number of bytes sent, IO_TIMEOUT if the deadline passed, or a value <= 0 on error.
+ */
+int sendCommandBIO(BIO *bio, const string &command);
+
+/**
+ * Receives data from the secure connection, waiting at most until the deadline of the current command.
+ * @param bio - The BIO object for the secure IMAPS connection.
+ * @param buffer - The buffer to store the data.
+ * @param length - The size of the buffer.
+ * @return - The number of bytes received, IO_TIMEOUT if the deadline passed, or a value <= 0 if the connection failed.
+ */
+int receiveDataBIO(BIO *bio, char *buffer, int length);
+
+/**
+ * Authenticates a user over a secure IMAP connection using BIO, see authenticateSession.
  * @param bio - Pointer to the active BIO object.
  * @param username - The username for authentication.
  * @param password - The password for authentication.
+ * @param capabilities - The capabilities announced with the result, empty if the server did not announce them.
  * @return - Returns true if authentication is successful, false otherwise.
  */
-bool authenticateBIO(BIO *bio, const string &username, const string &password);
+bool authenticateBIO(BIO *bio, const string &username, const string &password, string &capabilities);
 
 /**
  * Selects a mailbox on a secure IMAPS connection using the BIO library.
  * @param bio - The BIO object for the IMAPS connection.
  * @param mailbox - The name of the mailbox to select (e.g., "INBOX").
+ * @param messageCount - Set to the number of messages from the EXISTS response, -1 if the response has none.
  * @return - Returns the UIDVALIDITY if successful, -1 on failure.
  */
-int selectMailboxBIO(BIO *bio, const string &mailbox);
+int selectMailboxBIO(BIO *bio, const string &mailbox, long &messageCount);
 
 /**
  * Sends a UID SEARCH command to the server using a secure BIO connection and retrieves message UIDs.
+ * The result is parsed while it is being received, so there is no limit on the number of UIDs.
  * @param bio - The BIO object for the IMAPS connection.
- * @param newMessagesOnly - If true, search for unseen messages only, otherwise search for all messages.
- * @return - A vector of message UIDs that match the search criteria.
+ * @param criteria - The search criteria built by buildSearchCriteria (e.g. "ALL" or "UNSEEN SINCE 1-Jan-2024").
+ * @param uids - The UIDs of the messages that match the search criteria.
+ * @param useESearch - If true, requests the compact ESEARCH result form (RFC 4731).
+ * @param messageCount - The number of messages in the mailbox that bounds the result, -1 if not known.
+ * @return - Returns true if the search succeeded, false otherwise.
  */
-vector<int> searchMessagesBIO(BIO *bio, bool newMessagesOnly);
+bool searchMessagesBIO(BIO *bio, const string &criteria, vector<int> &uids, bool useESearch = false, long messageCount = -1);
+
+/**
+ * Asks for the counters of a mailbox with STATUS, without selecting it.
+ * @param bio - The BIO object for the IMAPS connection.
+ * @param mailbox - The mailbox name.
+ * @param capabilities - The capabilities of the server, they decide the form of the name and the counters asked for.
+ * @param status - The counters of the mailbox.
+ * @return - Returns true if the status was received, false otherwise (also if the name needs a synchronizing literal).
+ */
+bool getMailboxStatusBIO(BIO *bio, const string &mailbox, const string &capabilities, MailboxStatus &status);
+
+/**
+ * Asks the server for its capabilities using the CAPABILITY command over a secure BIO connection.
+ * @param bio - The BIO object for the IMAPS connection.
+ * @return - The space separated capability list, or an empty string on failure.
+ */
+string getCapabilitiesBIO(BIO *bio);
 
 /**
  * Fetch and save a message using a secure BIO connection (IMAPS).
@@ -68,9 +120,43 @@ vector<int> searchMessagesBIO(BIO *bio, bool newMessagesOnly);
  * @param headersOnly - If true, only fetch and save the headers.
  * @param mailbox - The mailbox name.
  * @param server - The server name.
+ * @param partialBytes - If positive, only the first partialBytes of the body are saved (BODY.PEEK[1]<0.N>, or BODY.PEEK[TEXT]<0.N> with attachments).
+ * @param saveAttachments - If true, the complete message is saved and its attachments are decoded next to it.
  * @return - Returns true if successful, false otherwise.
  */
-bool fetchAndSaveMessageBIO(BIO *bio, int messageUID, const string &outDir, bool headersOnly, const string &mailbox, const string &server);
+bool fetchAndSaveMessageBIO(BIO *bio, int messageUID, const string &outDir, bool headersOnly, const string &mailbox, const string &server,
+                            long partialBytes = 0, bool saveAttachments = false);
+
+/**
+ * Result of fetching a message whose body is spliced to the file.
+ */
+enum class SpliceFetchResult {
+    Saved,                          // The message was written to the file
+    Failed,                         // The message could not be saved, the connection is still in order
+    ConnectionLost                  // The connection failed or the stream position within a response is unknown
+};
+
+/**
+ * Fetch and save a complete (or partial) message over a connection with kernel TLS. The header is read as usual,
+ * the body literal is spliced from the socket straight to the file, so it is not copied through user space.
+ * Responses without a literal are saved like in fetchAndSaveMessageBIO. If the file cannot be written, the rest of
+ * the responses is still read, so the next command finds the stream in order.
+ * @param bio - The BIO object for the secure IMAPS connection, kernelTlsReceiveBIO must be true.
+ * @param messageUID - The UID of the message to fetch.
+ * @param paths - The paths of the mailbox directory.
+ * @param partialBytes - If positive, only the first partialBytes of the body are saved (BODY.PEEK[1]<0.N>, or BODY.PEEK[TEXT]<0.N> with attachments).
+ * @return - Saved, Failed if the message could not be saved, or ConnectionLost if the responses could not be read to
+ *           their end (the session cannot be used any more).
+ */
+SpliceFetchResult fetchAndSaveMessageSpliceBIO(BIO *bio, int messageUID, MessagePaths &paths, long partialBytes = 0);
+
+/**
+ * Fetches RFC822.SIZE of the given messages over a secure BIO connection using as few UID FETCH commands as possible.
+ * @param bio - The BIO object for the secure IMAPS connection.
+ * @param uids - The UIDs of the messages.
+ * @return - A map of message sizes in bytes keyed by UID.
+ */
+unordered_map<int, long> fetchMessageSizesBIO(BIO *bio, const vector<int> &uids);
 
 /**
  * Logs out the user from the IMAPS server using a secure BIO connection.
@@ -83,8 +169,36 @@ bool logoutBIO(BIO *bio);
  * Reads the server response from the BIO object and stores it in a string.
  * @param bio - The BIO object for the secure IMAPS connection.
  * @param response - The string to store the server response.
+ * @param tag - The tag of the command; if empty, the first tagged status line ends the response.
+ * @return - Returns true if successful, false otherwise.
+ */
+bool readIMAPSResponse(BIO *bio, string &response, const string &tag = "");
+
+/**
+ * Fetches the BODYSTRUCTURE of a message over a secure BIO connection and saves only its header and text parts.
+ * Attachments are described in a stub file next to the message and can be fetched later with fetchAndSavePartBIO.
+ * @param bio - The BIO object for the secure IMAPS connection.
+ * @param messageUID - The UID of the message to fetch.
+ * @param outDir - The base output directory.
+ * @param mailbox - The mailbox name.
+ * @param server - The server name.
+ * @return - Returns true if successful, false otherwise.
+ */
+bool fetchAndSaveMessageTextBIO(BIO *bio, int messageUID, const string &outDir, const string &mailbox, const string &server);
+
+/**
+ * Fetches a single part of a message over a secure BIO connection and saves it.
+ * @param bio - The BIO object for the secure IMAPS connection.
+ * @param messageUID - The UID of the message.
+ * @param section - The part specifier, e.g. "2" or "1.3".
+ * @param outDir - The base output directory.
+ * @param mailbox - The mailbox name.
+ * @param server - The server name.
+ * @param decode - If true, the part is decoded using the transfer encoding recorded in its stub.
+ * @param binary - If true (the server supports BINARY), a part to be decoded is fetched decoded by the server.
  * @return - Returns true if successful, false otherwise.
  */
-bool readIMAPSResponse(BIO *bio, string &response);
+bool fetchAndSavePartBIO(BIO *bio, int messageUID, const string &section, const string &outDir, const string &mailbox, const string &server,
+                         bool decode = false, bool binary = false);
 
 #endif // IMAPS_H
\ No newline at end of file
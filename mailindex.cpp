@@ -0,0 +1,354 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#include "mailindex.h"
+#include <cstdint>
+#include <cstring>
+
+static const char segmentMagic[8] = {'I', 'M', 'A', 'P', 'C', 'L', 'I', 'X'};
+static const size_t maxSegments = 8;            // Segments are merged into one above this count
+static const size_t minTermLength = 2;
+static const size_t maxTermLength = 32;
+
+static void putVarint(string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+static bool getVarint(string_view in, size_t &pos, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+        uint8_t byte = in[pos++];
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void tokenizeText(string_view text, vector<string> &terms) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+        while (pos < text.size() && !isalnum(static_cast<unsigned char>(text[pos])) && !(text[pos] & 0x80)) {
+            ++pos;
+        }
+        size_t start = pos;
+        while (pos < text.size() && (isalnum(static_cast<unsigned char>(text[pos])) || (text[pos] & 0x80))) {
+            ++pos;
+        }
+        if (pos - start >= minTermLength && pos - start <= maxTermLength) {
+            string term(text.substr(start, pos - start));
+            transform(term.begin(), term.end(), term.begin(), [](unsigned char c) { return tolower(c); });
+            terms.push_back(move(term));
+        }
+    }
+}
+
+MailIndex::MailIndex(const string &dir, int uidvalidity) : indexDir(dir + "/.index"), uidvalidity(uidvalidity) {
+    // UIDs of another UIDVALIDITY point to different messages, so the old segments are useless
+    for (const string &segment : listSegments(indexDir)) {
+        ifstream segmentFile(segment, ios::binary);
+        char header[12] = {};
+        segmentFile.read(header, sizeof(header));
+        int32_t segmentValidity;
+        memcpy(&segmentValidity, header + 8, sizeof(segmentValidity));
+        if (!segmentFile || memcmp(header, segmentMagic, 8) != 0 || segmentValidity != uidvalidity) {
+            fs::remove(segment);
+        }
+    }
+}
+
+bool MailIndex::addMessageFile(int uid, const string &path) {
+    ifstream messageFile(path, ios::binary);
+    if (!messageFile) {
+        return false;
+    }
+    string message((istreambuf_iterator<char>(messageFile)), istreambuf_iterator<char>());
+    addMessage(uid, message);
+    return true;
+}
+
+void MailIndex::addMessage(int uid, string_view message) {
+    vector<string> terms;
+    bool inHeader = true;
+    string field;
+
+    for (size_t pos = 0; pos < message.size();) {
+        size_t lineEnd = message.find('\n', pos);
+        if (lineEnd == string_view::npos) {
+            lineEnd = message.size();
+        }
+        string_view line = message.substr(pos, lineEnd - pos);
+        pos = lineEnd + 1;
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+
+        // The header ends with the first empty line after the header fields
+        if (line.empty()) {
+            if (!field.empty()) {
+                inHeader = false;
+            }
+            continue;
+        }
+
+        size_t before = terms.size();
+        if (inHeader) {
+            if (line[0] != ' ' && line[0] != '\t') {
+                size_t colon = line.find(':');
+                field = colon == string_view::npos ? "" : string(line.substr(0, colon));
+                transform(field.begin(), field.end(), field.begin(), [](unsigned char c) { return tolower(c); });
+                line = colon == string_view::npos ? line : line.substr(colon + 1);
+            }
+            tokenizeText(line, terms);
+            if (field == "subject" || field == "from" || field == "to") {
+                size_t fieldTerms = terms.size();
+                for (size_t i = before; i < fieldTerms; i++) {
+                    terms.push_back(field + ":" + terms[i]);
+                }
+            }
+            continue;
+        }
+
+        // Lines of base64 data only fill the index with noise
+        if (line.size() >= 60 && line.find(' ') == string_view::npos) {
+            continue;
+        }
+        tokenizeText(line, terms);
+    }
+
+    sort(terms.begin(), terms.end());
+    terms.erase(unique(terms.begin(), terms.end()), terms.end());
+    for (const string &term : terms) {
+        pending[term].push_back(uid);
+    }
+}
+
+// Reads the number of a segment from its file name "segment_<number>.idx", other files in the directory are not segments
+static bool parseSegmentNumber(const string &name, int &number) {
+    if (!name.starts_with("segment_") || !name.ends_with(".idx")) {
+        return false;
+    }
+    const char *end = name.data() + name.size() - 4;
+    auto [numberEnd, ec] = from_chars(name.data() + 8, end, number);
+    return ec == errc() && numberEnd == end;
+}
+
+vector<string> MailIndex::listSegments(const string &indexDir) {
+    vector<string> segments;
+    if (!fs::exists(indexDir)) {
+        return segments;
+    }
+    for (const auto &entry : fs::directory_iterator(indexDir)) {
+        int number;
+        if (parseSegmentNumber(entry.path().filename().string(), number)) {
+            segments.push_back(entry.path().string());
+        }
+    }
+    sort(segments.begin(), segments.end());
+    return segments;
+}
+
+bool MailIndex::writeSegment(const string &path, int uidvalidity, const map<string, vector<int>> &postings) {
+    // Layout: magic, UIDVALIDITY, posting lists, term dictionary, offset of the dictionary
+    string data(segmentMagic, sizeof(segmentMagic));
+    int32_t validity = uidvalidity;
+    data.append(reinterpret_cast<const char *>(&validity), sizeof(validity));
+
+    string dictionary;
+    putVarint(dictionary, postings.size());
+    for (const auto &[term, uids] : postings) {
+        size_t offset = data.size();
+        int previous = 0;
+        for (int uid : uids) {
+            putVarint(data, uid - previous);
+            previous = uid;
+        }
+        putVarint(dictionary, term.size());
+        dictionary += term;
+        putVarint(dictionary, offset);
+        putVarint(dictionary, data.size() - offset);
+    }
+
+    uint64_t dictionaryOffset = data.size();
+    data += dictionary;
+    data.append(reinterpret_cast<const char *>(&dictionaryOffset), sizeof(dictionaryOffset));
+
+    // Written under a temporary name, a reader never sees a half written segment
+    string tmpPath = path + ".tmp";
+    ofstream segmentFile(tmpPath, ios::binary);
+    if (!segmentFile.write(data.data(), data.size())) {
+        return false;
+    }
+    segmentFile.close();
+    fs::rename(tmpPath, path);
+    return true;
+}
+
+// Decodes the posting lists of the requested terms (all terms if none are given); only the term dictionary and the
+// posting lists of the requested terms are read from the file
+static bool readSegment(const string &path, const vector<string> &terms, map<string, vector<int>> &postings) {
+    ifstream segmentFile(path, ios::binary | ios::ate);
+    streamoff fileSize = segmentFile.tellg();
+    if (!segmentFile || fileSize < 20) {
+        return false;
+    }
+    char magic[8];
+    uint64_t dictionaryOffset;
+    segmentFile.seekg(0);
+    segmentFile.read(magic, sizeof(magic));
+    segmentFile.seekg(fileSize - 8);
+    segmentFile.read(reinterpret_cast<char *>(&dictionaryOffset), sizeof(dictionaryOffset));
+    if (!segmentFile || memcmp(magic, segmentMagic, 8) != 0 || dictionaryOffset < 12 ||
+        dictionaryOffset > static_cast<uint64_t>(fileSize - 8)) {
+        return false;
+    }
+
+    string dictionary(fileSize - 8 - dictionaryOffset, '\0');
+    segmentFile.seekg(dictionaryOffset);
+    if (!segmentFile.read(dictionary.data(), dictionary.size())) {
+        return false;
+    }
+    size_t pos = 0;
+    uint64_t termCount;
+    if (!getVarint(dictionary, pos, termCount)) {
+        return false;
+    }
+
+    string postingList;
+    for (uint64_t i = 0; i < termCount; i++) {
+        uint64_t termLength, offset, length;
+        if (!getVarint(dictionary, pos, termLength) || pos + termLength > dictionary.size()) {
+            return false;
+        }
+        string_view term = string_view(dictionary).substr(pos, termLength);
+        pos += termLength;
+        if (!getVarint(dictionary, pos, offset) || !getVarint(dictionary, pos, length)) {
+            return false;
+        }
+        if (!terms.empty() && find(terms.begin(), terms.end(), term) == terms.end()) {
+            continue;
+        }
+        if (offset + length > dictionaryOffset) {
+            return false;
+        }
+
+        postingList.resize(length);
+        segmentFile.seekg(offset);
+        if (!segmentFile.read(postingList.data(), length)) {
+            return false;
+        }
+        vector<int> &uids = postings[string(term)];
+        size_t postingPos = 0;
+        uint64_t delta;
+        int uid = 0;
+        while (postingPos < postingList.size() && getVarint(postingList, postingPos, delta)) {
+            uid += delta;
+            uids.push_back(uid);
+        }
+    }
+    return true;
+}
+
+bool MailIndex::save() {
+    if (pending.empty()) {
+        return true;
+    }
+    try {
+        fs::create_directories(indexDir);
+    } catch (const exception &e) {
+        cerr << "Error: Could not create index directory " << indexDir << ". " << e.what() << endl;
+        return false;
+    }
+
+    // Segment names grow monotonically, so they sort in the order they were written
+    vector<string> segments = listSegments(indexDir);
+    int nextNumber = 1;
+    if (!segments.empty() && parseSegmentNumber(fs::path(segments.back()).filename().string(), nextNumber)) {
+        nextNumber++;
+    }
+    auto segmentPath = [&](int number) {
+        string name = to_string(number);
+        return indexDir + "/segment_" + string(8 - min<size_t>(8, name.size()), '0') + name + ".idx";
+    };
+
+    for (auto &[term, uids] : pending) {
+        sort(uids.begin(), uids.end());
+        uids.erase(unique(uids.begin(), uids.end()), uids.end());
+    }
+    if (!writeSegment(segmentPath(nextNumber), uidvalidity, pending)) {
+        cerr << "Error: Could not write index segment." << endl;
+        return false;
+    }
+    pending.clear();
+    segments.push_back(segmentPath(nextNumber));
+
+    // Merge all segments into one once there are too many of them to search quickly
+    if (segments.size() > maxSegments) {
+        map<string, vector<int>> merged;
+        for (const string &segment : segments) {
+            readSegment(segment, {}, merged);
+        }
+        for (auto &[term, uids] : merged) {
+            sort(uids.begin(), uids.end());
+            uids.erase(unique(uids.begin(), uids.end()), uids.end());
+        }
+        if (!writeSegment(segmentPath(nextNumber + 1), uidvalidity, merged)) {
+            cerr << "Error: Could not write compacted index segment." << endl;
+            return false;
+        }
+        for (const string &segment : segments) {
+            fs::remove(segment);
+        }
+    }
+    return true;
+}
+
+vector<int> MailIndex::search(const string &dir, const vector<string> &terms) {
+    // Query terms are normalized like the indexed text, a "field:" prefix is kept
+    vector<string> queryTerms;
+    for (const string &term : terms) {
+        size_t colon = term.find(':');
+        string prefix = colon == string::npos ? "" : term.substr(0, colon + 1);
+        transform(prefix.begin(), prefix.end(), prefix.begin(), [](unsigned char c) { return tolower(c); });
+        vector<string> tokens;
+        tokenizeText(colon == string::npos ? term : term.substr(colon + 1), tokens);
+        for (const string &token : tokens) {
+            queryTerms.push_back(prefix + token);
+        }
+    }
+    if (queryTerms.empty()) {
+        return {};
+    }
+
+    map<string, vector<int>> postings;
+    for (const string &segment : listSegments(dir + "/.index")) {
+        readSegment(segment, queryTerms, postings);
+    }
+
+    // Intersect the posting lists, starting with the shortest one
+    vector<vector<int>> lists;
+    for (const string &term : queryTerms) {
+        vector<int> &uids = postings[term];
+        sort(uids.begin(), uids.end());
+        uids.erase(unique(uids.begin(), uids.end()), uids.end());
+        lists.push_back(uids);
+    }
+    sort(lists.begin(), lists.end(), [](const vector<int> &a, const vector<int> &b) { return a.size() < b.size(); });
+
+    vector<int> result = lists[0];
+    for (size_t i = 1; i < lists.size() && !result.empty(); i++) {
+        vector<int> intersection;
+        set_intersection(result.begin(), result.end(), lists[i].begin(), lists[i].end(), back_inserter(intersection));
+        result = move(intersection);
+    }
+    return result;
+}
@@ -0,0 +1,55 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#ifndef MAILINDEX_H
+#define MAILINDEX_H
+
+#include "utils.h"
+#include <map>
+
+using namespace std;
+
+/**
+ * Incremental inverted index over the messages downloaded into one mailbox directory.
+ * Terms map to UID posting lists stored delta and varint compressed. Every sync writes the
+ * messages it indexed as a new immutable segment, so existing data is never rewritten until
+ * the segments are compacted. Header terms are also indexed with a field prefix ("from:alice").
+ */
+class MailIndex {
+public:
+    // Opens the index of a mailbox directory, segments of another UIDVALIDITY are discarded
+    MailIndex(const string &dir, int uidvalidity);
+
+    // Tokenizes a saved message file and adds its terms to the pending segment
+    bool addMessageFile(int uid, const string &path);
+
+    // Tokenizes a message and adds its terms to the pending segment
+    void addMessage(int uid, string_view message);
+
+    // Writes the pending segment and compacts the index when it has too many segments
+    bool save();
+
+    // Returns the UIDs of messages containing all terms (a term may carry a field prefix)
+    static vector<int> search(const string &dir, const vector<string> &terms);
+
+private:
+    string indexDir;
+    int uidvalidity;
+    map<string, vector<int>> pending;   // Terms of the messages indexed in this run
+
+    static vector<string> listSegments(const string &indexDir);
+    static bool writeSegment(const string &path, int uidvalidity, const map<string, vector<int>> &postings);
+};
+
+/**
+ * Splits text into lower-case index terms (runs of letters and digits, UTF-8 bytes are kept).
+ * @param text - The text to tokenize.
+ * @param terms - Vector the terms are appended to.
+ */
+void tokenizeText(string_view text, vector<string> &terms);
+
+#endif // MAILINDEX_H
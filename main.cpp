@@ -9,16 +9,32 @@ const int IMAP_PORT = 143;
 
 #include "utils.h"
 #include "arg_parser.h"
+#include "memstats.h"
 #include "imap.h"
 #include "imaps.h"
+#include "mailindex.h"
+#include "pipeline.h"
+#include "session.h"
+#include "headerarchive.h"
+#include "serve.h"
+#include "transcript.h"
+#include "uidremap.h"
+#include <climits>
+#include <optional>
+#include <set>
 
 using namespace std;
 
 int main(int argc, char *argv[]) {
     int sockfd = -1;
     int uidvalidity = -1;
+    long messageCount = -1;                 // From the EXISTS response of SELECT, bounds the search result
     SSL_CTX *sslCtx = nullptr;
     BIO *bio = nullptr;
+    bool connectionLost = false;            // The responses got out of step with the commands
+
+    // The time budget counts from the start, including connecting and searching
+    auto startTime = chrono::steady_clock::now();
 
     try {
         // Create and initialize the argument parser
@@ -35,12 +51,71 @@ int main(int argc, char *argv[]) {
 
         // Retrieve values from the argument parser
         vector<string> positionalArgs = args.getPositionalArgs();
+
+        // "fetch-part server UID SECTION" downloads a single part skipped in the lazy attachment mode
+        bool fetchPartCommand = !positionalArgs.empty() && positionalArgs[0] == "fetch-part";
+        int partUID = 0;
+        if (fetchPartCommand) {
+            positionalArgs.erase(positionalArgs.begin());
+            if (positionalArgs.size() != 3) {
+                cerr << "Usage: ./imapcl fetch-part server UID SECTION [-p port] [-T] -a auth_file [-b MAILBOX] -o out_dir" << endl;
+                return -1;
+            }
+            const string &uidText = positionalArgs[1];
+            auto [uidEnd, ec] = from_chars(uidText.data(), uidText.data() + uidText.size(), partUID);
+            if (ec != errc() || uidEnd != uidText.data() + uidText.size() || partUID <= 0) {
+                cerr << "Error: invalid value for UID: " << uidText << " (expected a positive number)." << endl;
+                return -1;
+            }
+            // The section goes into the command and the file name, so only part numbers such as 2 or 1.3 are accepted
+            const string &section = positionalArgs[2];
+            if (section.empty() || section.find_first_not_of("0123456789.") != string::npos || section.front() == '.' ||
+                section.back() == '.' || section.find("..") != string::npos) {
+                cerr << "Error: invalid value for SECTION: " << section << " (expected a part number such as 2 or 1.3)." << endl;
+                return -1;
+            }
+        }
+        // "search server term..." answers a query from the local index without connecting to the server
+        if (!positionalArgs.empty() && positionalArgs[0] == "search") {
+            string outDir = args.getOption("-o");
+            string mailbox = args.getOption("-b").empty() ? "INBOX" : args.getOption("-b");
+            if (positionalArgs.size() < 3 || outDir.empty()) {
+                cerr << "Usage: ./imapcl search server term... [-b MAILBOX] -o out_dir" << endl;
+                return -1;
+            }
+            string dir = outDir + "/" + positionalArgs[1] + "/" + mailbox;
+            vector<string> terms(positionalArgs.begin() + 2, positionalArgs.end());
+            for (int uid : MailIndex::search(dir, terms)) {
+                cout << dir << "/message_uid_" << uid << ".eml" << endl;
+            }
+            return 0;
+        }
+        // "serve server ..." answers local IMAP clients from the downloaded store and syncs it in the background
+        if (!positionalArgs.empty() && positionalArgs[0] == "serve") {
+            string outDir = args.getOption("-o");
+            string authFile = args.getOption("-a");
+            if (positionalArgs.size() != 2 || outDir.empty() || authFile.empty()) {
+                cerr << "Usage: ./imapcl serve server [options] -a auth_file -o out_dir [--listen PORT] [--sync-interval S]" << endl;
+                return -1;
+            }
+            ServeOptions options;
+            options.storeDir = outDir + "/" + positionalArgs[1];
+            tie(options.username, options.password) = readAuthFile(authFile);
+            long long listenPort, syncInterval;
+            if (!args.getNumber("--listen", DEFAULT_SERVE_PORT, 1, 65535, listenPort) ||
+                !args.getNumber("--sync-interval", DEFAULT_SYNC_INTERVAL_S, 0, INT_MAX, syncInterval)) {
+                return -1;
+            }
+            options.port = listenPort;
+            options.syncIntervalSeconds = syncInterval;
+            if (options.syncIntervalSeconds > 0) {
+                options.syncCommand = buildSyncCommand(argc, argv);
+            }
+            return serveLocalStore(options);
+        }
         string server = positionalArgs.empty() ? "" : positionalArgs[0];
-        int port;
-        try {
-            port = args.getOption("-p").empty() ? IMAP_PORT : stoi(args.getOption("-p"));
-        } catch (const std::invalid_argument &e) {
-            cerr << "Error: The specified port is not a valid number." << endl;
+        long long port;
+        if (!args.getNumber("-p", IMAP_PORT, 1, 65535, port)) {
             return -1;
         }
         bool useSSL = args.hasFlag("-T");
@@ -49,8 +124,92 @@ int main(int argc, char *argv[]) {
         string outDir = args.getOption("-o");
         string mailbox = args.getOption("-b").empty() ? "INBOX" : args.getOption("-b");
         bool newMessagesOnly = args.hasFlag("-n");
+
+        // The server selects the messages to download, the criteria of --search are combined with -n
+        string searchCriteria;
+        if (!buildSearchCriteria(args.getOption("--search"), newMessagesOnly, searchCriteria)) {
+            return -1;
+        }
         bool headersOnly = args.hasFlag("-h");
+        bool finishPartial = args.hasFlag("--finish-partial");
+        bool lazyAttachments = args.hasFlag("--lazy-attachments");
+        bool saveAttachments = args.hasFlag("--extract-attachments");
+        bool buildIndex = args.hasFlag("--index");
+        bool printStats = args.hasFlag("--stats");
+        bool printMemStats = args.hasFlag("--mem-stats");
+        if (printMemStats) {
+            enableMemoryTracking();
+            startMemoryPhase("session start");
+        }
+        bool kernelTls = args.hasFlag("--ktls");
+        bool bulkHeaders = args.hasFlag("--bulk-headers") && headersOnly;
+
+        // Messages larger than maxSize are saved only up to partialSize bytes and finished later
+        long long maxSize, partialSize;
+        if (!args.getNumber("--max-size", 0, 0, LONG_MAX, maxSize) ||
+            !args.getNumber("--partial-size", maxSize, 0, LONG_MAX, partialSize)) {
+            return -1;
+        }
         
+        // Download order and the time after which no further messages are requested
+        string order = args.getOption("--order").empty() ? "oldest" : args.getOption("--order");
+        if (order != "oldest" && order != "newest" && order != "smallest") {
+            cerr << "Error: The download order must be oldest, newest or smallest." << endl;
+            return -1;
+        }
+        unordered_map<int, double> weights;
+        if (!args.getOption("--weights").empty() && !readWeights(args.getOption("--weights"), weights)) {
+            cerr << "Error: Could not read the weight file " << args.getOption("--weights") << "." << endl;
+            return -1;
+        }
+        auto deadline = chrono::steady_clock::time_point::max();
+        long long timeBudget;
+        if (!args.getNumber("--time-budget", -1, 0, INT_MAX, timeBudget)) {
+            return -1;
+        }
+        if (timeBudget >= 0) {
+            deadline = startTime + chrono::seconds(timeBudget);
+        }
+
+        // Line endings of the saved messages, converted while they are written
+        string eol = args.getOption("--eol");
+        if (!eol.empty() && eol != "crlf" && eol != "lf") {
+            cerr << "Error: The line ending must be crlf or lf." << endl;
+            return -1;
+        }
+        setOutputLineEnding(eol == "lf" ? LineEnding::LF : eol == "crlf" ? LineEnding::CRLF : LineEnding::Keep);
+
+        // A recorded session is replayed through the plain connection functions instead of connecting
+        string replaySpeed = args.getOption("--replay-speed");
+        if (!replaySpeed.empty() && replaySpeed != "original" && replaySpeed != "max") {
+            cerr << "Error: The replay speed must be original or max." << endl;
+            return -1;
+        }
+        if (!args.getOption("--replay").empty()) {
+            if (!startReplay(args.getOption("--replay"), replaySpeed == "original")) {
+                cerr << "Error: Could not read the session transcript " << args.getOption("--replay") << "." << endl;
+                return -1;
+            }
+            useSSL = false;
+        } else if (!args.getOption("--record").empty() && !startRecording(args.getOption("--record"))) {
+            cerr << "Error: Could not open the session transcript " << args.getOption("--record") << "." << endl;
+            return -1;
+        }
+
+        // Cap of the response data the fetch pipeline may have in flight
+        long long pipelineMemoryMB;
+        if (!args.getNumber("--pipeline-memory", DEFAULT_PIPELINE_MEMORY / (1024 * 1024), 1, 1024 * 1024, pipelineMemoryMB)) {
+            return -1;
+        }
+        size_t pipelineMemory = pipelineMemoryMB * 1024 * 1024;
+
+        // Deadlines for connecting and for the server to complete each command
+        long long connectTimeout, commandTimeout;
+        if (!args.getNumber("--connect-timeout", DEFAULT_CONNECT_TIMEOUT_MS, 1, INT_MAX, connectTimeout) ||
+            !args.getNumber("--read-timeout", DEFAULT_COMMAND_TIMEOUT_MS, 0, INT_MAX, commandTimeout)) {
+            return -1;
+        }
+
         string certificateFile = args.getOption("-c").empty() ? "" : args.getOption("-c");
         string certDirectory = args.getOption("-C").empty() ? "/etc/ssl/certs" : args.getOption("-C");
 
@@ -64,85 +223,393 @@ int main(int argc, char *argv[]) {
         auto [username, password] = readAuthFile(authFile);
         vector<int> serverUIDs;
 
+        auto sendCommands = [&](const string &commands) { return useSSL ? sendCommandBIO(bio, commands) : sendCommand(sockfd, commands); };
+        auto receiveChunk = [&](char *buffer, size_t length) {
+            return useSSL ? receiveDataBIO(bio, buffer, length) : receiveData(sockfd, buffer, length);
+        };
+
+        // With --fast-startup, the authentication, SELECT and UID SEARCH are pipelined behind the greeting
+        SessionStart session;
+        string capabilities;
+        bool fastStartup = args.hasFlag("--fast-startup");
+
+        // A mailbox whose STATUS counters match those stored by the last complete download is not selected at all
+        MailboxStatus cachedStatus, mailboxStatus;
+        if (fetchPartCommand || finishPartial || !readStatusCache(outDir, mailbox, server, headersOnly, searchCriteria, cachedStatus)) {
+            cachedStatus = MailboxStatus();
+        }
+        bool mailboxUnchangedSinceCache = false;
+        bool searchSucceeded = true;
+
         if (useSSL) {
             sslCtx = initializeSSL(certificateFile, certDirectory);
             if (!sslCtx) return -1;
 
-            bio = connectToServerBIO(sslCtx, server, port);
+            bio = connectToServerBIO(sslCtx, server, port, connectTimeout, commandTimeout, kernelTls);
             if (!bio) {
                 SSL_CTX_free(sslCtx);
                 return -1;
             }
-            if(!authenticateBIO(bio, username, password)) {
-                BIO_free_all(bio);
-                SSL_CTX_free(sslCtx);
-                return -1;
+            if (fastStartup) {
+                if (!startSession(sendCommands, receiveChunk, username, password, mailbox, !fetchPartCommand, searchCriteria, cachedStatus, session)) {
+                    BIO_free_all(bio);
+                    SSL_CTX_free(sslCtx);
+                    return -1;
+                }
+                uidvalidity = session.uidvalidity;
+                mailboxStatus = session.status;
+                mailboxUnchangedSinceCache = session.unchanged;
+            } else {
+                if (!authenticateBIO(bio, username, password, capabilities)) {
+                    BIO_free_all(bio);
+                    SSL_CTX_free(sslCtx);
+                    return -1;
+                }
+                if (!fetchPartCommand) {
+                    // The capabilities usually come with the authentication result, otherwise they are asked for
+                    if (capabilities.empty()) {
+                        capabilities = getCapabilitiesBIO(bio);
+                    }
+                    getMailboxStatusBIO(bio, mailbox, capabilities, mailboxStatus);
+                    mailboxUnchangedSinceCache = mailboxUnchanged(cachedStatus, mailboxStatus, searchCriteria);
+                }
+                if (!mailboxUnchangedSinceCache && (uidvalidity = selectMailboxBIO(bio, mailbox, messageCount)) == -1) {
+                    BIO_free_all(bio);
+                    SSL_CTX_free(sslCtx);
+                    return -1;
+                }
             }
-            if ((uidvalidity = selectMailboxBIO(bio, mailbox)) == -1) {
+            if (fetchPartCommand) {
+                // A part that is decoded anyway is fetched decoded by the server if it supports BINARY
+                if (fastStartup) {
+                    capabilities = session.capabilities;
+                } else if (capabilities.empty() && saveAttachments) {
+                    capabilities = getCapabilitiesBIO(bio);
+                }
+                bool partSuccess = fetchAndSavePartBIO(bio, partUID, positionalArgs[2], outDir, mailbox, server, saveAttachments,
+                                                       hasCapability(capabilities, "BINARY"));
+                if (!logoutBIO(bio)) cerr << "Error: Logout failed." << endl;
                 BIO_free_all(bio);
                 SSL_CTX_free(sslCtx);
-                return -1;
+                return partSuccess ? 0 : -1;
+            }
+            if (fastStartup) {
+                serverUIDs = move(session.uids);
+            } else if (!mailboxUnchangedSinceCache) {
+                searchSucceeded = searchMessagesBIO(bio, searchCriteria, serverUIDs, hasCapability(capabilities, "ESEARCH"), messageCount);
             }
-            serverUIDs = searchMessagesBIO(bio, newMessagesOnly);
 
         } else {
-            if (!connectToServer(sockfd, server, port)) {
+            if (!replaying() && !connectToServer(sockfd, server, port, connectTimeout, commandTimeout)) {
                 close(sockfd);
                 return -1;
             }
-            // Authenticate using the provided credentials
-            if (!authenticate(sockfd, username, password)) {
-                close(sockfd);
-                return -1;
+            if (fastStartup) {
+                if (!startSession(sendCommands, receiveChunk, username, password, mailbox, !fetchPartCommand, searchCriteria, cachedStatus, session)) {
+                    close(sockfd);
+                    return -1;
+                }
+                uidvalidity = session.uidvalidity;
+                mailboxStatus = session.status;
+                mailboxUnchangedSinceCache = session.unchanged;
+            } else {
+                // Authenticate using the provided credentials
+                if (!authenticate(sockfd, username, password, capabilities)) {
+                    close(sockfd);
+                    return -1;
+                }
+                if (!fetchPartCommand) {
+                    // The capabilities usually come with the authentication result, otherwise they are asked for
+                    if (capabilities.empty()) {
+                        capabilities = getCapabilities(sockfd);
+                    }
+                    getMailboxStatus(sockfd, mailbox, capabilities, mailboxStatus);
+                    mailboxUnchangedSinceCache = mailboxUnchanged(cachedStatus, mailboxStatus, searchCriteria);
+                }
+                // Select the mailbox
+                if (!mailboxUnchangedSinceCache && (uidvalidity = selectMailbox(sockfd, mailbox, messageCount)) == -1) {
+                    close(sockfd);
+                    return -1;
+                }
             }
-            // Select the mailbox
-            if ((uidvalidity = selectMailbox(sockfd, mailbox)) == -1) {
+            if (fetchPartCommand) {
+                // A part that is decoded anyway is fetched decoded by the server if it supports BINARY
+                if (fastStartup) {
+                    capabilities = session.capabilities;
+                } else if (capabilities.empty() && saveAttachments) {
+                    capabilities = getCapabilities(sockfd);
+                }
+                bool partSuccess = fetchAndSavePart(sockfd, partUID, positionalArgs[2], outDir, mailbox, server, saveAttachments,
+                                                    hasCapability(capabilities, "BINARY"));
+                if (!logout(sockfd)) cerr << "Error: Logout failed." << endl;
                 close(sockfd);
-                return -1;
+                return partSuccess ? 0 : -1;
+            }
+            if (fastStartup) {
+                serverUIDs = move(session.uids);
+            } else if (!mailboxUnchangedSinceCache) {
+                // Search for messages in the mailbox, using the compact ESEARCH form if the server supports it
+                searchSucceeded = searchMessages(sockfd, searchCriteria, serverUIDs, hasCapability(capabilities, "ESEARCH"), messageCount);
             }
-            // Search for messages in the mailbox
-            serverUIDs = searchMessages(sockfd, newMessagesOnly);
         }
 
-        if (serverUIDs.empty()) {
-            string outMsg = (newMessagesOnly ? "No new messages found in the mailbox: " : "No messages found in the mailbox: ") + mailbox;
+        // Set once every message matching the criteria is stored, the mailbox status is then cached for the next run
+        bool mailboxComplete = false;
+        if (sessionTimedOut()) {
+            // The server stopped responding, the session is given up
+        } else if (mailboxUnchangedSinceCache) {
+            cout << "Mailbox " << mailbox << " is up to date." << endl;
+        } else if (serverUIDs.empty()) {
+            string outMsg = (!args.getOption("--search").empty() ? "No messages matching the search criteria found in the mailbox: "
+                             : newMessagesOnly ? "No new messages found in the mailbox: " : "No messages found in the mailbox: ") + mailbox;
             cout << outMsg << endl;
+            mailboxComplete = searchSucceeded && createDir(outDir, mailbox, server);
         } else {
-            
+            startMemoryPhase("state check");
+
+            // After a UIDVALIDITY change, stored messages still on the server are renamed instead of downloaded again
+            vector<int> remappedUIDs;
+            if (remapMailbox(outDir, mailbox, server, uidvalidity, sendCommands, receiveChunk, remappedUIDs) &&
+                !remappedUIDs.empty()) {
+                cout << "UIDVALIDITY of mailbox " << mailbox << " changed, " << remappedUIDs.size() << " stored messages were matched and kept." << endl;
+                if (buildIndex || fs::is_directory(outDir + "/" + server + "/" + mailbox + "/.index")) {
+                    // The index of the previous generation is discarded, the kept messages are indexed from their files
+                    MailIndex remappedIndex(outDir + "/" + server + "/" + mailbox, uidvalidity);
+                    for (int messageUID : remappedUIDs) {
+                        remappedIndex.addMessageFile(messageUID, outDir + "/" + server + "/" + mailbox + "/message_uid_" + to_string(messageUID) + ".eml");
+                    }
+                    remappedIndex.save();
+                }
+            }
+
             // Check if the directory is valid and if we need to download any new messages
-            vector<int> uidsToDownload = checkValidity(outDir, uidvalidity, mailbox, serverUIDs, server, headersOnly);
+            vector<int> uidsToDownload = checkValidity(outDir, uidvalidity, mailbox, serverUIDs, server, headersOnly, finishPartial);
+            MailboxState storedState;
+            if (!readStateFile(outDir + "/" + server + "/" + mailbox, storedState) || storedState.uidvalidity != uidvalidity) {
+                storedState = MailboxState();
+            }
+            unordered_set<int> &partialUIDs = storedState.partialUIDs;
+            unordered_set<int> &headerUIDs = storedState.headerUIDs;
+            unordered_set<int> unfetchedUIDs(uidsToDownload.begin(), uidsToDownload.end());
 
             if (uidsToDownload.empty()) {
                 cout << "Mailbox " << mailbox << " is up to date." << endl;
             } else {
-                // Create the directory if it doesn't exist and store the current state
-                createDir(outDir, uidvalidity, mailbox, uidsToDownload, server, headersOnly);
+                startMemoryPhase("download");
 
-                // Fetch and save each message using the UIDs that need to be downloaded
-                for (int messageUID : uidsToDownload) {
-                    bool fetchSuccess;
+                // Create the directory if it doesn't exist
+                createDir(outDir, mailbox, server);
+
+                // Prefetch the sizes of all candidates in one command to find the messages above the threshold
+                unordered_map<int, long> messageSizes;
+                if ((maxSize > 0 && !headersOnly && !lazyAttachments) || order == "smallest") {
+                    messageSizes = useSSL ? fetchMessageSizesBIO(bio, uidsToDownload) : fetchMessageSizes(sockfd, uidsToDownload);
+                }
+                uidsToDownload = scheduleDownloads(uidsToDownload, order, messageSizes, weights);
+                bool budgetReached = false;
+                int partialCount = 0;
+                PipelineStats stats;
+
+                // With kernel TLS the bodies are spliced to the files as received, which needs one message at a time;
+                // spliced data bypasses the transport functions, so it cannot be recorded
+                bool spliceBodies = kernelTls && useSSL && !headersOnly && !lazyAttachments && !saveAttachments &&
+                                    outputLineEnding() == LineEnding::Keep && !recording();
+                if (spliceBodies && !kernelTlsReceiveBIO(bio)) {
+                    cerr << "Warning: Kernel TLS is not available for this connection, messages are downloaded as usual." << endl;
+                    spliceBodies = false;
+                }
+
+                // Queued partial messages are finished in full, other large messages are only saved partially
+                auto partialBytesOf = [&](int messageUID) -> long {
+                    bool finishing = finishPartial && partialUIDs.count(messageUID);
+                    auto size = messageSizes.find(messageUID);
+                    return maxSize > 0 && !finishing && size != messageSizes.end() && size->second > maxSize ? partialSize : 0;
+                };
 
-                    // Call the appropriate fetch function based on connection type
-                    if (useSSL) {
-                        fetchSuccess = fetchAndSaveMessageBIO(bio, messageUID, outDir, headersOnly, mailbox, server);
+                // Only the messages downloaded in this run are added to the index; it is opened only with --index,
+                // as opening it drops the segments of another UIDVALIDITY
+                string mailboxDir = outDir + "/" + server + "/" + mailbox;
+                optional<MailIndex> mailIndex;
+                if (buildIndex) {
+                    mailIndex.emplace(mailboxDir, uidvalidity);
+                }
+                ProgressJournal journal(mailboxDir, uidvalidity, headersOnly);
+                MessagePaths paths(mailboxDir);
+
+                // Bookkeeping of a saved message: progress journal, partial queue and index
+                auto messageSaved = [&](int messageUID, long partialBytes) {
+                    unfetchedUIDs.erase(messageUID);
+                    const string &messagePath = paths.message(messageUID);
+                    if (!journal.record(messageUID, partialBytes > 0, messagePath)) {
+                        cerr << "Warning: Could not record the progress of message with UID " << messageUID << endl;
+                    }
+                    if (partialBytes > 0) {
+                        partialUIDs.insert(messageUID);
+                        partialCount++;
                     } else {
-                        fetchSuccess = fetchAndSaveMessage(sockfd, messageUID, outDir, headersOnly, mailbox, server);
+                        partialUIDs.erase(messageUID);
+                    }
+                    if (mailIndex) {
+                        mailIndex->addMessageFile(messageUID, messagePath);
                     }
+                };
 
-                    // Check if fetching was successful
-                    if (!fetchSuccess) {
+                if (bulkHeaders) {
+                    // Headers of many messages per command, streamed into the consolidated header archive
+                    HeaderArchive archive(mailboxDir, uidvalidity);
+                    if (!archive.isOpen()) {
+                        cerr << "Error: Could not open the header archive in " << mailboxDir << "." << endl;
+                    } else {
+                        bool fetched = fetchHeaderArchive(archive, uidsToDownload, sendCommands, receiveChunk, deadline,
+                                                          [&](int messageUID, string_view header) {
+                            if (mailIndex) {
+                                mailIndex->addMessage(messageUID, header);
+                            }
+                        });
+                        for (int messageUID : uidsToDownload) {
+                            if (archive.contains(messageUID)) {
+                                unfetchedUIDs.erase(messageUID);
+                            }
+                        }
+                        budgetReached = !unfetchedUIDs.empty() && chrono::steady_clock::now() >= deadline && !sessionTimedOut();
+                        if (!fetched && !sessionTimedOut()) {
+                            cerr << "Error: Fetching the headers failed, " << unfetchedUIDs.size() << " messages are left for the next run." << endl;
+                        } else if (fetched && !budgetReached && !unfetchedUIDs.empty()) {
+                            cerr << "Warning: The server sent no header fields for " << unfetchedUIDs.size() << " messages, they are left for the next run." << endl;
+                        }
+                    }
+                } else if (lazyAttachments && !headersOnly) {
+                    // The text parts depend on the BODYSTRUCTURE, so these messages are fetched one by one
+                    for (int messageUID : uidsToDownload) {
+                        if (sessionTimedOut()) {
+                            break;
+                        }
+                        if (chrono::steady_clock::now() >= deadline) {
+                            budgetReached = true;
+                            break;
+                        }
+                        bool fetchSuccess = useSSL ? fetchAndSaveMessageTextBIO(bio, messageUID, outDir, mailbox, server)
+                                                   : fetchAndSaveMessageText(sockfd, messageUID, outDir, mailbox, server);
+                        if (!fetchSuccess) {
+                            cerr << "Error: Failed to fetch or save message with UID " << messageUID << endl;
+                        } else {
+                            messageSaved(messageUID, 0);
+                        }
+                    }
+                } else if (spliceBodies) {
+                    for (int messageUID : uidsToDownload) {
+                        if (sessionTimedOut()) {
+                            break;
+                        }
+                        if (chrono::steady_clock::now() >= deadline) {
+                            budgetReached = true;
+                            break;
+                        }
+                        long partialBytes = partialBytesOf(messageUID);
+                        SpliceFetchResult result = fetchAndSaveMessageSpliceBIO(bio, messageUID, paths, partialBytes);
+                        if (result == SpliceFetchResult::Saved) {
+                            messageSaved(messageUID, partialBytes);
+                            continue;
+                        }
                         cerr << "Error: Failed to fetch or save message with UID " << messageUID << endl;
+                        if (result == SpliceFetchResult::ConnectionLost) {
+                            // The responses are out of step with the commands, the session is given up like after a timeout
+                            connectionLost = true;
+                            break;
+                        }
                     }
+                } else {
+                    // Fetch the messages with several commands in flight, the window adapts to the link
+                    FetchPipeline pipeline(
+                        [&](int messageUID, long partialBytes, size_t command, string &out) {
+                            appendMessageFetchCommand(out, messageUID, command, partialBytes, saveAttachments);
+                        },
+                        sendCommands, receiveChunk, pipelineMemory);
+                    pipeline.setDeadline(deadline);
+
+                    for (int messageUID : uidsToDownload) {
+                        long partialBytes = partialBytesOf(messageUID);
+                        auto size = messageSizes.find(messageUID);
+                        size_t expectedBytes = size == messageSizes.end() ? 0 : (partialBytes > 0 ? partialBytes : size->second);
+                        pipeline.add(messageUID, messageFetchCommandCount(headersOnly), expectedBytes, partialBytes);
+                    }
+
+                    bool fetched = pipeline.run([&](int messageUID, long partialBytes, const vector<string_view> &responses) {
+                        if (!saveFetchedMessage(messageUID, responses, paths, headersOnly, partialBytes, saveAttachments)) {
+                            cerr << "Error: Failed to fetch or save message with UID " << messageUID << endl;
+                        } else {
+                            messageSaved(messageUID, partialBytes);
+                        }
+                    });
+                    if (!fetched && !sessionTimedOut()) {
+                        cerr << "Error: Connection to the server failed, " << unfetchedUIDs.size() << " messages are left for the next run." << endl;
+                    }
+                    stats = pipeline.stats();
+                    budgetReached = pipeline.deadlineReached() && !sessionTimedOut();
+                }
+                if (mailIndex) {
+                    mailIndex->save();
                 }
-                string outMsg = formatOutMsg(mailbox, uidsToDownload.size(), newMessagesOnly);
+                string outMsg = formatOutMsg(mailbox, uidsToDownload.size() - unfetchedUIDs.size(), newMessagesOnly);
                 cout << outMsg << endl;
+                if (partialCount > 0) {
+                    cout << "Saved " << partialCount << " large messages partially, use --finish-partial to download them in full." << endl;
+                }
+                if (budgetReached) {
+                    cout << "Time budget reached, " << unfetchedUIDs.size() << " messages are left for the next run." << endl;
+                }
+                endMemoryPhase(uidsToDownload.size() - unfetchedUIDs.size());
+                if (printStats && !bulkHeaders) {
+                    printPipelineStats(stats);
+                }
+
+                // The messages saved in this run are complete unless only their headers were downloaded
+                for (int messageUID : uidsToDownload) {
+                    if (unfetchedUIDs.count(messageUID)) {
+                        continue;
+                    }
+                    if (headersOnly) {
+                        headerUIDs.insert(messageUID);
+                    } else {
+                        headerUIDs.erase(messageUID);
+                    }
+                }
+            }
+            startMemoryPhase("state update");
+            // Update the state file with the new UIDs after download, messages that failed are fetched again next time.
+            // Stored messages outside the criteria of this run stay; only a search of all messages shows which are gone.
+            set<int> savedUIDSet(storedState.uids.begin(), storedState.uids.end());
+            for (int uid : serverUIDs) {
+                if (!unfetchedUIDs.count(uid)) {
+                    savedUIDSet.insert(uid);
+                }
+            }
+            if (searchCriteria == "ALL") {
+                unordered_set<int> present(serverUIDs.begin(), serverUIDs.end());
+                erase_if(savedUIDSet, [&](int uid) { return !present.count(uid); });
             }
-            // Update the state file with the new UIDs after download
-            updateStateFile(outDir, mailbox, uidvalidity, serverUIDs, server, headersOnly);
+            vector<int> savedUIDs(savedUIDSet.begin(), savedUIDSet.end());
+            vector<int> remainingPartialUIDs, savedHeaderUIDs;
+            for (int uid : savedUIDs) {
+                if (partialUIDs.count(uid)) {
+                    remainingPartialUIDs.push_back(uid);
+                }
+                if (headerUIDs.count(uid)) {
+                    savedHeaderUIDs.push_back(uid);
+                }
+            }
+            updateStateFile(outDir, mailbox, uidvalidity, savedUIDs, server, savedHeaderUIDs, remainingPartialUIDs);
+            mailboxComplete = unfetchedUIDs.empty() && !sessionTimedOut();
+        }
+        if (mailboxComplete && mailboxStatus.uidvalidity == uidvalidity) {
+            writeStatusCache(outDir, mailbox, server, headersOnly, searchCriteria, mailboxStatus);
         }
 
         // Logout and close the connection
-       if (useSSL ? !logoutBIO(bio) : !logout(sockfd)) cerr << "Error: Logout failed." << endl;
+       if (!sessionTimedOut() && !connectionLost && !replayFailed() && (useSSL ? !logoutBIO(bio) : !logout(sockfd))) cerr << "Error: Logout failed." << endl;
+        if (printMemStats) {
+            printMemoryStats();
+        }
     } catch (const exception &ex) {
         cerr << "Error: " << ex.what() << endl;
         if (sockfd != -1) close(sockfd);
@@ -153,5 +620,5 @@ int main(int argc, char *argv[]) {
     if (sockfd != -1) close(sockfd);
     if (bio) BIO_free_all(bio);
     if (sslCtx) SSL_CTX_free(sslCtx);
-    return 0;
+    return sessionTimedOut() ? -2 : connectionLost || replayFailed() ? -1 : 0;
 }
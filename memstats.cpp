@@ -0,0 +1,200 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#include "memstats.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <malloc.h>
+#include <new>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+static atomic<size_t> allocationCount{0};
+static atomic<size_t> allocatedBytes{0};
+
+// Live heap, tracked only after enableMemoryTracking; blocks allocated before it may make it slightly negative
+static atomic<bool> trackingEnabled{false};
+static atomic<long long> liveBytes{0};
+static atomic<long long> peakLiveBytes{0};
+
+static vector<MemoryPhase> phases;
+static bool phaseRunning = false;
+static bool phasePeakRssReset = false;      // Otherwise VmHWM counts from the start of the process
+static AllocationCounters phaseStart;
+
+bool allocationCountingEnabled() {
+#ifdef MEMSTATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+AllocationCounters allocationCounters() {
+    AllocationCounters counters;
+    counters.allocations = allocationCount.load(memory_order_relaxed);
+    counters.bytes = allocatedBytes.load(memory_order_relaxed);
+    return counters;
+}
+
+// Reads the resident set and its high-water mark from /proc without allocating, -1 if not available
+static void readRss(long &rssKiB, long &peakRssKiB) {
+    rssKiB = peakRssKiB = -1;
+    int fd = open("/proc/self/status", O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    char status[8192];
+    ssize_t length = read(fd, status, sizeof(status) - 1);
+    close(fd);
+    if (length <= 0) {
+        return;
+    }
+    status[length] = '\0';
+    if (const char *line = strstr(status, "VmRSS:")) {
+        rssKiB = strtol(line + 6, nullptr, 10);
+    }
+    if (const char *line = strstr(status, "VmHWM:")) {
+        peakRssKiB = strtol(line + 6, nullptr, 10);
+    }
+}
+
+// Resets VmHWM to the current resident set (Linux 4.0+), returns false if the kernel does not allow it
+static bool resetPeakRss() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool reset = write(fd, "5", 1) == 1;
+    close(fd);
+    return reset;
+}
+
+void enableMemoryTracking() {
+    trackingEnabled.store(true, memory_order_relaxed);
+}
+
+void startMemoryPhase(const char *name) {
+    if (!trackingEnabled.load(memory_order_relaxed)) {
+        return;
+    }
+    endMemoryPhase();
+    phases.push_back(MemoryPhase());
+    phases.back().name = name;
+    peakLiveBytes.store(liveBytes.load(memory_order_relaxed), memory_order_relaxed);
+    phasePeakRssReset = resetPeakRss();
+    phaseStart = allocationCounters();
+    phaseRunning = true;
+}
+
+void endMemoryPhase(size_t messages) {
+    if (!phaseRunning) {
+        return;
+    }
+    AllocationCounters now = allocationCounters();
+    MemoryPhase &phase = phases.back();
+    phase.counters.allocations = now.allocations - phaseStart.allocations;
+    phase.counters.bytes = now.bytes - phaseStart.bytes;
+    phase.peakHeapBytes = max(peakLiveBytes.load(memory_order_relaxed), 0LL);
+    phase.messages = messages;
+    readRss(phase.rssKiB, phase.peakRssKiB);
+    if (!phasePeakRssReset) {
+        phase.peakRssKiB = -1;
+    }
+    phaseRunning = false;
+}
+
+void printMemoryStats() {
+    endMemoryPhase();
+    if (phases.empty()) {
+        return;
+    }
+    size_t peakHeapBytes = 0;
+    long peakRssKiB = -1;
+    const double MiB = 1024 * 1024;
+    if (!allocationCountingEnabled()) {
+        cout << "Memory: allocations and the heap are counted only in a build with make MEMSTATS=1." << endl;
+    }
+    cout << fixed << setprecision(2);
+    for (const MemoryPhase &phase : phases) {
+        // Without the allocation counters of a MEMSTATS build only the resident set is known
+        const char *separator = " ";
+        cout << "Memory (" << phase.name << "):";
+        if (allocationCountingEnabled()) {
+            cout << separator << phase.counters.allocations << " allocations, " << phase.counters.bytes / MiB
+                 << " MiB allocated, heap peak " << phase.peakHeapBytes / MiB << " MiB";
+            separator = ", ";
+        }
+        if (phase.peakRssKiB >= 0) {
+            cout << separator << "RSS peak " << phase.peakRssKiB / 1024.0 << " MiB";
+            separator = ", ";
+        }
+        if (phase.rssKiB >= 0) {
+            cout << separator << "RSS " << phase.rssKiB / 1024.0 << " MiB at the end";
+            separator = ", ";
+        }
+        if (allocationCountingEnabled() && phase.messages > 0) {
+            cout << separator << "per message " << static_cast<double>(phase.counters.allocations) / phase.messages << " allocations and "
+                 << static_cast<double>(phase.counters.bytes) / phase.messages / 1024 << " KiB";
+        }
+        cout << endl;
+        peakHeapBytes = max(peakHeapBytes, phase.peakHeapBytes);
+        peakRssKiB = max(peakRssKiB, phase.peakRssKiB);
+    }
+    const char *separator = " ";
+    cout << "Memory (run):";
+    if (allocationCountingEnabled()) {
+        cout << separator << "heap peak " << peakHeapBytes / MiB << " MiB";
+        separator = ", ";
+    }
+    if (peakRssKiB >= 0) {
+        cout << separator << "RSS peak " << peakRssKiB / 1024.0 << " MiB";
+    }
+    cout << endl << defaultfloat;
+}
+
+#ifdef MEMSTATS
+// Raises the high-water mark of the live heap if the new value exceeds it
+static void raisePeak(long long live) {
+    long long peak = peakLiveBytes.load(memory_order_relaxed);
+    while (live > peak && !peakLiveBytes.compare_exchange_weak(peak, live, memory_order_relaxed)) {
+    }
+}
+
+// The replaced operator new counts every allocation; array and nothrow forms call it by default
+void *operator new(size_t size) {
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    allocatedBytes.fetch_add(size, memory_order_relaxed);
+    void *memory = malloc(size ? size : 1);
+    if (!memory) {
+        throw bad_alloc();
+    }
+    if (trackingEnabled.load(memory_order_relaxed)) {
+        long long usable = malloc_usable_size(memory);
+        raisePeak(liveBytes.fetch_add(usable, memory_order_relaxed) + usable);
+    }
+    return memory;
+}
+
+void operator delete(void *memory) noexcept {
+    if (memory && trackingEnabled.load(memory_order_relaxed)) {
+        liveBytes.fetch_sub(malloc_usable_size(memory), memory_order_relaxed);
+    }
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept {
+    operator delete(memory);
+}
+#endif // MEMSTATS
@@ -0,0 +1,71 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include <cstddef>
+
+/**
+ * Counters of the global operator new. It is replaced in memstats.cpp only in builds with MEMSTATS defined
+ * (make MEMSTATS=1), so regular builds keep the allocator's fast path; the counters then stay zero.
+ */
+struct AllocationCounters {
+    size_t allocations = 0;         // Number of heap allocations
+    size_t bytes = 0;               // Bytes requested by them
+};
+
+/**
+ * Tells whether the allocations are counted, i.e. the programme was built with MEMSTATS.
+ * @return - Returns true in a MEMSTATS build, false otherwise.
+ */
+bool allocationCountingEnabled();
+
+/**
+ * Returns the counters of all heap allocations made so far by the process.
+ * @return - The current counters.
+ */
+AllocationCounters allocationCounters();
+
+/**
+ * Memory use of one phase of a run (--mem-stats).
+ */
+struct MemoryPhase {
+    const char *name = "";
+    AllocationCounters counters;    // Allocations made during the phase
+    size_t peakHeapBytes = 0;       // High-water mark of the live heap during the phase
+    long peakRssKiB = -1;           // High-water mark of the resident set during the phase, -1 if it cannot be reset
+    long rssKiB = -1;               // Resident set at the end of the phase, -1 if unknown
+    size_t messages = 0;            // Messages saved during the phase
+};
+
+/**
+ * Starts tracking the live heap (the bytes allocated and not yet freed) and the phases of the run. The live heap
+ * costs a malloc_usable_size call per allocation and deallocation, so it is tracked only on request; the phase
+ * functions do nothing until this is called. Without MEMSTATS only the resident set of the phases is tracked.
+ */
+void enableMemoryTracking();
+
+/**
+ * Starts a phase of the run, the running phase is ended first. The high-water marks of the live heap and of the
+ * resident set (VmHWM, reset through /proc/self/clear_refs) start from the current values.
+ * @param name - The name of the phase, a string literal.
+ */
+void startMemoryPhase(const char *name);
+
+/**
+ * Ends the running phase, if any.
+ * @param messages - The messages saved during the phase, used for the figures per message.
+ */
+void endMemoryPhase(size_t messages = 0);
+
+/**
+ * Ends the running phase and prints the counters and high-water marks of all phases, and the peaks of the whole run.
+ */
+void printMemoryStats();
+
+#endif // MEMSTATS_H
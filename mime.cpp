@@ -0,0 +1,490 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#include "mime.h"
+#include "codec.h"
+
+// Node of a parenthesized IMAP list, e.g. a parsed BODYSTRUCTURE
+struct ListItem {
+    bool isList = false;
+    bool isNil = false;
+    string value;
+    vector<ListItem> items;
+};
+
+static string toLower(string value) {
+    transform(value.begin(), value.end(), value.begin(), [](unsigned char c) { return tolower(c); });
+    return value;
+}
+
+// Parses one item (list, quoted string, literal or atom) starting at pos
+static bool parseListItem(string_view in, size_t &pos, ListItem &item) {
+    while (pos < in.size() && in[pos] == ' ') {
+        ++pos;
+    }
+    if (pos >= in.size()) {
+        return false;
+    }
+
+    if (in[pos] == '(') {
+        item.isList = true;
+        ++pos;
+        while (true) {
+            while (pos < in.size() && in[pos] == ' ') {
+                ++pos;
+            }
+            if (pos >= in.size()) {
+                return false;
+            }
+            if (in[pos] == ')') {
+                ++pos;
+                return true;
+            }
+            ListItem child;
+            if (!parseListItem(in, pos, child)) {
+                return false;
+            }
+            item.items.push_back(move(child));
+        }
+    }
+
+    if (in[pos] == '"') {
+        for (++pos; pos < in.size() && in[pos] != '"'; ++pos) {
+            if (in[pos] == '\\' && pos + 1 < in.size()) {
+                ++pos;
+            }
+            item.value += in[pos];
+        }
+        ++pos;
+        return pos <= in.size();
+    }
+
+    if (in[pos] == '{') {
+        size_t length;
+        auto [ptr, ec] = from_chars(in.data() + pos + 1, in.data() + in.size(), length);
+        size_t start = (ptr - in.data()) + 3;   // Skip "}\r\n"
+        if (ec != errc() || start + length > in.size()) {
+            return false;
+        }
+        item.value = string(in.substr(start, length));
+        pos = start + length;
+        return true;
+    }
+
+    size_t end = in.find_first_of(" ()", pos);
+    if (end == string_view::npos) {
+        end = in.size();
+    }
+    item.value = string(in.substr(pos, end - pos));
+    item.isNil = item.value == "NIL";
+    pos = end;
+    return true;
+}
+
+// Finds the value of a parameter in a ("KEY" "value" ...) list
+static string findParameter(const ListItem &parameters, const string &key) {
+    for (size_t i = 0; i + 1 < parameters.items.size(); i += 2) {
+        if (toLower(parameters.items[i].value) == key) {
+            return parameters.items[i + 1].value;
+        }
+    }
+    return "";
+}
+
+// Walks the body structure and collects its leaf parts
+static void collectParts(const ListItem &body, const string &section, vector<MimePart> &parts) {
+    if (!body.isList || body.items.empty()) {
+        return;
+    }
+
+    // A multipart body starts with the list of its children followed by the subtype
+    if (body.items[0].isList) {
+        int childNumber = 1;
+        for (const ListItem &child : body.items) {
+            if (!child.isList) {
+                break;
+            }
+            collectParts(child, section.empty() ? to_string(childNumber) : section + "." + to_string(childNumber), parts);
+            childNumber++;
+        }
+        return;
+    }
+
+    if (body.items.size() < 7) {
+        return;
+    }
+
+    MimePart part;
+    part.section = section.empty() ? "1" : section;
+    part.type = toLower(body.items[0].value);
+    part.subtype = toLower(body.items[1].value);
+    part.encoding = body.items[5].isNil ? "7BIT" : body.items[5].value;
+    from_chars(body.items[6].value.data(), body.items[6].value.data() + body.items[6].value.size(), part.size);
+    part.name = findParameter(body.items[2], "name");
+
+    // Extension data follows the basic fields: text adds the line count, message/rfc822 adds envelope, body and lines
+    size_t basicFields = 7;
+    if (part.type == "text") {
+        basicFields = 8;
+    } else if (part.type == "message" && part.subtype == "rfc822") {
+        basicFields = 10;
+    }
+    size_t dispositionIndex = basicFields + 1;
+    if (dispositionIndex < body.items.size() && body.items[dispositionIndex].isList &&
+        body.items[dispositionIndex].items.size() >= 2) {
+        string fileName = findParameter(body.items[dispositionIndex].items[1], "filename");
+        if (!fileName.empty()) {
+            part.name = fileName;
+        }
+    }
+
+    parts.push_back(part);
+}
+
+vector<MimePart> parseBodyStructure(const string &response) {
+    vector<MimePart> parts;
+    size_t pos = response.find("BODYSTRUCTURE ");
+    if (pos == string::npos) {
+        return parts;
+    }
+    pos += 14;
+
+    ListItem body;
+    if (parseListItem(response, pos, body)) {
+        collectParts(body, "", parts);
+    }
+    return parts;
+}
+
+bool isTextPart(const MimePart &part) {
+    return part.type == "text" && (part.subtype == "plain" || part.subtype == "html") && part.name.empty();
+}
+
+string buildTextFetchItems(const vector<MimePart> &parts) {
+    string items;
+    for (const MimePart &part : parts) {
+        if (isTextPart(part)) {
+            items += (items.empty() ? "" : " ") + string("BODY[") + part.section + "]";
+        }
+    }
+    return items.empty() ? "" : "(" + items + ")";
+}
+
+bool saveTextAndStubs(const string &path, const string &headerResponse, const string &textResponse, const vector<MimePart> &parts) {
+    ofstream outFile(path + ".eml");
+    if (!outFile) {
+        return false;
+    }
+
+    string message = "\r\n" + formatToRFC5322(headerResponse, true) + "\r\n";
+    for (const MimePart &part : parts) {
+        string text;
+        if (isTextPart(part) && extractFetchLiteral(textResponse, "BODY[" + part.section + "]", text)) {
+            message += text;
+        }
+    }
+    string converted;
+    char previous = 0;
+    convertLineEndings(message, converted, outputLineEnding(), previous);
+    outFile << converted;
+    outFile.close();
+
+    // Attachments are only described, they can be fetched later with the fetch-part command
+    if (all_of(parts.begin(), parts.end(), isTextPart)) {
+        return true;
+    }
+    ofstream stubFile(path + ".stubs");
+    if (!stubFile) {
+        return false;
+    }
+    stubFile << "# section\ttype\tencoding\tsize\tname\n";
+    for (const MimePart &part : parts) {
+        if (!isTextPart(part)) {
+            stubFile << part.section << "\t" << part.type << "/" << part.subtype << "\t" << part.encoding << "\t"
+                     << part.size << "\t" << part.name << "\n";
+        }
+    }
+    stubFile.close();
+    return true;
+}
+
+// Longest part of a file name taken from the message, so the whole name stays below the usual 255 byte limit
+const size_t MAX_PART_NAME_LENGTH = 200;
+
+string partFileName(int messageUID, const string &section, const string &name) {
+    string fileName = "message_uid_" + to_string(messageUID) + "_part_" + section;
+
+    // Never let a server supplied name leave the mailbox directory: separators and control characters are replaced,
+    // leading dots removed (no "..", no hidden files) and the length is capped
+    size_t nameStart = name.find_first_not_of('.');
+    string safeName = nameStart == string::npos ? "" : name.substr(nameStart, MAX_PART_NAME_LENGTH);
+    for (char &c : safeName) {
+        if (c == '/' || c == '\\' || static_cast<unsigned char>(c) < 0x20 || c == 0x7f) {
+            c = '_';
+        }
+    }
+    if (!safeName.empty()) {
+        fileName += "_" + safeName;
+    }
+    return fileName;
+}
+
+MimePart readStub(const string &path, const string &section) {
+    ifstream stubFile(path + ".stubs");
+    string line;
+
+    while (getline(stubFile, line)) {
+        istringstream fields(line);
+        MimePart part;
+        string type, size;
+        if (getline(fields, part.section, '\t') && part.section == section &&
+            getline(fields, type, '\t') && getline(fields, part.encoding, '\t') && getline(fields, size, '\t')) {
+            getline(fields, part.name);
+            part.type = type.substr(0, type.find('/'));
+            part.subtype = type.substr(type.find('/') + 1);
+            from_chars(size.data(), size.data() + size.size(), part.size);
+            return part;
+        }
+    }
+    return MimePart();
+}
+
+string decodeTransferEncoding(string_view data, const string &encoding) {
+    string decoded;
+    string lowerEncoding = toLower(encoding);
+
+    if (lowerEncoding == "base64") {
+        decodeBase64(data, decoded);
+    } else if (lowerEncoding == "quoted-printable") {
+        decodeQuotedPrintable(data, decoded);
+    } else {
+        decoded = string(data);
+    }
+    return decoded;
+}
+
+// Returns the unfolded value of a header field, or an empty string if the field is missing
+static string headerValue(string_view headers, const string &name) {
+    size_t pos = 0;
+    while (pos < headers.size()) {
+        size_t lineEnd = headers.find('\n', pos);
+        if (lineEnd == string_view::npos) {
+            lineEnd = headers.size();
+        }
+        string_view line = headers.substr(pos, lineEnd - pos);
+        pos = lineEnd + 1;
+
+        if (line.size() > name.size() && line[name.size()] == ':' && toLower(string(line.substr(0, name.size()))) == name) {
+            string value(line.substr(name.size() + 1));
+            // Continuation lines start with whitespace
+            while (pos < headers.size() && (headers[pos] == ' ' || headers[pos] == '\t')) {
+                lineEnd = headers.find('\n', pos);
+                if (lineEnd == string_view::npos) {
+                    lineEnd = headers.size();
+                }
+                value += " " + string(headers.substr(pos, lineEnd - pos));
+                pos = lineEnd + 1;
+            }
+            value.erase(remove(value.begin(), value.end(), '\r'), value.end());
+            size_t first = value.find_first_not_of(" \t");
+            return first == string::npos ? "" : value.substr(first);
+        }
+    }
+    return "";
+}
+
+// Returns a parameter of a structured header value, e.g. the boundary of a Content-Type
+static string headerParameter(const string &value, const string &key) {
+    string lowerValue = toLower(value);
+    size_t pos = 0;
+    while ((pos = lowerValue.find(key + "=", pos)) != string::npos) {
+        // The key has to start a parameter, not end another one ("name=" inside "filename=")
+        if (pos > 0 && lowerValue[pos - 1] != ';' && lowerValue[pos - 1] != ' ' && lowerValue[pos - 1] != '\t') {
+            pos += key.size();
+            continue;
+        }
+        size_t start = pos + key.size() + 1;
+        if (start < value.size() && value[start] == '"') {
+            size_t end = value.find('"', start + 1);
+            return value.substr(start + 1, end == string::npos ? string::npos : end - start - 1);
+        }
+        size_t end = value.find_first_of("; \t", start);
+        return value.substr(start, end == string::npos ? string::npos : end - start);
+    }
+    return "";
+}
+
+// Walks one MIME entity and writes the attachments it contains
+static bool extractEntity(string_view entity, const string &section, const string &dir, int messageUID, int &count) {
+    // Headers end with the first empty line
+    size_t headerEnd = entity.find("\r\n\r\n");
+    size_t bodyStart = headerEnd + 4;
+    if (headerEnd == string_view::npos) {
+        headerEnd = entity.find("\n\n");
+        bodyStart = headerEnd + 2;
+    }
+    if (entity.starts_with("\r\n") || entity.starts_with("\n")) {
+        headerEnd = 0;
+        bodyStart = entity.find('\n') + 1;
+    }
+    if (headerEnd == string_view::npos) {
+        return true;
+    }
+    string_view headers = entity.substr(0, headerEnd);
+    string_view body = entity.substr(bodyStart);
+
+    string contentType = headerValue(headers, "content-type");
+    string mediaType = toLower(contentType.substr(0, contentType.find(';')));
+    mediaType.erase(remove_if(mediaType.begin(), mediaType.end(), ::isspace), mediaType.end());
+
+    if (mediaType.starts_with("multipart/")) {
+        string boundary = headerParameter(contentType, "boundary");
+        if (boundary.empty()) {
+            return true;
+        }
+        string delimiter = "--" + boundary;
+
+        // Children are separated by delimiter lines, the closing delimiter ends with "--"
+        size_t pos = body.starts_with(delimiter) ? 0 : body.find("\n" + delimiter);
+        if (pos != 0 && pos != string_view::npos) {
+            pos++;
+        }
+        int childNumber = 1;
+        while (pos != string_view::npos && body.compare(pos + delimiter.size(), 2, "--") != 0) {
+            size_t start = body.find('\n', pos);
+            if (start == string_view::npos) {
+                break;
+            }
+            start++;
+            size_t next = body.find("\n" + delimiter, start);
+            if (next == string_view::npos) {
+                next = body.size();
+            }
+            size_t end = (next > start && body[next - 1] == '\r') ? next - 1 : next;
+
+            string childSection = section.empty() ? to_string(childNumber) : section + "." + to_string(childNumber);
+            if (!extractEntity(body.substr(start, end - start), childSection, dir, messageUID, count)) {
+                return false;
+            }
+            childNumber++;
+            pos = next == body.size() ? string_view::npos : next + 1;
+        }
+        return true;
+    }
+
+    // Leaf part: everything with a file name or a non-text type is an attachment
+    string disposition = headerValue(headers, "content-disposition");
+    string name = headerParameter(disposition, "filename");
+    if (name.empty()) {
+        name = headerParameter(contentType, "name");
+    }
+    bool isText = mediaType.empty() || mediaType.starts_with("text/");
+    if (name.empty() && (isText || toLower(disposition).starts_with("inline"))) {
+        return true;
+    }
+
+    string data = decodeTransferEncoding(body, headerValue(headers, "content-transfer-encoding"));
+    ofstream outFile(dir + "/" + partFileName(messageUID, section.empty() ? "1" : section, name), ios::binary);
+    if (!outFile) {
+        return false;
+    }
+    outFile.write(data.data(), data.size());
+    count++;
+    return true;
+}
+
+int extractAttachments(string_view message, const string &dir, int messageUID) {
+    int count = 0;
+    if (!extractEntity(message, "", dir, messageUID, count)) {
+        return -1;
+    }
+    return count;
+}
+
+BinaryFetchResult fetchBinaryPart(const function<int(const string &)> &send, const function<int(char *, size_t)> &receive, int messageUID,
+                                  const string &section, const string &path) {
+    string tag = generateTag();
+    if (send(tag + " UID FETCH " + to_string(messageUID) + " BINARY.PEEK[" + section + "]\r\n") <= 0) {
+        cerr << "Error: Failed to send UID FETCH command for part " << section << " of message " << messageUID << "." << endl;
+        return BinaryFetchResult::Failed;
+    }
+
+    string response;
+    char buffer[65536];
+    auto receiveMore = [&]() {
+        int bytesReceived = receive(buffer, sizeof(buffer));
+        if (bytesReceived <= 0) {
+            cerr << "Error: Could not receive part " << section << " of message " << messageUID << " from server." << endl;
+            return false;
+        }
+        response.append(buffer, bytesReceived);
+        return true;
+    };
+
+    // Read the response up to the announcement of the literal8, or to its end if the part is not sent as a literal
+    size_t literalOffset = 0, literalLength = 0, scanPos = 0;
+    bool announced;
+    while (!(announced = findFetchLiteralStart(response, literalOffset, literalLength)) && !hasTaggedCompletion(response, tag, scanPos)) {
+        if (!receiveMore()) {
+            return BinaryFetchResult::Failed;
+        }
+    }
+
+    if (!announced) {
+        // A refusal, or a short part sent as a quoted string or NIL
+        size_t statusStart = response.rfind("\r\n", scanPos - 3);
+        statusStart = statusStart == string::npos ? 0 : statusStart + 2;
+        if (response.compare(statusStart + tag.size() + 1, 2, "OK") != 0) {
+            return BinaryFetchResult::Unsupported;
+        }
+        string data;
+        if (!extractFetchLiteral(response, "BINARY[" + section + "]", data)) {
+            cerr << "Error: Part " << section << " of message " << messageUID << " not found." << endl;
+            return BinaryFetchResult::Failed;
+        }
+        ofstream outFile(path, ios::binary);
+        if (!outFile.write(data.data(), data.size())) {
+            cerr << "Error: Could not open file to save part " << section << " of message " << messageUID << "." << endl;
+            return BinaryFetchResult::Failed;
+        }
+        return BinaryFetchResult::Saved;
+    }
+
+    ofstream outFile(path, ios::binary);
+    if (!outFile) {
+        cerr << "Error: Could not open file to save part " << section << " of message " << messageUID << "." << endl;
+        return BinaryFetchResult::Failed;
+    }
+
+    // The decoded data goes to the file chunk by chunk as it arrives
+    size_t received = min(literalLength, response.size() - literalOffset);
+    outFile.write(response.data() + literalOffset, received);
+    response.erase(0, literalOffset + received);
+    while (received < literalLength && outFile) {
+        int bytesReceived = receive(buffer, min(sizeof(buffer), literalLength - received));
+        if (bytesReceived <= 0) {
+            cerr << "Error: Could not receive part " << section << " of message " << messageUID << " from server." << endl;
+            return BinaryFetchResult::Failed;
+        }
+        outFile.write(buffer, bytesReceived);
+        received += bytesReceived;
+    }
+    outFile.close();
+    if (!outFile) {
+        cerr << "Error: Could not save part " << section << " of message " << messageUID << "." << endl;
+        return BinaryFetchResult::Failed;
+    }
+
+    // The rest of the FETCH response and the tagged status follow the literal
+    scanPos = 0;
+    while (!hasTaggedCompletion(response, tag, scanPos)) {
+        if (!receiveMore()) {
+            return BinaryFetchResult::Failed;
+        }
+    }
+    return BinaryFetchResult::Saved;
+}
@@ -0,0 +1,118 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#ifndef MIME_H
+#define MIME_H
+
+#include "utils.h"
+#include <functional>
+
+using namespace std;
+
+/**
+ * One leaf part of a message as described by BODYSTRUCTURE.
+ */
+struct MimePart {
+    string section;                 // Part specifier used in BODY[...], e.g. "1" or "2.1"
+    string type;                    // Lower-case media type, e.g. "text"
+    string subtype;                 // Lower-case media subtype, e.g. "plain"
+    string encoding;                // Content-Transfer-Encoding, e.g. "BASE64"
+    long size = 0;                  // Size of the encoded part in bytes
+    string name;                    // File name from the disposition or content type parameters
+};
+
+/**
+ * Parses the BODYSTRUCTURE item of a UID FETCH response into its leaf parts.
+ * Nested multiparts are flattened, message/rfc822 parts are kept as a single leaf.
+ * @param response - The raw server response containing "BODYSTRUCTURE (...)".
+ * @return - The leaf parts in section order, or an empty vector if the structure could not be parsed.
+ */
+vector<MimePart> parseBodyStructure(const string &response);
+
+/**
+ * Checks whether a part is downloaded eagerly in the lazy attachment mode (text/plain and text/html).
+ * @param part - The part to check.
+ * @return - Returns true for text parts that are not attachments.
+ */
+bool isTextPart(const MimePart &part);
+
+/**
+ * Builds the FETCH item list that downloads all text parts of a message, e.g. "(BODY[1] BODY[2.1])".
+ * @param parts - The parts returned by parseBodyStructure.
+ * @return - The item list, or an empty string if the message has no text parts.
+ */
+string buildTextFetchItems(const vector<MimePart> &parts);
+
+/**
+ * Saves the header and text parts of a message and a stub file describing the attachments that were skipped.
+ * @param path - Path of the message file without the ".eml" extension.
+ * @param headerResponse - The raw header response from the server.
+ * @param textResponse - The raw response with the text parts (may be empty).
+ * @param parts - The parts returned by parseBodyStructure.
+ * @return - Returns true if successful, false otherwise.
+ */
+bool saveTextAndStubs(const string &path, const string &headerResponse, const string &textResponse, const vector<MimePart> &parts);
+
+/**
+ * Builds the file name a part fetched on demand is saved under, e.g. "message_uid_5_part_2_report.pdf".
+ * @param messageUID - The UID of the message.
+ * @param section - The part specifier.
+ * @param name - The file name of the part (may be empty).
+ * @return - The file name without directory.
+ */
+string partFileName(int messageUID, const string &section, const string &name);
+
+/**
+ * Looks up the stub of an attachment that was skipped in the lazy attachment mode.
+ * @param path - Path of the message file without the ".eml" extension.
+ * @param section - The part specifier.
+ * @return - The stub, or a part with an empty section if no stub was found.
+ */
+MimePart readStub(const string &path, const string &section);
+
+/**
+ * Decodes part data according to its Content-Transfer-Encoding; base64 and quoted-printable are decoded,
+ * any other encoding is returned unchanged.
+ * @param data - The encoded part data.
+ * @param encoding - The Content-Transfer-Encoding value (case-insensitive).
+ * @return - The decoded data.
+ */
+string decodeTransferEncoding(string_view data, const string &encoding);
+
+/**
+ * Parses the MIME structure of a complete RFC 5322 message and writes every attachment, decoded,
+ * next to the message file. The files are named like the parts downloaded by fetch-part.
+ * @param message - The complete raw message (BODY[]).
+ * @param dir - The mailbox directory the message is saved in.
+ * @param messageUID - The UID of the message.
+ * @return - The number of attachments written, or -1 if a file could not be written.
+ */
+int extractAttachments(string_view message, const string &dir, int messageUID);
+
+/**
+ * Result of fetching a part decoded by the server.
+ */
+enum class BinaryFetchResult {
+    Saved,                          // The decoded part was written to the file
+    Unsupported,                    // The server refused to decode the part (e.g. UNKNOWN-CTE), it has to be fetched with BODY
+    Failed                          // The connection or the file failed
+};
+
+/**
+ * Fetches a part decoded by the server with BINARY.PEEK (RFC 3516), which avoids the base64 overhead on the wire.
+ * The literal8 ("~{n}") is written to the file while it is received, the part is never held in memory as a whole.
+ * @param send - Sends a complete command.
+ * @param receive - Receives the next chunk of data.
+ * @param messageUID - The UID of the message.
+ * @param section - The part specifier.
+ * @param path - The file the decoded part is saved to.
+ * @return - Saved, Unsupported if the server answered the command with NO or BAD, Failed otherwise.
+ */
+BinaryFetchResult fetchBinaryPart(const function<int(const string &)> &send, const function<int(char *, size_t)> &receive, int messageUID,
+                                  const string &section, const string &path);
+
+#endif // MIME_H
@@ -0,0 +1,403 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#include "net.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <ctime>
+
+bool setNonBlocking(int sockfd, bool nonBlocking) {
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags < 0) {
+        return false;
+    }
+    flags = nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(sockfd, F_SETFL, flags) == 0;
+}
+
+// Deadline state of the connection used by the calling thread
+static thread_local int commandTimeoutMs = 0;
+static thread_local chrono::steady_clock::time_point commandDeadline;
+static thread_local bool timedOut = false;
+
+void setCommandTimeout(int timeoutMs) {
+    commandTimeoutMs = timeoutMs;
+    timedOut = false;
+}
+
+void armCommandDeadline() {
+    commandDeadline = chrono::steady_clock::now() + chrono::milliseconds(commandTimeoutMs);
+}
+
+bool sessionTimedOut() {
+    return timedOut;
+}
+
+int waitForSocket(int sockfd, short events) {
+    if (timedOut) {
+        return IO_TIMEOUT;
+    }
+    pollfd socket = {sockfd, events, 0};
+    while (true) {
+        int waitMs = commandTimeoutMs > 0 ? remainingMs(commandDeadline) : -1;
+        int ready = poll(&socket, 1, waitMs);
+        if (ready > 0) {
+            return 1;
+        }
+        if (ready == 0) {
+            cerr << "Error: Timed out after " << commandTimeoutMs << " ms waiting for the server." << endl;
+            timedOut = true;
+            return IO_TIMEOUT;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+int remainingMs(chrono::steady_clock::time_point deadline) {
+    auto remaining = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+    return remaining > 0 ? static_cast<int>(remaining) : 0;
+}
+
+// Size requested for the pipe between the socket and the file, larger pipes need fewer system calls
+const int SPLICE_PIPE_SIZE = 1024 * 1024;
+
+// Copies the data through user space when the socket cannot be spliced
+static long copyToFile(int sockfd, int fd, size_t length) {
+    char buffer[65536];
+    size_t copied = 0;
+    while (copied < length) {
+        ssize_t received = recv(sockfd, buffer, min(length - copied, sizeof(buffer)), 0);
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            int ready = waitForSocket(sockfd, POLLIN);
+            if (ready <= 0) {
+                return ready;
+            }
+            continue;
+        }
+        if (received <= 0 || write(fd, buffer, received) != received) {
+            return -1;
+        }
+        armCommandDeadline();
+        copied += received;
+    }
+    return copied;
+}
+
+long spliceToFile(int sockfd, int fd, size_t length) {
+    int pipeFds[2];
+    if (pipe(pipeFds) < 0) {
+        return copyToFile(sockfd, fd, length);
+    }
+    int pipeSize = fcntl(pipeFds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    if (pipeSize <= 0) {
+        pipeSize = 65536;
+    }
+
+    size_t moved = 0;
+    long result = 0;
+    while (moved < length) {
+        ssize_t inPipe = splice(sockfd, nullptr, pipeFds[1], nullptr, min(length - moved, static_cast<size_t>(pipeSize)),
+                                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (inPipe < 0 && (errno == EAGAIN || errno == EINTR)) {
+            int ready = waitForSocket(sockfd, POLLIN);
+            if (ready <= 0) {
+                result = ready;
+                break;
+            }
+            continue;
+        }
+        if (inPipe < 0 && moved == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // The kernel cannot splice from this socket, the data still does not pass through the TLS library
+            close(pipeFds[0]);
+            close(pipeFds[1]);
+            return copyToFile(sockfd, fd, length);
+        }
+        if (inPipe <= 0) {
+            result = -1;
+            break;
+        }
+        armCommandDeadline();
+
+        // Drain the pipe into the file before reading more from the socket
+        while (inPipe > 0) {
+            ssize_t written = splice(pipeFds[0], nullptr, fd, nullptr, inPipe, SPLICE_F_MOVE);
+            if (written <= 0) {
+                break;
+            }
+            inPipe -= written;
+            moved += written;
+        }
+        if (inPipe > 0) {
+            result = -1;
+            break;
+        }
+    }
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+    return moved == length ? static_cast<long>(moved) : result;
+}
+
+struct DnsCacheEntry {
+    long expires;                   // Unix time after which the entry is stale
+    vector<string> addresses;       // Textual IPv6 and IPv4 addresses
+};
+
+// The cache is loaded once and shared by all connections of the process
+static mutex dnsCacheMutex;
+static unordered_map<string, DnsCacheEntry> dnsCache;
+static bool dnsCacheLoaded = false;
+
+static string dnsCachePath() {
+    const char *cacheHome = getenv("XDG_CACHE_HOME");
+    if (cacheHome && *cacheHome) {
+        return string(cacheHome) + "/imapcl/dns_cache";
+    }
+    const char *home = getenv("HOME");
+    return home && *home ? string(home) + "/.cache/imapcl/dns_cache" : "";
+}
+
+// Reads lines of the form "host expires address..."
+static void readDnsCache(const string &path, unordered_map<string, DnsCacheEntry> &cache) {
+    ifstream file(path);
+    string line;
+    while (getline(file, line)) {
+        istringstream fields(line);
+        string host, address;
+        DnsCacheEntry entry;
+        if (!(fields >> host >> entry.expires)) {
+            continue;
+        }
+        while (fields >> address) {
+            entry.addresses.push_back(address);
+        }
+        if (!entry.addresses.empty()) {
+            cache[host] = move(entry);
+        }
+    }
+}
+
+// Merges the entries of the process into the file, so concurrent runs do not drop each other's hosts
+static void writeDnsCache(const string &path) {
+    unordered_map<string, DnsCacheEntry> merged;
+    readDnsCache(path, merged);
+    for (const auto &[host, entry] : dnsCache) {
+        auto found = merged.find(host);
+        if (found == merged.end() || found->second.expires < entry.expires) {
+            merged[host] = entry;
+        }
+    }
+
+    filesystem::path file(path);
+    error_code error;
+    filesystem::create_directories(file.parent_path(), error);
+    string tmpPath = path + ".tmp" + to_string(getpid());
+    ofstream out(tmpPath, ios::trunc);
+    for (const auto &[host, entry] : merged) {
+        out << host << " " << entry.expires;
+        for (const string &address : entry.addresses) {
+            out << " " << address;
+        }
+        out << "\n";
+    }
+    out.close();
+    if (!out || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        remove(tmpPath.c_str());
+    }
+}
+
+// Asks the system resolver for the textual addresses of the server
+static bool lookupServer(const string &server, vector<string> &addresses) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(server.c_str(), nullptr, &hints, &res) != 0) {
+        return false;
+    }
+    char text[INET6_ADDRSTRLEN];
+    for (addrinfo *address = res; address; address = address->ai_next) {
+        const void *raw = address->ai_family == AF_INET6
+            ? static_cast<const void *>(&reinterpret_cast<sockaddr_in6 *>(address->ai_addr)->sin6_addr)
+            : static_cast<const void *>(&reinterpret_cast<sockaddr_in *>(address->ai_addr)->sin_addr);
+        if (inet_ntop(address->ai_family, raw, text, sizeof(text)) &&
+            find(addresses.begin(), addresses.end(), text) == addresses.end()) {
+            addresses.push_back(text);
+        }
+    }
+    freeaddrinfo(res);
+    return !addresses.empty();
+}
+
+// Converts a textual address to a socket address with the given port
+static bool toSocketAddress(const string &text, int port, ResolvedAddress &resolved) {
+    memset(&resolved, 0, sizeof(resolved));
+    auto *ipv6 = reinterpret_cast<sockaddr_in6 *>(&resolved.address);
+    auto *ipv4 = reinterpret_cast<sockaddr_in *>(&resolved.address);
+    if (inet_pton(AF_INET6, text.c_str(), &ipv6->sin6_addr) == 1) {
+        ipv6->sin6_family = AF_INET6;
+        ipv6->sin6_port = htons(port);
+        resolved.length = sizeof(sockaddr_in6);
+    } else if (inet_pton(AF_INET, text.c_str(), &ipv4->sin_addr) == 1) {
+        ipv4->sin_family = AF_INET;
+        ipv4->sin_port = htons(port);
+        resolved.length = sizeof(sockaddr_in);
+    } else {
+        return false;
+    }
+    resolved.family = resolved.address.ss_family;
+    return true;
+}
+
+bool resolveServer(const string &server, int port, vector<ResolvedAddress> &addresses) {
+    vector<string> textAddresses;
+    ResolvedAddress resolved;
+
+    // Literal addresses need no lookup and are not cached
+    if (toSocketAddress(server, port, resolved)) {
+        addresses.push_back(resolved);
+        return true;
+    }
+
+    {
+        lock_guard<mutex> lock(dnsCacheMutex);
+        string path = dnsCachePath();
+        if (!dnsCacheLoaded) {
+            if (!path.empty()) {
+                readDnsCache(path, dnsCache);
+            }
+            dnsCacheLoaded = true;
+        }
+
+        long now = time(nullptr);
+        auto cached = dnsCache.find(server);
+        if (cached != dnsCache.end() && cached->second.expires > now) {
+            textAddresses = cached->second.addresses;
+        } else if (lookupServer(server, textAddresses)) {
+            dnsCache[server] = {now + DNS_CACHE_TTL_S, textAddresses};
+            if (!path.empty()) {
+                writeDnsCache(path);
+            }
+        } else if (cached != dnsCache.end()) {
+            // The resolver failed, the last known addresses are better than nothing
+            cerr << "Warning: Could not resolve " << server << ", using cached addresses." << endl;
+            textAddresses = cached->second.addresses;
+        }
+    }
+
+    for (const string &text : textAddresses) {
+        if (toSocketAddress(text, port, resolved)) {
+            addresses.push_back(resolved);
+        }
+    }
+    return !addresses.empty();
+}
+
+// Orders the addresses IPv6 first, then alternating between the families (RFC 8305 section 4)
+static vector<const ResolvedAddress *> interleaveFamilies(const vector<ResolvedAddress> &addresses) {
+    vector<const ResolvedAddress *> ipv6, ipv4, ordered;
+    for (const ResolvedAddress &address : addresses) {
+        (address.family == AF_INET6 ? ipv6 : ipv4).push_back(&address);
+    }
+    for (size_t i = 0; i < max(ipv6.size(), ipv4.size()); i++) {
+        if (i < ipv6.size()) ordered.push_back(ipv6[i]);
+        if (i < ipv4.size()) ordered.push_back(ipv4[i]);
+    }
+    return ordered;
+}
+
+int connectHappyEyeballs(const string &server, int port, int connectTimeoutMs) {
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(connectTimeoutMs);
+
+    // Resolve both address families
+    vector<ResolvedAddress> addresses;
+    if (!resolveServer(server, port, addresses)) {
+        cerr << "Není možné ověřit identitu serveru " << server << endl;
+        return -1;
+    }
+    vector<const ResolvedAddress *> candidates = interleaveFamilies(addresses);
+
+    vector<pollfd> pending;                         // Attempts still in progress
+    size_t next = 0;
+    int connected = -1;
+    auto nextAttempt = chrono::steady_clock::now();
+
+    while (connected < 0 && remainingMs(deadline) > 0 && (next < candidates.size() || !pending.empty())) {
+        // Start the next attempt when the previous one had its head start or failed
+        if (next < candidates.size() && (pending.empty() || chrono::steady_clock::now() >= nextAttempt)) {
+            const ResolvedAddress *address = candidates[next++];
+            int sockfd = socket(address->family, SOCK_STREAM, 0);
+            if (sockfd < 0) {
+                continue;
+            }
+            setNonBlocking(sockfd, true);
+            if (connect(sockfd, reinterpret_cast<const sockaddr *>(&address->address), address->length) == 0) {
+                connected = sockfd;
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                close(sockfd);
+                continue;
+            }
+            pending.push_back({sockfd, POLLOUT, 0});
+            nextAttempt = chrono::steady_clock::now() + chrono::milliseconds(CONNECTION_ATTEMPT_DELAY_MS);
+        }
+
+        // Wait for any attempt to finish, at most until the next attempt is due
+        int waitMs = remainingMs(deadline);
+        if (next < candidates.size()) {
+            waitMs = min(waitMs, remainingMs(nextAttempt));
+        }
+        if (poll(pending.data(), pending.size(), waitMs) < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (size_t i = 0; i < pending.size();) {
+            if (pending[i].revents == 0) {
+                i++;
+                continue;
+            }
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error == 0 && connected < 0) {
+                connected = pending[i].fd;
+            } else {
+                close(pending[i].fd);
+            }
+            pending.erase(pending.begin() + i);
+            // A failed attempt lets the next address start right away
+            nextAttempt = chrono::steady_clock::now();
+        }
+    }
+
+    for (const pollfd &attempt : pending) {
+        close(attempt.fd);
+    }
+
+    if (connected < 0) {
+        if (remainingMs(deadline) == 0) {
+            cerr << "Error: Connection to " << server << " on port " << port << " timed out after " << connectTimeoutMs << " ms." << endl;
+        } else {
+            cerr << "Není možné se připojit k serveru " << server << " na portu " << port << endl;
+        }
+        return -1;
+    }
+    return connected;
+}
@@ -0,0 +1,120 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#ifndef NET_H
+#define NET_H
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+
+using namespace std;
+
+// Default deadlines for connecting (including the TLS handshake) and for the server to send the next data of a command
+const int DEFAULT_CONNECT_TIMEOUT_MS = 10000;
+const int DEFAULT_COMMAND_TIMEOUT_MS = 120000;
+
+// How long a resolved address list is used without asking the resolver again (getaddrinfo does not report TTLs)
+const long DNS_CACHE_TTL_S = 300;
+
+// Returned by reads and writes whose command deadline passed
+const int IO_TIMEOUT = -2;
+
+// Delay before the next address is tried while earlier attempts are still pending (RFC 8305)
+const int CONNECTION_ATTEMPT_DELAY_MS = 250;
+
+/**
+ * One resolved address of the server.
+ */
+struct ResolvedAddress {
+    sockaddr_storage address;
+    socklen_t length;
+    int family;
+};
+
+/**
+ * Resolves the server to its IPv6 and IPv4 addresses through the DNS cache.
+ * The cache is kept in $XDG_CACHE_HOME/imapcl/dns_cache (or ~/.cache/imapcl/dns_cache) and shared by all
+ * connections of the process. Entries are refreshed after DNS_CACHE_TTL_S seconds; if the fresh lookup fails,
+ * the stale entry is used.
+ * @param server - The domain name or IP address of the server.
+ * @param port - The port number stored in the returned addresses.
+ * @param addresses - The vector to store the resolved addresses.
+ * @return - Returns true if at least one address was found, false otherwise.
+ */
+bool resolveServer(const string &server, int port, vector<ResolvedAddress> &addresses);
+
+/**
+ * Connects to the server using happy eyeballs (RFC 8305): the resolved IPv6 and IPv4 addresses are
+ * interleaved and raced with non-blocking connects started CONNECTION_ATTEMPT_DELAY_MS apart.
+ * The first connection to succeed wins, the others are closed.
+ * @param server - The domain name or IP address of the server.
+ * @param port - The port number to connect to.
+ * @param connectTimeoutMs - Deadline for the whole connection attempt in milliseconds.
+ * @return - The connected non-blocking socket, or -1 on failure.
+ */
+int connectHappyEyeballs(const string &server, int port, int connectTimeoutMs);
+
+/**
+ * Switches a socket between blocking and non-blocking mode.
+ * @param sockfd - The socket file descriptor.
+ * @param nonBlocking - If true, the socket is made non-blocking.
+ * @return - Returns true if successful, false otherwise.
+ */
+bool setNonBlocking(int sockfd, bool nonBlocking);
+
+/**
+ * Sets the deadline of every command sent on connections of the calling thread. It is an idle timeout: the deadline
+ * is armed when a command is sent and again whenever data arrives, so long responses are not cut off.
+ * @param timeoutMs - The time the server may stay silent during a command in milliseconds, 0 disables it.
+ */
+void setCommandTimeout(int timeoutMs);
+
+/**
+ * Starts the deadline anew; called when a command is sent, a connection is established or data arrives.
+ */
+void armCommandDeadline();
+
+/**
+ * Waits until the socket is ready for the given events or the command deadline passes.
+ * A timeout is reported once and marks the session as timed out.
+ * @param sockfd - The non-blocking socket file descriptor.
+ * @param events - The poll events to wait for (POLLIN or POLLOUT).
+ * @return - 1 if the socket is ready, IO_TIMEOUT on a timeout, -1 on error.
+ */
+int waitForSocket(int sockfd, short events);
+
+/**
+ * Tells whether a command on the connection of the calling thread timed out. Once it has,
+ * every further read or write fails immediately with IO_TIMEOUT, so the session can be reclaimed.
+ * @return - Returns true after a timeout, false otherwise.
+ */
+bool sessionTimedOut();
+
+/**
+ * Moves data from the socket straight to a file with splice(), without copying it through user space.
+ * On a socket with kernel TLS the data arrives decrypted. If the socket cannot be spliced, the data is copied
+ * with recv() and write().
+ * @param sockfd - The non-blocking socket file descriptor.
+ * @param fd - The file descriptor of the output file.
+ * @param length - The number of bytes to move.
+ * @return - The number of bytes moved, IO_TIMEOUT if the deadline passed, or -1 on error.
+ */
+long spliceToFile(int sockfd, int fd, size_t length);
+
+/**
+ * Returns the milliseconds left until the deadline (0 if it has passed).
+ * @param deadline - The deadline.
+ * @return - Remaining milliseconds.
+ */
+int remainingMs(chrono::steady_clock::time_point deadline);
+
+#endif // NET_H
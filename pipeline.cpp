@@ -0,0 +1,395 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#include "pipeline.h"
+#include "mime.h"
+#include "net.h"
+#include "memstats.h"
+#include <cmath>
+#include <iomanip>
+#include <limits>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+// Window gain over the bandwidth-delay product, leaves room for the delay of the client itself
+const double WINDOW_GAIN = 2.0;
+
+AdaptiveWindow::AdaptiveWindow(size_t memoryCap) : memoryCap(memoryCap) {
+    roundEnd = currentDepth;
+}
+
+void AdaptiveWindow::onResponse(double latencyMs, size_t bytes) {
+    completed++;
+    delivered += bytes;
+    minRttMs = minRttMs == 0 ? latencyMs : min(minRttMs, latencyMs);
+    avgResponseBytes = avgResponseBytes == 0 ? bytes : avgResponseBytes + (bytes - avgResponseBytes) / 8;
+
+    // A delivery rate sample spans at least one round trip, shorter ones only measure bursts
+    auto now = chrono::steady_clock::now();
+    double elapsedMs = chrono::duration<double, milli>(now - sampleStart).count();
+    if (elapsedMs >= max(minRttMs, 1.0)) {
+        bandwidthSamples[bandwidthSampleCount++ % bandwidthSamples.size()] = (delivered - sampleDelivered) * 1000.0 / elapsedMs;
+        maxBandwidth = *max_element(bandwidthSamples.begin(), bandwidthSamples.end());
+        sampleStart = now;
+        sampleDelivered = delivered;
+    }
+
+    // A round ends when the commands of the window at its start have completed
+    if (completed < roundEnd) {
+        return;
+    }
+    roundEnd = completed + currentDepth;
+
+    if (startup) {
+        // Keep doubling while the bandwidth grows by a quarter per round, like BBR startup
+        if (maxBandwidth > roundBandwidth * 1.25) {
+            roundBandwidth = maxBandwidth;
+            roundsWithoutGrowth = 0;
+            currentDepth = min(currentDepth * 2, MAX_PIPELINE_DEPTH);
+        } else if (++roundsWithoutGrowth >= 3) {
+            startup = false;
+        }
+    }
+    if (!startup && maxBandwidth > 0 && avgResponseBytes > 0) {
+        // Follow the bandwidth-delay product expressed in responses
+        double bdpResponses = maxBandwidth * (minRttMs / 1000.0) / avgResponseBytes;
+        currentDepth = clamp(static_cast<int>(ceil(WINDOW_GAIN * bdpResponses)) + 1, 1, MAX_PIPELINE_DEPTH);
+    }
+    limitByMemory();
+    maxDepth = max(maxDepth, currentDepth);
+}
+
+void AdaptiveWindow::limitByMemory() {
+    if (avgResponseBytes > 0) {
+        int memoryDepth = static_cast<int>(memoryCap / avgResponseBytes);
+        currentDepth = max(1, min(currentDepth, memoryDepth));
+    }
+}
+
+void AdaptiveWindow::fillStats(PipelineStats &stats) const {
+    stats.minRttMs = minRttMs;
+    stats.bandwidth = maxBandwidth;
+    stats.depth = currentDepth;
+    stats.maxDepth = maxDepth;
+    stats.batch = batch();
+}
+
+FetchPipeline::FetchPipeline(CommandWriter writeCommand, SendFunction send, ReceiveFunction receive, size_t memoryCap)
+    : writeCommand(move(writeCommand)), send(move(send)), receive(move(receive)), memoryCap(memoryCap), window(memoryCap),
+      inFlight(MAX_PIPELINE_DEPTH) {}
+
+void FetchPipeline::add(int uid, size_t commandCount, size_t expectedBytes, long parameter) {
+    if (commandCount > 0) {
+        jobs.push_back({uid, commandCount, expectedBytes, parameter});
+    }
+}
+
+bool FetchPipeline::sendMore() {
+    // Wait until a batch of slots is free, unless nothing is in flight
+    int freeSlots = window.depth() - static_cast<int>(inFlightCount);
+    if (nextJob >= jobs.size() || (freeSlots < window.batch() && inFlightCount > 0)) {
+        return true;
+    }
+
+    commands.clear();
+    while (nextJob < jobs.size() && static_cast<int>(inFlightCount) < window.depth()) {
+        // Past the deadline only the message that is already being requested is completed
+        if (nextCommand == 0 && chrono::steady_clock::now() >= sendDeadline) {
+            stoppedAtDeadline = true;
+            break;
+        }
+        Job &job = jobs[nextJob];
+        size_t expected = job.expectedBytes > 0 ? job.expectedBytes / job.commandCount : window.averageResponse();
+        if (inFlightCount > 0 && inFlightBytes + expected > memoryCap) {
+            break;
+        }
+
+        InFlight &command = inFlight[(inFlightHead + inFlightCount++) % inFlight.size()];
+        command.job = nextJob;
+        command.tag = generateTag();
+        command.expectedBytes = expected;
+        command.sent = chrono::steady_clock::now();
+        inFlightBytes += expected;
+
+        commands += command.tag;
+        commands += ' ';
+        writeCommand(job.uid, job.parameter, nextCommand, commands);
+        commands += "\r\n";
+
+        if (++nextCommand == job.commandCount) {
+            nextJob++;
+            nextCommand = 0;
+        }
+    }
+    return commands.empty() || send(commands) > 0;
+}
+
+bool FetchPipeline::run(const MessageCallback &callback) {
+    auto start = chrono::steady_clock::now();
+    AllocationCounters allocationsBefore = allocationCounters();
+    size_t scanPos = 0;
+    char buffer[65536];
+
+    while (inFlightCount > 0 || nextJob < jobs.size()) {
+        if (!sendMore()) {
+            cerr << "Error: Failed to send UID FETCH commands." << endl;
+            return false;
+        }
+        if (inFlightCount == 0) {
+            break;                                  // The deadline passed
+        }
+
+        // Responses arrive in the order of the commands, the head command is completed first
+        InFlight &head = inFlight[inFlightHead];
+        if (!hasTaggedCompletion(pending, head.tag, scanPos)) {
+            int bytesReceived = receive(buffer, sizeof(buffer));
+            if (bytesReceived <= 0) {
+                cerr << "Error: Could not receive response for message " << jobs[head.job].uid << " from server." << endl;
+                return false;
+            }
+            pending.append(buffer, bytesReceived);
+            continue;
+        }
+
+        size_t responseStart = responseEnds.empty() ? 0 : responseEnds.back();
+
+        // A refused command (NO or BAD, e.g. the message was expunged since the search) leaves the message unsaved
+        size_t statusStart = pending.rfind("\r\n", scanPos - 3);
+        statusStart = statusStart == string::npos || statusStart < responseStart ? responseStart : statusStart + 2;
+        if (pending.compare(statusStart + head.tag.size() + 1, 2, "OK") != 0) {
+            jobRefused = true;
+        }
+
+        double latencyMs = chrono::duration<double, milli>(chrono::steady_clock::now() - head.sent).count();
+        window.onResponse(latencyMs, scanPos - responseStart);
+        pipelineStats.commands++;
+        pipelineStats.bytes += scanPos - responseStart;
+        responseEnds.push_back(scanPos);
+
+        const Job &job = jobs[head.job];
+        inFlightBytes -= head.expectedBytes;
+        inFlightHead = (inFlightHead + 1) % inFlight.size();
+        inFlightCount--;
+
+        // The next command in flight gets a full deadline of its own
+        armCommandDeadline();
+
+        // Hand the message over once all its responses are complete, then drop them from the buffer
+        if (responseEnds.size() == job.commandCount) {
+            responses.clear();
+            size_t begin = 0;
+            for (size_t end : responseEnds) {
+                responses.emplace_back(pending.data() + begin, end - begin);
+                begin = end;
+            }
+            if (jobRefused) {
+                cerr << "Error: Server refused to fetch message with UID " << job.uid << "." << endl;
+            } else {
+                callback(job.uid, job.parameter, responses);
+                pipelineStats.messages++;
+            }
+            jobRefused = false;
+
+            pending.erase(0, scanPos);
+            scanPos = 0;
+            responseEnds.clear();
+        }
+    }
+
+    pipelineStats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    pipelineStats.allocations = allocationCounters().allocations - allocationsBefore.allocations;
+    window.fillStats(pipelineStats);
+    return true;
+}
+
+vector<int> scheduleDownloads(vector<int> uids, const string &order, const unordered_map<int, long> &sizes,
+                              const unordered_map<int, double> &weights) {
+    // Messages of unknown size are scheduled last in the smallest-first order
+    auto sizeOf = [&](int uid) {
+        auto size = sizes.find(uid);
+        return size == sizes.end() ? numeric_limits<long>::max() : size->second;
+    };
+    auto weightOf = [&](int uid) {
+        auto weight = weights.find(uid);
+        return weight == weights.end() ? 0.0 : weight->second;
+    };
+
+    if (order == "newest") {
+        sort(uids.begin(), uids.end(), greater<int>());
+    } else if (order == "smallest") {
+        stable_sort(uids.begin(), uids.end(), [&](int a, int b) { return sizeOf(a) < sizeOf(b); });
+    }
+    if (!weights.empty()) {
+        stable_sort(uids.begin(), uids.end(), [&](int a, int b) { return weightOf(a) > weightOf(b); });
+    }
+    return uids;
+}
+
+bool readWeights(const string &path, unordered_map<int, double> &weights) {
+    ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    string line;
+    while (getline(file, line)) {
+        istringstream fields(line);
+        int uid;
+        double weight;
+        if (fields >> uid >> weight) {
+            weights[uid] = weight;
+        }
+    }
+    return true;
+}
+
+size_t messageFetchCommandCount(bool headersOnly) {
+    return headersOnly ? 1 : 2;
+}
+
+// Appends the decimal representation of a number without a temporary string
+static void appendNumber(string &out, long number) {
+    char digits[24];
+    char *end = to_chars(digits, digits + sizeof(digits), number).ptr;
+    out.append(digits, end - digits);
+}
+
+void appendMessageFetchCommand(string &out, int messageUID, size_t command, long partialBytes, bool saveAttachments) {
+    out += "UID FETCH ";
+    appendNumber(out, messageUID);
+    if (command == 0) {
+        out += " BODY[HEADER.FIELDS (DATE FROM TO SUBJECT MESSAGE-ID)]";
+        return;
+    }
+
+    // Fetch the body text separately, large messages only up to the partial size without setting \Seen.
+    // Attachments can only be extracted from the complete message. A partial body is the beginning of the section
+    // --finish-partial fetches in full: the first part, or the raw body text when the complete message is kept.
+    if (partialBytes > 0) {
+        out += saveAttachments ? " BODY.PEEK[TEXT]<0." : " BODY.PEEK[1]<0.";
+        appendNumber(out, partialBytes);
+        out += '>';
+    } else {
+        out += saveAttachments ? " BODY[]" : " BODY[1]";
+    }
+}
+
+// Writes all pieces to the file with as few system calls as possible, in the line endings set by --eol
+static bool writeFile(const string &path, const struct iovec *pieces, int count) {
+    // Converted pieces are joined in a buffer kept between messages and written at once
+    thread_local string converted;
+    struct iovec joined;
+    LineEnding eol = outputLineEnding();
+    if (eol != LineEnding::Keep) {
+        converted.clear();
+        char previous = 0;
+        for (int i = 0; i < count; i++) {
+            convertLineEndings(string_view(static_cast<const char *>(pieces[i].iov_base), pieces[i].iov_len), converted, eol, previous);
+        }
+        joined.iov_base = converted.data();
+        joined.iov_len = converted.size();
+        pieces = &joined;
+        count = 1;
+    }
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += pieces[i].iov_len;
+    }
+    ssize_t written = writev(fd, pieces, count);
+    bool complete = written == static_cast<ssize_t>(total);
+    if (!complete && written >= 0) {
+        // A short write of a large message, finish it piece by piece
+        size_t skip = written;
+        complete = true;
+        for (int i = 0; i < count && complete; i++) {
+            const char *data = static_cast<const char *>(pieces[i].iov_base);
+            size_t length = pieces[i].iov_len;
+            size_t offset = min(skip, length);
+            skip -= offset;
+            while (offset < length) {
+                ssize_t chunk = write(fd, data + offset, length - offset);
+                if (chunk <= 0) {
+                    complete = false;
+                    break;
+                }
+                offset += chunk;
+            }
+        }
+    }
+    return close(fd) == 0 && complete;
+}
+
+bool saveFetchedMessage(int messageUID, const vector<string_view> &responses, MessagePaths &paths, bool headersOnly, long partialBytes,
+                        bool saveAttachments) {
+    const string &path = paths.message(messageUID);
+    string_view header, body;
+    array<string_view, RFC5322_HEADER_FIELDS> fields;
+    struct iovec pieces[RFC5322_HEADER_FIELDS + 3];
+    int count = 0;
+    auto add = [&](string_view piece) {
+        pieces[count].iov_base = const_cast<char *>(piece.data());
+        pieces[count++].iov_len = piece.size();
+    };
+
+    if (saveAttachments && partialBytes <= 0 && !headersOnly) {
+        // Keep the raw message and write its attachments, decoded, next to it
+        if (!findFetchLiteral(responses[1], body)) {
+            cerr << "Error: Message " << messageUID << " not found in the server response." << endl;
+            return false;
+        }
+        add(body);
+        if (!writeFile(path, pieces, count)) {
+            cerr << "Error: Could not open file to save message " << messageUID << "." << endl;
+            return false;
+        }
+        if (extractAttachments(body, paths.dir(), messageUID) < 0) {
+            cerr << "Error: Could not save attachments of message " << messageUID << "." << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // A response without a literal carries no message data (e.g. a refused command), nothing is saved
+    if (!findFetchLiteral(responses[0], header) || (!headersOnly && !findFetchLiteral(responses[1], body))) {
+        cerr << "Error: Message " << messageUID << " not found in the server response." << endl;
+        return false;
+    }
+
+    // Header fields in RFC 5322 order, followed by the body when it was fetched
+    int fieldCount = selectHeaderFields(header, fields);
+    if (!headersOnly) {
+        add("\r\n");
+    }
+    for (int i = 0; i < fieldCount; i++) {
+        add(fields[i]);
+    }
+    if (!headersOnly) {
+        add("\r\n");
+        add(body);
+    }
+    if (!writeFile(path, pieces, count)) {
+        cerr << "Error: Could not open file to save message " << messageUID << "." << endl;
+        return false;
+    }
+    return true;
+}
+
+void printPipelineStats(const PipelineStats &stats) {
+    cout << fixed << setprecision(2);
+    cout << "Pipeline: depth " << stats.depth << " (max " << stats.maxDepth << "), batch " << stats.batch
+         << ", RTT " << stats.minRttMs << " ms, bandwidth " << stats.bandwidth / (1024 * 1024) << " MiB/s" << endl;
+    cout << "Fetched " << stats.bytes << " bytes in " << stats.commands << " commands, " << stats.seconds << " s" << endl;
+    if (allocationCountingEnabled()) {
+        cout << "Allocations: " << stats.allocations << " while fetching " << stats.messages << " messages ("
+             << (stats.messages ? static_cast<double>(stats.allocations) / stats.messages : 0.0) << " per message)" << endl;
+    }
+    cout << defaultfloat;
+}
@@ -0,0 +1,219 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "utils.h"
+#include <chrono>
+#include <array>
+#include <functional>
+
+// Upper bound of the command window, keeps the number of outstanding tags reasonable for any server
+const int MAX_PIPELINE_DEPTH = 256;
+// Default cap of the response data that may be in flight at once
+const size_t DEFAULT_PIPELINE_MEMORY = 64 * 1024 * 1024;
+
+/**
+ * Statistics of a pipelined fetch, printed with --stats.
+ */
+struct PipelineStats {
+    size_t commands = 0;            // Completed commands
+    size_t bytes = 0;               // Bytes of all responses
+    double seconds = 0;             // Time from the first command to the last response
+    double minRttMs = 0;            // Lowest observed command latency
+    double bandwidth = 0;           // Highest delivery rate in bytes per second
+    int depth = 0;                  // Command window chosen at the end
+    int maxDepth = 0;               // Largest command window used
+    int batch = 0;                  // Commands written at once at the end
+    size_t messages = 0;            // Messages handed over
+    size_t allocations = 0;         // Heap allocations while fetching
+};
+
+/**
+ * Chooses the number of commands in flight similarly to TCP congestion control (BBR): the window starts small
+ * and doubles every round while the delivery rate keeps growing, then follows the bandwidth-delay product
+ * measured from the lowest command latency and the highest delivery rate. The window never allows more
+ * response data in flight than the memory cap.
+ */
+class AdaptiveWindow {
+public:
+    explicit AdaptiveWindow(size_t memoryCap);
+
+    // Accounts a completed command that took latencyMs and delivered bytes
+    void onResponse(double latencyMs, size_t bytes);
+
+    // Commands allowed in flight
+    int depth() const { return currentDepth; }
+
+    // Free slots needed before new commands are written, so they are coalesced into one write
+    int batch() const { return max(1, currentDepth / 4); }
+
+    // Expected size of a response, used when the real size is not known
+    size_t averageResponse() const { return static_cast<size_t>(avgResponseBytes); }
+
+    void fillStats(PipelineStats &stats) const;
+
+private:
+    void limitByMemory();
+
+    size_t memoryCap;
+    int currentDepth = 2;
+    int maxDepth = 2;
+    bool startup = true;                            // Doubling the window while the bandwidth grows
+    int roundsWithoutGrowth = 0;
+    double roundBandwidth = 0;                      // Bandwidth at the end of the previous round
+    size_t roundEnd = 0;                            // Completed commands that end the current round
+
+    double minRttMs = 0;
+    double avgResponseBytes = 0;
+    array<double, 10> bandwidthSamples = {};        // Recent delivery rates (bytes per second), max filtered
+    size_t bandwidthSampleCount = 0;
+    double maxBandwidth = 0;
+    size_t completed = 0;
+    size_t delivered = 0;
+    chrono::steady_clock::time_point sampleStart = chrono::steady_clock::now();
+    size_t sampleDelivered = 0;
+};
+
+/**
+ * Fetches messages over one connection with several commands in flight. Commands are written ahead
+ * of the responses and the responses, which arrive in order, are handed over per message.
+ * Commands are formatted straight into a reused buffer and responses are handed over as views of the
+ * receive buffer, so the steady state does not allocate.
+ */
+class FetchPipeline {
+public:
+    // Appends the command (without tag and CRLF) with the given index of a message to out
+    using CommandWriter = function<void(int uid, long parameter, size_t command, string &out)>;
+    using SendFunction = function<int(const string &)>;
+    using ReceiveFunction = function<int(char *, size_t)>;
+    // Called for each message with the responses of its commands; the views are valid during the call only
+    using MessageCallback = function<void(int uid, long parameter, const vector<string_view> &responses)>;
+
+    FetchPipeline(CommandWriter writeCommand, SendFunction send, ReceiveFunction receive, size_t memoryCap = DEFAULT_PIPELINE_MEMORY);
+
+    /**
+     * Queues the commands of one message.
+     * @param uid - The UID of the message.
+     * @param commandCount - The number of commands the message needs.
+     * @param expectedBytes - The expected size of all responses (e.g. RFC822.SIZE), 0 if unknown.
+     * @param parameter - A value passed to the command writer and the callback, e.g. the partial size.
+     */
+    void add(int uid, size_t commandCount, size_t expectedBytes = 0, long parameter = 0);
+
+    /**
+     * Sends the queued commands and delivers the responses until all messages are done or the connection fails.
+     * @param callback - Called for every message whose commands all ended with OK.
+     * @return - Returns true if all responses were received, false otherwise.
+     */
+    bool run(const MessageCallback &callback);
+
+    const PipelineStats &stats() const { return pipelineStats; }
+
+    /**
+     * Sets the time after which no further messages are requested; messages already requested are still saved.
+     * @param deadline - The deadline.
+     */
+    void setDeadline(chrono::steady_clock::time_point deadline) { sendDeadline = deadline; }
+
+    // True if messages were left unrequested because the deadline passed
+    bool deadlineReached() const { return stoppedAtDeadline; }
+
+private:
+    struct Job {
+        int uid;
+        size_t commandCount;
+        size_t expectedBytes;
+        long parameter;
+    };
+    struct InFlight {
+        size_t job;
+        string tag;                                 // Short enough to be stored inline
+        size_t expectedBytes;
+        chrono::steady_clock::time_point sent;
+    };
+
+    bool sendMore();
+
+    CommandWriter writeCommand;
+    SendFunction send;
+    ReceiveFunction receive;
+    size_t memoryCap;
+    AdaptiveWindow window;
+    vector<Job> jobs;
+    vector<InFlight> inFlight;                      // Ring buffer of MAX_PIPELINE_DEPTH commands
+    size_t inFlightHead = 0, inFlightCount = 0;
+    size_t inFlightBytes = 0;
+    size_t nextJob = 0, nextCommand = 0;            // Next command to be sent
+    string commands;                                // Reused buffer of the commands written at once
+    string pending;                                 // Received data of the messages not yet handed over
+    vector<size_t> responseEnds;                    // Ends of the responses of the head message in pending
+    bool jobRefused = false;                        // A command of the head message did not end with OK
+    vector<string_view> responses;
+    PipelineStats pipelineStats;
+    chrono::steady_clock::time_point sendDeadline = chrono::steady_clock::time_point::max();
+    bool stoppedAtDeadline = false;                 // sendMore stopped requesting messages because of sendDeadline
+};
+
+/**
+ * Orders the messages to download.
+ * @param uids - The UIDs in server order.
+ * @param order - "oldest" (server order), "newest" (highest UID first) or "smallest" (by RFC822.SIZE).
+ * @param sizes - The message sizes, used by the "smallest" order.
+ * @param weights - User supplied weights by UID; if not empty, the highest weight goes first and the order breaks ties.
+ * @return - The UIDs in download order.
+ */
+vector<int> scheduleDownloads(vector<int> uids, const string &order, const unordered_map<int, long> &sizes,
+                              const unordered_map<int, double> &weights);
+
+/**
+ * Reads a weight file with lines of the form "UID weight".
+ * @param path - The path to the weight file.
+ * @param weights - The map the weights are stored to.
+ * @return - Returns true if the file could be read, false otherwise.
+ */
+bool readWeights(const string &path, unordered_map<int, double> &weights);
+
+/**
+ * Appends one of the commands that fetch a message, as used by fetchAndSaveMessage and the pipeline.
+ * @param out - The string the command (without tag and CRLF) is appended to.
+ * @param messageUID - The UID of the message.
+ * @param command - The index of the command, below messageFetchCommandCount.
+ * @param partialBytes - If positive, only the first partialBytes of the body are fetched.
+ * @param saveAttachments - If true, the complete message is fetched.
+ */
+void appendMessageFetchCommand(string &out, int messageUID, size_t command, long partialBytes, bool saveAttachments);
+
+/**
+ * Returns the number of commands that fetch a message.
+ * @param headersOnly - If true, only the headers are fetched.
+ * @return - The number of commands.
+ */
+size_t messageFetchCommandCount(bool headersOnly);
+
+/**
+ * Saves a message from the responses to the commands built by appendMessageFetchCommand.
+ * The file is written with one writev() of views into the responses.
+ * @param messageUID - The UID of the message.
+ * @param responses - The raw server responses in the order of the commands.
+ * @param paths - The paths of the mailbox directory.
+ * @param headersOnly - If true, only the headers are saved.
+ * @param partialBytes - If positive, the body was fetched only partially.
+ * @param saveAttachments - If true, the complete message is saved and its attachments are decoded next to it.
+ * @return - Returns true if successful, false otherwise.
+ */
+bool saveFetchedMessage(int messageUID, const vector<string_view> &responses, MessagePaths &paths, bool headersOnly, long partialBytes,
+                        bool saveAttachments);
+
+/**
+ * Prints the statistics of a pipelined fetch.
+ * @param stats - The statistics to print.
+ */
+void printPipelineStats(const PipelineStats &stats);
+
+#endif // PIPELINE_H
@@ -0,0 +1,950 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#include "serve.h"
+#include "net.h"
+#include <arpa/inet.h>
+#include <set>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <thread>
+
+extern char **environ;
+
+// Capabilities of the local endpoint
+static const string SERVE_CAPABILITIES = "IMAP4rev1 LITERAL+ SASL-IR AUTH=PLAIN UNSELECT";
+
+// Longest command accepted from a client including its literals, only credentials and mailbox names are sent as literals
+const size_t MAX_COMMAND_LENGTH = 65536;
+
+// Responses are sent once this much is buffered, and at the end of every command
+const size_t SERVE_OUTPUT_CHUNK = 256 * 1024;
+
+// A client that sends nothing for this long is logged out (the autologout timer of RFC 3501)
+const int CLIENT_IDLE_TIMEOUT_S = 30 * 60;
+
+// A client that reads nothing of a response for this long is disconnected
+const int CLIENT_SEND_TIMEOUT_S = 60;
+
+// Clients served at once, further connections are refused with BYE
+const int MAX_SERVE_CLIENTS = 64;
+
+static atomic<int> activeClients{0};
+
+bool loadLocalMailbox(const string &dir, LocalMailbox &mailbox) {
+    mailbox = LocalMailbox();
+    MailboxState state;
+    readStateFile(dir, state);
+    mailbox.uidvalidity = state.uidvalidity;
+    mailbox.headerUIDs = move(state.headerUIDs);
+    mailbox.partialUIDs = move(state.partialUIDs);
+    set<int> uids(state.uids.begin(), state.uids.end());
+    string line;
+
+    // Messages saved by a running or interrupted sync are only in the journal; a torn last line is ignored
+    ifstream journal(dir + "/journal.txt");
+    int journalUIDValidity = -1;
+    string journalHeadersOnly;
+    vector<pair<int, bool>> records;        // UID, saved only partially
+    while (getline(journal, line) && !journal.eof()) {
+        istringstream fields(line);
+        string key;
+        int value;
+        fields >> key;
+        if (key == "HeadersOnly:") {
+            fields >> journalHeadersOnly;
+        } else if (fields >> value) {
+            if (key == "UIDVALIDITY:") {
+                journalUIDValidity = value;
+            } else if (key == "Saved:" || key == "Partial:") {
+                records.push_back({value, key == "Partial:"});
+            }
+        }
+    }
+
+    // A journal of another generation means the mailbox is being downloaded anew
+    if (journalUIDValidity >= 0 && journalUIDValidity != mailbox.uidvalidity) {
+        uids.clear();
+        mailbox.headerUIDs.clear();
+        mailbox.partialUIDs.clear();
+        mailbox.uidvalidity = journalUIDValidity;
+    }
+    for (const auto &[uid, partial] : records) {
+        uids.insert(uid);
+        if (journalHeadersOnly == "true") {
+            mailbox.headerUIDs.insert(uid);
+        } else {
+            mailbox.headerUIDs.erase(uid);
+        }
+        if (partial) {
+            mailbox.partialUIDs.insert(uid);
+        } else {
+            mailbox.partialUIDs.erase(uid);
+        }
+    }
+    if (mailbox.uidvalidity < 0) {
+        return false;
+    }
+
+    MessagePaths paths(dir);
+    for (int uid : uids) {
+        if (fs::exists(paths.message(uid))) {
+            mailbox.uids.push_back(uid);
+        }
+    }
+    return true;
+}
+
+vector<string> buildSyncCommand(int argc, char *argv[]) {
+    vector<string> command = {argv[0]};
+    bool serveSkipped = false;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        // As in ArgumentParser, an option takes the next argument as its value unless it starts with '-'
+        bool hasValue = arg[0] == '-' && i + 1 < argc && argv[i + 1][0] != '-';
+        if (arg == "--listen" || arg == "--sync-interval") {
+            i += hasValue;
+            continue;
+        }
+        if (arg == "serve" && !serveSkipped) {
+            serveSkipped = true;
+            continue;
+        }
+        command.push_back(arg);
+        if (hasValue) {
+            command.push_back(argv[++i]);
+        }
+    }
+    return command;
+}
+
+// Splits command arguments: atoms (a bracket may contain spaces, as in BODY[HEADER.FIELDS (FROM)]) and parenthesized
+// lists are returned as written, quoted strings and literals ("{n}\r\n" and the data) without their framing
+static bool splitArguments(string_view text, vector<string> &args) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+        if (text[pos] == ' ') {
+            pos++;
+            continue;
+        }
+        string arg;
+        if (text[pos] == '"') {
+            for (pos++; pos < text.size() && text[pos] != '"'; pos++) {
+                if (text[pos] == '\\' && pos + 1 < text.size()) {
+                    pos++;
+                }
+                arg += text[pos];
+            }
+            if (pos++ >= text.size()) {
+                return false;
+            }
+        } else if (text[pos] == '{') {
+            size_t length;
+            size_t close = text.find('}', pos);
+            if (from_chars(text.data() + pos + 1, text.data() + text.size(), length).ec != errc() || close == string_view::npos || text.compare(close + 1, 2, "\r\n") != 0 ||
+                close + 3 + length > text.size()) {
+                return false;
+            }
+            arg = text.substr(close + 3, length);
+            pos = close + 3 + length;
+        } else {
+            size_t start = pos;
+            int depth = 0;
+            for (; pos < text.size() && (depth > 0 || text[pos] != ' '); pos++) {
+                if (text[pos] == '(' || text[pos] == '[') {
+                    depth++;
+                } else if (text[pos] == ')' || text[pos] == ']') {
+                    depth--;
+                }
+            }
+            if (depth != 0) {
+                return false;
+            }
+            arg = text.substr(start, pos - start);
+        }
+        args.push_back(move(arg));
+    }
+    return true;
+}
+
+static string upperCase(string value) {
+    transform(value.begin(), value.end(), value.begin(), ::toupper);
+    return value;
+}
+
+// Checks whether a number is in a sequence set such as "1:4,7,9:*", where '*' stands for the largest number in use
+static bool inSequenceSet(string_view set, int number, int largest, bool &valid) {
+    auto parseNumber = [&](string_view text, int &value) {
+        if (text == "*") {
+            value = largest;
+            return true;
+        }
+        auto [end, ec] = from_chars(text.data(), text.data() + text.size(), value);
+        return ec == errc() && end == text.data() + text.size() && value > 0;
+    };
+    bool found = false;
+    valid = !set.empty();
+    while (!set.empty()) {
+        size_t comma = set.find(',');
+        string_view range = set.substr(0, comma);
+        set = comma == string_view::npos ? string_view() : set.substr(comma + 1);
+        size_t colon = range.find(':');
+        int first, last;
+        if (!parseNumber(range.substr(0, colon), first) ||
+            !parseNumber(colon == string_view::npos ? range : range.substr(colon + 1), last)) {
+            valid = false;
+            return false;
+        }
+        found = found || (number >= min(first, last) && number <= max(first, last));
+    }
+    return found;
+}
+
+/**
+ * A data item of a FETCH command.
+ */
+struct FetchItem {
+    enum class Kind { Uid, Flags, Size, InternalDate, Section };
+
+    FetchItem(Kind kind, string name, string section = "") : kind(kind), name(move(name)), section(move(section)) {}
+
+    Kind kind;
+    string name;                            // Name in the response, e.g. "RFC822.HEADER" or "BODY[HEADER.FIELDS (FROM)]<0>"
+    string section;                         // "", "HEADER", "TEXT", "HEADER.FIELDS" or "HEADER.FIELDS.NOT"
+    vector<string> fields;                  // Upper-case field names of HEADER.FIELDS
+    long partialStart = -1;                 // "<start.length>" of a partial fetch
+    long partialLength = 0;
+};
+
+// Parses the data items of a FETCH command; ENVELOPE, BODYSTRUCTURE and MIME parts are not supported by the store
+static bool parseFetchItems(const string &spec, vector<FetchItem> &items) {
+    string text = upperCase(spec);
+    if (text.starts_with('(') && text.ends_with(')')) {
+        text = text.substr(1, text.size() - 2);
+    }
+    vector<string> names;
+    if (!splitArguments(text, names) || names.empty()) {
+        return false;
+    }
+    for (const string &name : names) {
+        if (name == "FAST") {
+            items.push_back({FetchItem::Kind::Flags, "FLAGS"});
+            items.push_back({FetchItem::Kind::InternalDate, "INTERNALDATE"});
+            items.push_back({FetchItem::Kind::Size, "RFC822.SIZE"});
+        } else if (name == "UID") {
+            items.push_back({FetchItem::Kind::Uid, name});
+        } else if (name == "FLAGS") {
+            items.push_back({FetchItem::Kind::Flags, name});
+        } else if (name == "RFC822.SIZE") {
+            items.push_back({FetchItem::Kind::Size, name});
+        } else if (name == "INTERNALDATE") {
+            items.push_back({FetchItem::Kind::InternalDate, name});
+        } else if (name == "RFC822" || name == "RFC822.HEADER" || name == "RFC822.TEXT") {
+            items.push_back({FetchItem::Kind::Section, name, name == "RFC822" ? "" : name.substr(7)});
+        } else if (name.starts_with("BODY[") || name.starts_with("BODY.PEEK[")) {
+            size_t open = name.find('[');
+            size_t close = name.rfind(']');
+            FetchItem item(FetchItem::Kind::Section, "");
+            string section = name.substr(open + 1, close - open - 1);
+            size_t list = section.find(" (");
+            item.section = section.substr(0, list);
+            if (item.section == "HEADER.FIELDS" || item.section == "HEADER.FIELDS.NOT") {
+                if (list == string::npos || !section.ends_with(')') ||
+                    !splitArguments(string_view(section).substr(list + 2, section.size() - list - 3), item.fields)) {
+                    return false;
+                }
+            } else if (!item.section.empty() && item.section != "HEADER" && item.section != "TEXT") {
+                return false;
+            }
+            item.name = "BODY[" + section + "]";
+
+            // "<start.length>"
+            string_view partial = string_view(name).substr(close + 1);
+            if (!partial.empty()) {
+                size_t dot = partial.find('.');
+                if (!partial.starts_with('<') || !partial.ends_with('>') || dot == string_view::npos ||
+                    from_chars(partial.data() + 1, partial.data() + dot, item.partialStart).ec != errc() ||
+                    from_chars(partial.data() + dot + 1, partial.data() + partial.size() - 1, item.partialLength).ec != errc()) {
+                    return false;
+                }
+                item.name += "<" + to_string(item.partialStart) + ">";
+            }
+            items.push_back(move(item));
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Keeps the header lines of the listed fields (or of all other fields), with their continuation lines
+static string filterHeader(string_view header, const vector<string> &fields, bool exclude) {
+    string filtered;
+    bool keep = false;
+    size_t lineStart = 0;
+    while (lineStart < header.size()) {
+        size_t eol = header.find("\r\n", lineStart);
+        size_t lineEnd = eol == string_view::npos ? header.size() : eol + 2;
+        string_view line = header.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd;
+        if (line == "\r\n") {
+            break;
+        }
+        if (line[0] != ' ' && line[0] != '\t') {
+            string name = upperCase(string(line.substr(0, line.find(':'))));
+            keep = (find(fields.begin(), fields.end(), name) != fields.end()) != exclude;
+        }
+        if (keep) {
+            filtered += line;
+        }
+    }
+    filtered += "\r\n";
+    return filtered;
+}
+
+/**
+ * Connection of one local client, served by its own thread with blocking I/O.
+ */
+class ServeClient {
+public:
+    ServeClient(int fd, const ServeOptions &options) : fd(fd), options(options) {}
+    ~ServeClient() { close(fd); }
+
+    // Greets the client and answers its commands until it logs out or the connection is closed
+    void run();
+
+private:
+    bool receiveMore();
+    bool readCommand(string &command);
+    void send(string_view data);
+    bool flush();
+
+    // Answers one command, returns false if the connection is to be closed
+    bool handle(const string &tag, const string &name, const vector<string> &args);
+    bool authenticate(const string &tag, bool login, const vector<string> &args);
+    void select(const string &tag, const string &name, const string &mailboxName);
+    void list(const string &tag, const string &name, const vector<string> &args);
+    void status(const string &tag, const vector<string> &args);
+    void search(const string &tag, bool byUid, const vector<string> &args);
+    void fetch(const string &tag, bool byUid, const string &set, const string &itemSpec);
+    bool refresh();
+
+    string mailboxDirOf(const string &mailboxName) const;
+    bool loadMessage(int uid, string &data);
+    long messageSize(int uid);
+
+    int fd;
+    const ServeOptions &options;
+    string input;                           // Received data not processed yet
+    string output;                          // Responses not sent yet
+    bool authenticated = false;
+    bool selected = false;
+    string mailboxDir;                      // Directory of the selected mailbox
+    LocalMailbox mailbox;                   // Messages of the selected mailbox as the client knows them
+    int highestUID = 0;                     // Highest UID the client was told of
+    unordered_map<int, long> sizes;         // RFC822.SIZE of the messages loaded so far
+    unordered_set<int> rawUIDs;             // Loaded messages whose file holds BODY[] as received (--extract-attachments)
+};
+
+bool ServeClient::receiveMore() {
+    char buffer[16384];
+    ssize_t bytesReceived;
+    do {
+        bytesReceived = recv(fd, buffer, sizeof(buffer), 0);
+    } while (bytesReceived < 0 && errno == EINTR);
+    if (bytesReceived <= 0) {
+        return false;
+    }
+    input.append(buffer, bytesReceived);
+    return true;
+}
+
+bool ServeClient::readCommand(string &command) {
+    command.clear();
+    while (true) {
+        size_t eol;
+        while ((eol = input.find('\n')) == string::npos) {
+            if (input.size() > MAX_COMMAND_LENGTH || !receiveMore()) {
+                return false;
+            }
+        }
+        string_view line(input.data(), eol);
+        if (line.ends_with('\r')) {
+            line.remove_suffix(1);
+        }
+
+        // A line ending with "{n}" or "{n+}" continues after a literal of n bytes
+        size_t open = line.rfind('{');
+        size_t literalLength = 0;
+        bool literal = line.ends_with('}') && open != string_view::npos &&
+                       from_chars(line.data() + open + 1, line.data() + line.size() - 1, literalLength).ec == errc();
+        bool nonSynchronizing = line.ends_with("+}");
+        literal = literal || (nonSynchronizing && open != string_view::npos &&
+                              from_chars(line.data() + open + 1, line.data() + line.size() - 2, literalLength).ec == errc());
+        command += line;
+        input.erase(0, eol + 1);
+        if (!literal) {
+            return true;
+        }
+        if (command.size() + literalLength > MAX_COMMAND_LENGTH) {
+            send("* BYE Command too long\r\n");
+            flush();
+            return false;
+        }
+        command += "\r\n";
+        if (!nonSynchronizing) {
+            send("+ Ready for literal data\r\n");
+            if (!flush()) {
+                return false;
+            }
+        }
+        while (input.size() < literalLength) {
+            if (!receiveMore()) {
+                return false;
+            }
+        }
+        command.append(input, 0, literalLength);
+        input.erase(0, literalLength);
+    }
+}
+
+void ServeClient::send(string_view data) {
+    output += data;
+    if (output.size() >= SERVE_OUTPUT_CHUNK) {
+        flush();
+    }
+}
+
+bool ServeClient::flush() {
+    size_t sent = 0;
+    while (sent < output.size()) {
+        ssize_t bytesSent = ::send(fd, output.data() + sent, output.size() - sent, MSG_NOSIGNAL);
+        if (bytesSent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesSent <= 0) {
+            output.clear();
+            return false;
+        }
+        sent += bytesSent;
+    }
+    output.clear();
+    return true;
+}
+
+void ServeClient::run() {
+    timeval idleTimeout = {CLIENT_IDLE_TIMEOUT_S, 0};
+    timeval sendTimeout = {CLIENT_SEND_TIMEOUT_S, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idleTimeout, sizeof(idleTimeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+
+    send("* OK [CAPABILITY " + SERVE_CAPABILITIES + "] imapcl local store ready\r\n");
+    string command;
+    while (flush() && readCommand(command)) {
+        vector<string> args;
+        if (!splitArguments(command, args) || args.size() < 2) {
+            send((args.empty() ? string("*") : args[0]) + " BAD Invalid command syntax\r\n");
+            continue;
+        }
+        string tag = args[0];
+        string name = upperCase(args[1]);
+        args.erase(args.begin(), args.begin() + 2);
+        if (!handle(tag, name, args)) {
+            flush();
+            return;
+        }
+    }
+}
+
+bool ServeClient::handle(const string &tag, const string &name, const vector<string> &args) {
+    if (name == "CAPABILITY") {
+        send("* CAPABILITY " + SERVE_CAPABILITIES + "\r\n" + tag + " OK CAPABILITY completed\r\n");
+    } else if (name == "NOOP" || name == "CHECK") {
+        if (selected && !refresh()) {
+            return false;
+        }
+        send(tag + " OK " + name + " completed\r\n");
+    } else if (name == "LOGOUT") {
+        send("* BYE Logging out\r\n" + tag + " OK LOGOUT completed\r\n");
+        return false;
+    } else if (name == "LOGIN" || name == "AUTHENTICATE") {
+        if (authenticated) {
+            send(tag + " BAD Already authenticated\r\n");
+        } else {
+            return authenticate(tag, name == "LOGIN", args);
+        }
+    } else if (!authenticated) {
+        send(tag + " BAD Command not valid before authentication\r\n");
+    } else if ((name == "SELECT" || name == "EXAMINE") && args.size() == 1) {
+        select(tag, name, args[0]);
+    } else if ((name == "LIST" || name == "LSUB") && args.size() == 2) {
+        list(tag, name, args);
+    } else if (name == "STATUS" && args.size() == 2) {
+        status(tag, args);
+    } else if (name == "APPEND" || name == "CREATE" || name == "DELETE" || name == "RENAME" || name == "SUBSCRIBE" ||
+               name == "UNSUBSCRIBE") {
+        send(tag + " NO [CANNOT] The local store is read-only\r\n");
+    } else if (!selected) {
+        send(tag + " BAD Command not valid in this state\r\n");
+    } else if (name == "CLOSE" || name == "UNSELECT") {
+        selected = false;
+        send(tag + " OK " + name + " completed\r\n");
+    } else if (name == "SEARCH") {
+        search(tag, false, args);
+    } else if (name == "FETCH" && args.size() == 2) {
+        fetch(tag, false, args[0], args[1]);
+    } else if (name == "UID" && !args.empty() && upperCase(args[0]) == "SEARCH") {
+        search(tag, true, vector<string>(args.begin() + 1, args.end()));
+    } else if (name == "UID" && args.size() == 3 && upperCase(args[0]) == "FETCH") {
+        fetch(tag, true, args[1], args[2]);
+    } else if (name == "EXPUNGE" || name == "STORE" || name == "COPY" || name == "MOVE" || name == "UID") {
+        send(tag + " NO [CANNOT] The local store is read-only\r\n");
+    } else {
+        send(tag + " BAD Command not supported by the local store\r\n");
+    }
+    return true;
+}
+
+bool ServeClient::authenticate(const string &tag, bool login, const vector<string> &args) {
+    string username, password;
+    if (login && args.size() == 2) {
+        username = args[0];
+        password = args[1];
+    } else if (!login && !args.empty() && upperCase(args[0]) == "PLAIN" && args.size() <= 2) {
+        // AUTHENTICATE PLAIN with the initial response (SASL-IR) or after a continuation request
+        string response = args.size() == 2 ? args[1] : "";
+        if (args.size() == 1) {
+            send("+ \r\n");
+            if (!flush() || !readCommand(response)) {
+                return false;
+            }
+            if (response == "*") {
+                send(tag + " BAD Authentication cancelled\r\n");
+                return true;
+            }
+        }
+        string credentials;
+        decodeBase64(response == "=" ? "" : response, credentials);
+        size_t first = credentials.find('\0');
+        size_t second = first == string::npos ? string::npos : credentials.find('\0', first + 1);
+        if (second == string::npos) {
+            send(tag + " BAD Invalid PLAIN response\r\n");
+            return true;
+        }
+        username = credentials.substr(first + 1, second - first - 1);
+        password = credentials.substr(second + 1);
+    } else if (login) {
+        send(tag + " BAD Invalid LOGIN arguments\r\n");
+        return true;
+    } else {
+        send(tag + " NO [CANNOT] Only the PLAIN mechanism is supported\r\n");
+        return true;
+    }
+
+    if (username != options.username || password != options.password) {
+        send(tag + " NO [AUTHENTICATIONFAILED] Invalid credentials\r\n");
+        return true;
+    }
+    authenticated = true;
+    send(tag + " OK [CAPABILITY " + SERVE_CAPABILITIES + "] Authenticated\r\n");
+    return true;
+}
+
+string ServeClient::mailboxDirOf(const string &mailboxName) const {
+    // Mailboxes are directories of the store, a name must not lead out of it
+    string name = upperCase(mailboxName) == "INBOX" ? "INBOX" : mailboxName;
+    if (name.empty() || name[0] == '/') {
+        return "";
+    }
+    for (const auto &component : fs::path(name)) {
+        if (component == ".." || component == ".") {
+            return "";
+        }
+    }
+    return options.storeDir + "/" + name;
+}
+
+void ServeClient::select(const string &tag, const string &name, const string &mailboxName) {
+    selected = false;
+    sizes.clear();
+    rawUIDs.clear();
+    mailboxDir = mailboxDirOf(mailboxName);
+    if (mailboxDir.empty() || !loadLocalMailbox(mailboxDir, mailbox)) {
+        send(tag + " NO Mailbox does not exist in the local store\r\n");
+        return;
+    }
+    selected = true;
+    highestUID = mailbox.uids.empty() ? 0 : mailbox.uids.back();
+    send("* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n"
+         "* OK [PERMANENTFLAGS ()] No permanent flags permitted\r\n"
+         "* " + to_string(mailbox.uids.size()) + " EXISTS\r\n"
+         "* 0 RECENT\r\n"
+         "* OK [UIDVALIDITY " + to_string(mailbox.uidvalidity) + "] UIDs valid\r\n"
+         "* OK [UIDNEXT " + to_string(highestUID + 1) + "] Predicted next UID\r\n" +
+         tag + " OK [READ-ONLY] " + name + " completed\r\n");
+}
+
+// Matches a mailbox name against a LIST pattern, '*' matches anything and '%' anything but the hierarchy delimiter
+static bool matchesPattern(string_view name, string_view pattern) {
+    if (pattern.empty()) {
+        return name.empty();
+    }
+    if (pattern[0] == '*' || pattern[0] == '%') {
+        for (size_t skip = 0; skip <= name.size(); skip++) {
+            if (matchesPattern(name.substr(skip), pattern.substr(1))) {
+                return true;
+            }
+            if (skip < name.size() && pattern[0] == '%' && name[skip] == '/') {
+                return false;
+            }
+        }
+        return false;
+    }
+    return !name.empty() && name[0] == pattern[0] && matchesPattern(name.substr(1), pattern.substr(1));
+}
+
+void ServeClient::list(const string &tag, const string &name, const vector<string> &args) {
+    string pattern = args[0] + args[1];
+    if (args[1].empty()) {
+        // An empty pattern asks for the hierarchy delimiter
+        send("* " + name + " (\\Noselect) \"/\" \"\"\r\n" + tag + " OK " + name + " completed\r\n");
+        return;
+    }
+
+    // Every directory with a downloaded mailbox is a mailbox
+    vector<string> names;
+    error_code error;
+    for (fs::recursive_directory_iterator entry(options.storeDir, error), end; !error && entry != end; entry.increment(error)) {
+        if (entry->is_directory() && (fs::exists(entry->path() / "state.txt") || fs::exists(entry->path() / "journal.txt"))) {
+            names.push_back(fs::relative(entry->path(), options.storeDir).string());
+        }
+    }
+    sort(names.begin(), names.end());
+    for (const string &mailboxName : names) {
+        if (matchesPattern(mailboxName, pattern)) {
+            string line = "* " + name + " () \"/\" ";
+            appendAString(line, mailboxName, false);
+            send(line + "\r\n");
+        }
+    }
+    send(tag + " OK " + name + " completed\r\n");
+}
+
+void ServeClient::status(const string &tag, const vector<string> &args) {
+    LocalMailbox statusMailbox;
+    string dir = mailboxDirOf(args[0]);
+    if (dir.empty() || !loadLocalMailbox(dir, statusMailbox)) {
+        send(tag + " NO Mailbox does not exist in the local store\r\n");
+        return;
+    }
+    string items = upperCase(args[1]);
+    if (items.starts_with('(') && items.ends_with(')')) {
+        items = items.substr(1, items.size() - 2);
+    }
+
+    // Flags are not stored, every message counts as unseen
+    string line = "* STATUS ";
+    appendAString(line, args[0], false);
+    line += " (";
+    istringstream itemStream(items);
+    string item;
+    bool first = true;
+    while (itemStream >> item) {
+        long value;
+        if (item == "MESSAGES" || item == "UNSEEN") {
+            value = statusMailbox.uids.size();
+        } else if (item == "RECENT") {
+            value = 0;
+        } else if (item == "UIDNEXT") {
+            value = (statusMailbox.uids.empty() ? 0 : statusMailbox.uids.back()) + 1;
+        } else if (item == "UIDVALIDITY") {
+            value = statusMailbox.uidvalidity;
+        } else {
+            send(tag + " BAD Unknown status item " + item + "\r\n");
+            return;
+        }
+        line += (first ? "" : " ") + item + " " + to_string(value);
+        first = false;
+    }
+    send(line + ")\r\n" + tag + " OK STATUS completed\r\n");
+}
+
+bool ServeClient::refresh() {
+    LocalMailbox current;
+    if (!loadLocalMailbox(mailboxDir, current) || current.uidvalidity != mailbox.uidvalidity) {
+        send("* BYE The mailbox was replaced in the local store\r\n");
+        return false;
+    }
+
+    // Messages gone from the store are expunged from the highest sequence number down, so the numbers stay valid
+    unordered_set<int> present(current.uids.begin(), current.uids.end());
+    vector<int> kept;
+    for (size_t i = mailbox.uids.size(); i-- > 0;) {
+        if (present.count(mailbox.uids[i])) {
+            kept.push_back(mailbox.uids[i]);
+        } else {
+            send("* " + to_string(i + 1) + " EXPUNGE\r\n");
+        }
+    }
+    reverse(kept.begin(), kept.end());
+
+    // UIDs have to ascend with the sequence numbers, so a message below the highest UID shown waits for the next SELECT
+    size_t count = mailbox.uids.size();
+    mailbox.uids = move(kept);
+    for (int uid : current.uids) {
+        if (uid > highestUID) {
+            mailbox.uids.push_back(uid);
+            highestUID = uid;
+        }
+    }
+    mailbox.headerUIDs = move(current.headerUIDs);
+    mailbox.partialUIDs = move(current.partialUIDs);
+    if (mailbox.uids.size() != count) {
+        send("* " + to_string(mailbox.uids.size()) + " EXISTS\r\n");
+    }
+    return true;
+}
+
+bool ServeClient::loadMessage(int uid, string &data) {
+    ifstream file(MessagePaths(mailboxDir).message(uid), ios::binary);
+    if (!file) {
+        return false;
+    }
+    string raw((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+    // Messages are transferred with CRLF line endings, whatever --eol they were saved with; the empty line
+    // the files of complete messages start with is not part of the message. Only files without it hold the
+    // message as received, the others hold selected header fields and the first body part (or the text parts).
+    data.clear();
+    char previous = 0;
+    convertLineEndings(raw, data, LineEnding::CRLF, previous);
+    if (data.starts_with("\r\n")) {
+        data.erase(0, 2);
+    } else {
+        rawUIDs.insert(uid);
+    }
+    sizes[uid] = data.size();
+    return true;
+}
+
+long ServeClient::messageSize(int uid) {
+    auto size = sizes.find(uid);
+    if (size != sizes.end()) {
+        return size->second;
+    }
+    string data;
+    return loadMessage(uid, data) ? static_cast<long>(data.size()) : 0;
+}
+
+void ServeClient::search(const string &tag, bool byUid, const vector<string> &args) {
+    // Criteria supported by the store: ALL, sequence sets, UID, LARGER and SMALLER, all of them have to match
+    size_t start = args.size() >= 2 && upperCase(args[0]) == "CHARSET" ? 2 : 0;
+    int messageCount = mailbox.uids.size();
+    vector<bool> matches(messageCount, true);
+    for (size_t i = start; i < args.size(); i++) {
+        string key = upperCase(args[i]);
+        bool valid = true;
+        if (key == "ALL") {
+            continue;
+        } else if ((key == "UID" || key == "LARGER" || key == "SMALLER") && i + 1 < args.size()) {
+            const string &value = args[++i];
+            long limit = 0;
+            if (key != "UID" && from_chars(value.data(), value.data() + value.size(), limit).ec != errc()) {
+                valid = false;
+            }
+            for (int seq = 0; seq < messageCount && valid; seq++) {
+                if (!matches[seq]) {
+                    continue;
+                }
+                if (key == "UID") {
+                    matches[seq] = inSequenceSet(value, mailbox.uids[seq], highestUID, valid);
+                } else {
+                    long size = messageSize(mailbox.uids[seq]);
+                    matches[seq] = key == "LARGER" ? size > limit : size < limit;
+                }
+            }
+        } else if (isdigit(static_cast<unsigned char>(key[0])) || key[0] == '*') {
+            inSequenceSet(key, 1, messageCount, valid);
+            for (int seq = 0; seq < messageCount && valid; seq++) {
+                matches[seq] = matches[seq] && inSequenceSet(key, seq + 1, messageCount, valid);
+            }
+        } else {
+            send(tag + " NO [CANNOT] Search key " + key + " is not supported by the local store\r\n");
+            return;
+        }
+        if (!valid) {
+            send(tag + " BAD Invalid search criteria\r\n");
+            return;
+        }
+    }
+
+    string line = "* SEARCH";
+    for (int seq = 0; seq < messageCount; seq++) {
+        if (matches[seq]) {
+            line += ' ';
+            line += to_string(byUid ? mailbox.uids[seq] : seq + 1);
+        }
+    }
+    send(line + "\r\n" + tag + " OK SEARCH completed\r\n");
+}
+
+void ServeClient::fetch(const string &tag, bool byUid, const string &set, const string &itemSpec) {
+    vector<FetchItem> items;
+    if (!parseFetchItems(itemSpec, items)) {
+        send(tag + " BAD Invalid or unsupported FETCH items\r\n");
+        return;
+    }
+    if (byUid && none_of(items.begin(), items.end(), [](const FetchItem &item) { return item.kind == FetchItem::Kind::Uid; })) {
+        items.insert(items.begin(), FetchItem(FetchItem::Kind::Uid, "UID"));
+    }
+
+    // The messages of the set, in the order of their sequence numbers
+    int messageCount = mailbox.uids.size();
+    vector<int> sequenceNumbers;
+    bool valid = true;
+    for (int seq = 1; seq <= messageCount && valid; seq++) {
+        if (byUid ? inSequenceSet(set, mailbox.uids[seq - 1], highestUID, valid) : inSequenceSet(set, seq, messageCount, valid)) {
+            sequenceNumbers.push_back(seq);
+        }
+    }
+    if (!valid || (!byUid && messageCount == 0)) {
+        send(tag + " BAD Invalid message set\r\n");
+        return;
+    }
+
+    string message;
+    string response;
+    for (int seq : sequenceNumbers) {
+        int uid = mailbox.uids[seq - 1];
+        bool complete = !mailbox.headerUIDs.count(uid) && !mailbox.partialUIDs.count(uid);
+        bool loaded = false;
+        response = "* " + to_string(seq) + " FETCH (";
+        for (size_t i = 0; i < items.size(); i++) {
+            const FetchItem &item = items[i];
+            response += i == 0 ? "" : " ";
+            response += item.name + " ";
+            if (item.kind == FetchItem::Kind::Uid) {
+                response += to_string(uid);
+            } else if (item.kind == FetchItem::Kind::Flags) {
+                response += "()";
+            } else if (item.kind == FetchItem::Kind::Size) {
+                response += to_string(messageSize(uid));
+            } else if (item.kind == FetchItem::Kind::InternalDate) {
+                // The time the message was saved
+                struct stat info;
+                tm date = {};
+                time_t saved = stat(MessagePaths(mailboxDir).message(uid).c_str(), &info) == 0 ? info.st_mtime : 0;
+                gmtime_r(&saved, &date);
+                char formatted[40];
+                strftime(formatted, sizeof(formatted), "\"%d-%b-%Y %H:%M:%S +0000\"", &date);
+                response += formatted;
+            } else {
+                // Only the header of incomplete messages is stored
+                bool wholeSection = item.section.empty() || item.section == "TEXT";
+                if (!complete && wholeSection) {
+                    send(tag + " NO [UNAVAILABLE] Message UID " + to_string(uid) + " is not stored in full\r\n");
+                    return;
+                }
+                if (!loaded && !(loaded = loadMessage(uid, message))) {
+                    send(tag + " NO [UNAVAILABLE] Message UID " + to_string(uid) + " could not be read\r\n");
+                    return;
+                }
+                // A body without its MIME structure would be served as a different message
+                if (wholeSection && !rawUIDs.count(uid)) {
+                    send(tag + " NO [UNAVAILABLE] Message UID " + to_string(uid) + " is stored without its MIME structure\r\n");
+                    return;
+                }
+                size_t headerEnd = message.find("\r\n\r\n");
+                headerEnd = headerEnd == string::npos ? message.size() : headerEnd + 4;
+                string filtered;
+                string_view data = message;
+                if (item.section == "HEADER") {
+                    data = data.substr(0, headerEnd);
+                } else if (item.section == "TEXT") {
+                    data = data.substr(headerEnd);
+                } else if (item.section.starts_with("HEADER.FIELDS")) {
+                    filtered = filterHeader(data.substr(0, headerEnd), item.fields, item.section == "HEADER.FIELDS.NOT");
+                    data = filtered;
+                }
+                if (item.partialStart >= 0) {
+                    data = data.substr(min(static_cast<size_t>(item.partialStart), data.size()), item.partialLength);
+                }
+                response += "{" + to_string(data.size()) + "}\r\n";
+                response += data;
+            }
+        }
+        response += ")\r\n";
+        send(response);
+    }
+    send(tag + " OK " + (byUid ? "UID FETCH" : "FETCH") + " completed\r\n");
+}
+
+// Starts a sync run in a child process, returns its PID or -1
+static pid_t startSync(const vector<string> &command) {
+    vector<char *> argv;
+    for (const string &arg : command) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    pid_t pid;
+    if (posix_spawn(&pid, "/proc/self/exe", nullptr, nullptr, argv.data(), environ) != 0) {
+        cerr << "Error: Could not start the background sync." << endl;
+        return -1;
+    }
+    return pid;
+}
+
+int serveLocalStore(const ServeOptions &options) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+        bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+        cerr << "Error: Could not listen on 127.0.0.1:" << options.port << "." << endl;
+        if (listener >= 0) close(listener);
+        return -1;
+    }
+    cout << "Serving " << options.storeDir << " on 127.0.0.1:" << options.port << endl;
+
+    // A sync is started once the previous one finished and the interval passed
+    pid_t syncProcess = -1;
+    auto nextSync = chrono::steady_clock::now();
+    while (true) {
+        auto now = chrono::steady_clock::now();
+        if (syncProcess > 0 && waitpid(syncProcess, nullptr, WNOHANG) == syncProcess) {
+            syncProcess = -1;
+            nextSync = now + chrono::seconds(options.syncIntervalSeconds);
+        }
+        if (syncProcess < 0 && !options.syncCommand.empty() && now >= nextSync) {
+            syncProcess = startSync(options.syncCommand);
+            nextSync = now + chrono::seconds(options.syncIntervalSeconds);
+        }
+
+        // While a sync runs, it is checked for completion every second
+        int waitMs = syncProcess > 0 ? 1000 : options.syncCommand.empty() ? -1 : max(remainingMs(nextSync), 1);
+        pollfd pending = {listener, POLLIN, 0};
+        if (poll(&pending, 1, waitMs) > 0) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client >= 0 && activeClients.load() >= MAX_SERVE_CLIENTS) {
+                static const string BYE = "* BYE Too many connections\r\n";
+                ::send(client, BYE.data(), BYE.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                close(client);
+            } else if (client >= 0) {
+                activeClients++;
+                thread([client, &options]() {
+                    ServeClient(client, options).run();
+                    activeClients--;
+                }).detach();
+            }
+        }
+    }
+}
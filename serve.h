@@ -0,0 +1,67 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "utils.h"
+
+// Default port of the local endpoint and default pause between two background syncs
+const int DEFAULT_SERVE_PORT = 1143;
+const int DEFAULT_SYNC_INTERVAL_S = 300;
+
+/**
+ * Settings of the local read-only IMAP endpoint ("imapcl serve").
+ */
+struct ServeOptions {
+    string storeDir;                        // out_dir/server, the mailboxes are its subdirectories
+    int port = DEFAULT_SERVE_PORT;          // Port on 127.0.0.1
+    string username;                        // Credentials the local clients log in with (those of the auth file)
+    string password;
+    int syncIntervalSeconds = DEFAULT_SYNC_INTERVAL_S;
+    vector<string> syncCommand;             // Command line of the background sync, empty if the store is not synced
+};
+
+/**
+ * Messages of one mailbox of the local store, as recorded in its state file and progress journal.
+ */
+struct LocalMailbox {
+    int uidvalidity = -1;
+    vector<int> uids;                       // Ascending, the message with sequence number n has the UID uids[n - 1]
+    unordered_set<int> headerUIDs;          // Messages stored with their header fields only (-h)
+    unordered_set<int> partialUIDs;         // Messages stored only partially (--max-size)
+};
+
+/**
+ * Loads the messages of a mailbox directory without modifying it, so it can be read while a sync writes to it.
+ * The messages recorded in the progress journal of a running sync are included, only messages whose file exists are listed.
+ * @param dir - The mailbox directory.
+ * @param mailbox - The messages of the mailbox.
+ * @return - Returns true if the directory holds a downloaded mailbox, false otherwise.
+ */
+bool loadLocalMailbox(const string &dir, LocalMailbox &mailbox);
+
+/**
+ * Builds the command line of the background sync from that of the serve command: "serve" and the options
+ * of the endpoint are left out, so the sync downloads the mailbox like a plain run would.
+ * @param argc - The number of arguments of the serve command.
+ * @param argv - The arguments of the serve command.
+ * @return - The arguments of the sync run, starting with the programme name.
+ */
+vector<string> buildSyncCommand(int argc, char *argv[]);
+
+/**
+ * Answers IMAP clients on 127.0.0.1 from the local store: LOGIN/AUTHENTICATE PLAIN with the credentials of the
+ * auth file, LIST, STATUS, SELECT/EXAMINE, SEARCH and FETCH (and their UID forms). The store is read-only, flags
+ * are not stored. Each client is served by its own thread; the sync command is run in a child process every
+ * interval, and NOOP reports the messages it added or removed to a client that has the mailbox selected.
+ * @param options - The settings of the endpoint.
+ * @return - Returns -1 if the endpoint could not be opened, otherwise it serves until the programme is stopped.
+ */
+int serveLocalStore(const ServeOptions &options);
+
+#endif // SERVE_H
@@ -0,0 +1,317 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#include "session.h"
+#include "codec.h"
+
+// Where sending stops until the server's continuation request: the end of a literal announcement and its command's tag
+struct LiteralStop {
+    size_t end;
+    string tag;
+};
+
+// Responses of the commands sent at session start, kept in one buffer and checked in the order of the commands
+class ResponseBuffer {
+public:
+    explicit ResponseBuffer(const SessionReceive &receive) : receive(receive) {}
+
+    // Appends the next received chunk, returns false if the connection failed
+    bool receiveMore() {
+        int bytesReceived = receive(buffer, sizeof(buffer));
+        if (bytesReceived <= 0) {
+            return false;
+        }
+        data.append(buffer, bytesReceived);
+        return true;
+    }
+
+    // Reads the greeting line, returns false if the connection failed
+    bool readGreeting(string &greeting) {
+        size_t greetingEnd;
+        while ((greetingEnd = data.find("\r\n")) == string::npos) {
+            if (!receiveMore()) {
+                return false;
+            }
+        }
+        greeting = data.substr(0, greetingEnd);
+        data.erase(0, greetingEnd + 2);
+        return true;
+    }
+
+    // Waits for the server's continuation request ("+ ..."); a tagged response to the command means it was rejected
+    bool awaitContinuation(const string &tag, bool &rejected) {
+        while (true) {
+            size_t eol = data.find("\r\n", continuationScan);
+            if (eol == string::npos) {
+                if (!receiveMore()) {
+                    return false;
+                }
+                continue;
+            }
+            string_view line(data.data() + continuationScan, eol - continuationScan);
+            continuationScan = eol + 2;
+            if (line.starts_with("+")) {
+                return true;
+            }
+            if (line.starts_with(tag + " ")) {
+                rejected = true;
+                return true;
+            }
+        }
+    }
+
+    // Waits for the tagged status line of the next command, the untagged responses before it start at from
+    bool awaitTagged(const string &tag, size_t &from, string &status) {
+        from = scanPos;
+        while (!hasTaggedCompletion(data, tag, scanPos)) {
+            if (!receiveMore()) {
+                return false;
+            }
+        }
+        size_t statusStart = data.rfind("\r\n", scanPos - 3);
+        statusStart = statusStart == string::npos || statusStart < from ? from : statusStart + 2;
+        status = data.substr(statusStart, scanPos - statusStart);
+        return true;
+    }
+
+    string data;
+    size_t scanPos = 0;                     // End of the responses checked so far
+
+private:
+    const SessionReceive &receive;
+    char buffer[65536];
+    size_t continuationScan = 0;
+};
+
+// True if the tagged status line reports success
+static bool statusOK(const string &status, const string &tag) {
+    return status.compare(tag.size() + 1, 2, "OK") == 0;
+}
+
+// Appends the authentication command chosen by the capabilities announced in the greeting
+static void appendAuthentication(string &commands, vector<LiteralStop> &literalStops, const string &tag, const string &username,
+                                 const string &password, const string &capabilities) {
+    bool plain = hasCapability(capabilities, "AUTH=PLAIN");
+    if (plain && (hasCapability(capabilities, "SASL-IR") || hasCapability(capabilities, "LOGINDISABLED"))) {
+        // SASL PLAIN (RFC 4616): authorization identity (empty), user name and password separated by NUL
+        string credentials;
+        credentials += '\0';
+        credentials += username;
+        credentials += '\0';
+        credentials += password;
+        commands += tag + " AUTHENTICATE PLAIN";
+        if (hasCapability(capabilities, "SASL-IR")) {
+            // The credentials go out with the command (RFC 4959)
+            commands += ' ';
+        } else {
+            // The credentials follow the server's continuation request
+            commands += "\r\n";
+            literalStops.push_back({commands.size(), tag});
+        }
+        encodeBase64(credentials, commands);
+        commands += "\r\n";
+        return;
+    }
+
+    commands += tag + " LOGIN";
+    for (const string *argument : {&username, &password}) {
+        commands += ' ';
+        size_t literalEnd = appendAString(commands, *argument, nonSynchronizingLiteral(capabilities, argument->size()));
+        if (literalEnd != string::npos) {
+            literalStops.push_back({literalEnd, tag});
+        }
+    }
+    commands += "\r\n";
+}
+
+// Sends the commands, waiting for the continuation request where a synchronizing literal needs one
+static bool sendAwaitingContinuations(const SessionSend &send, ResponseBuffer &responses, const string &commands,
+                                      const vector<LiteralStop> &literalStops) {
+    size_t sent = 0;
+    bool rejected = false;
+    for (const LiteralStop &stop : literalStops) {
+        if (send(commands.substr(sent, stop.end - sent)) <= 0 || !responses.awaitContinuation(stop.tag, rejected)) {
+            return false;
+        }
+        sent = stop.end;
+        if (rejected) {
+            return true;                    // The tagged response is checked by the caller
+        }
+    }
+    return send(commands.substr(sent)) > 0;
+}
+
+bool authenticateSession(const SessionSend &send, const SessionReceive &receive, const string &username, const string &password,
+                         string &capabilities) {
+    ResponseBuffer responses(receive);
+    string greeting;
+    if (!responses.readGreeting(greeting)) {
+        cerr << "Error: Unable to read server greeting." << endl;
+        return false;
+    }
+    capabilities.clear();
+    if (greeting.starts_with("* PREAUTH")) {
+        return true;
+    }
+    if (!greeting.starts_with("* OK")) {
+        cerr << "Error: Server does not support IMAP or is not ready." << endl;
+        return false;
+    }
+
+    string tag = generateTag();
+    string commands;
+    vector<LiteralStop> literalStops;
+    appendAuthentication(commands, literalStops, tag, username, password, parseCapabilities(greeting));
+    if (!sendAwaitingContinuations(send, responses, commands, literalStops)) {
+        cerr << "Error: Failed to send authentication command." << endl;
+        return false;
+    }
+
+    size_t from;
+    string status;
+    if (!responses.awaitTagged(tag, from, status)) {
+        cerr << "Error: Unable to receive server response after LOGIN." << endl;
+        return false;
+    }
+    if (!statusOK(status, tag)) {
+        cerr << "Error: Authentication of user " << username << " failed." << endl;
+        return false;
+    }
+
+    // Servers announce the capabilities of the authenticated state with the result, which saves a CAPABILITY command
+    capabilities = parseCapabilities(responses.data.substr(from));
+    return true;
+}
+
+bool startSession(const SessionSend &send, const SessionReceive &receive, const string &username, const string &password,
+                  const string &mailbox, bool search, const string &criteria, const MailboxStatus &cachedStatus, SessionStart &session) {
+    ResponseBuffer responses(receive);
+    string greeting;
+    if (!responses.readGreeting(greeting)) {
+        cerr << "Error: Unable to read server greeting." << endl;
+        return false;
+    }
+    bool preauthenticated = greeting.starts_with("* PREAUTH");
+    if (!greeting.starts_with("* OK") && !preauthenticated) {
+        cerr << "Error: Server does not support IMAP or is not ready." << endl;
+        return false;
+    }
+    session.capabilities = parseCapabilities(greeting);
+
+    // All commands are written at once, except where the authentication needs the server's consent
+    // and where the cached status may make SELECT and UID SEARCH unnecessary
+    string commands;
+    vector<LiteralStop> literalStops;
+    string authenticationTag, statusTag, selectTag, searchTag;
+    if (!preauthenticated) {
+        authenticationTag = generateTag();
+        appendAuthentication(commands, literalStops, authenticationTag, username, password, session.capabilities);
+    }
+    string statusCommand;
+    if (search) {
+        statusTag = generateTag();
+        statusCommand = buildStatusCommand(statusTag, mailbox, session.capabilities);
+        commands += statusCommand;
+    }
+    string selectCommands;
+    vector<LiteralStop> selectLiteralStops;
+    selectTag = generateTag();
+    selectCommands += selectTag + " SELECT ";
+    size_t literalEnd = appendAString(selectCommands, mailbox, nonSynchronizingLiteral(session.capabilities, mailbox.size()));
+    if (literalEnd != string::npos) {
+        selectLiteralStops.push_back({literalEnd, selectTag});
+    }
+    selectCommands += "\r\n";
+    if (search) {
+        searchTag = generateTag();
+        selectCommands += searchTag + " UID SEARCH " + (hasCapability(session.capabilities, "ESEARCH") ? "RETURN (ALL) " : "") + criteria + "\r\n";
+    }
+    bool statusFirst = !statusCommand.empty() && cachedStatus.uidvalidity != -1;
+    if (!statusFirst) {
+        for (const LiteralStop &stop : selectLiteralStops) {
+            literalStops.push_back({commands.size() + stop.end, stop.tag});
+        }
+        commands += selectCommands;
+    }
+    if (!sendAwaitingContinuations(send, responses, commands, literalStops)) {
+        cerr << "Error: Failed to send authentication command." << endl;
+        return false;
+    }
+
+    size_t from;
+    string status;
+    if (!preauthenticated) {
+        if (!responses.awaitTagged(authenticationTag, from, status)) {
+            cerr << "Error: Unable to receive server response after LOGIN." << endl;
+            return false;
+        }
+        if (!statusOK(status, authenticationTag)) {
+            cerr << "Error: Authentication of user " << username << " failed." << endl;
+            return false;
+        }
+        string authenticatedCapabilities = parseCapabilities(responses.data.substr(from, responses.scanPos - from));
+        if (!authenticatedCapabilities.empty()) {
+            session.capabilities = authenticatedCapabilities;
+        }
+    }
+
+    if (!statusCommand.empty()) {
+        if (!responses.awaitTagged(statusTag, from, status)) {
+            cerr << "Error: Could not receive STATUS response from server." << endl;
+            return false;
+        }
+        // A mailbox that does not exist is reported by SELECT
+        if (statusOK(status, statusTag)) {
+            parseMailboxStatus(responses.data.substr(from, responses.scanPos - from), session.status);
+        }
+        if (statusFirst) {
+            if (mailboxUnchanged(cachedStatus, session.status, criteria)) {
+                session.unchanged = true;
+                return true;
+            }
+            if (!sendAwaitingContinuations(send, responses, selectCommands, selectLiteralStops)) {
+                cerr << "Error: Failed to send SELECT command." << endl;
+                return false;
+            }
+        }
+    }
+
+    if (!responses.awaitTagged(selectTag, from, status)) {
+        cerr << "Error: Could not receive SELECT response from server." << endl;
+        return false;
+    }
+    size_t uidvalidity = responses.data.find("[UIDVALIDITY ", from);
+    if (!statusOK(status, selectTag) || uidvalidity == string::npos || uidvalidity > responses.scanPos) {
+        cerr << "Unable to select mailbox: " << mailbox << endl;
+        return false;
+    }
+    session.uidvalidity = atoi(responses.data.c_str() + uidvalidity + 13);
+    if (!search) {
+        return true;
+    }
+
+    // The search result may be large, it is parsed while it streams in
+    SearchResponseParser parser(searchTag, parseMessageCount(string_view(responses.data).substr(from, responses.scanPos - from)));
+    bool complete = parser.feed(responses.data.data() + responses.scanPos, responses.data.size() - responses.scanPos);
+    char buffer[65536];
+    while (!complete) {
+        int bytesReceived = receive(buffer, sizeof(buffer));
+        if (bytesReceived <= 0) {
+            cerr << "Error: Could not receive response for SEARCH command." << endl;
+            return false;
+        }
+        complete = parser.feed(buffer, bytesReceived);
+    }
+    if (!parser.succeeded()) {
+        if (!parser.resultInvalid()) {
+            cerr << "Error: Server returned NO response for SEARCH command." << endl;
+        }
+        return false;
+    }
+    session.uids = move(parser.uids);
+    return true;
+}
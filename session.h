@@ -0,0 +1,69 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "utils.h"
+#include <functional>
+
+// Sends a complete command (plain or TLS connection), returns the number of bytes sent or a value <= 0 on error
+using SessionSend = function<int(const string &)>;
+// Receives the next chunk of data, returns the number of bytes received or a value <= 0 on error
+using SessionReceive = function<int(char *, size_t)>;
+
+/**
+ * State of the session after the pipelined startup.
+ */
+struct SessionStart {
+    string capabilities;            // From the greeting, replaced by those announced in the authentication response
+    int uidvalidity = -1;           // UIDVALIDITY of the selected mailbox
+    vector<int> uids;               // Result of UID SEARCH
+    MailboxStatus status;           // Counters of the mailbox before it was selected
+    bool unchanged = false;         // The counters match the cached ones, the mailbox was not selected
+};
+
+/**
+ * Reads the greeting and authenticates the user in one round trip where the server allows it.
+ * If the greeting announces AUTH=PLAIN and SASL-IR, the credentials are sent with AUTHENTICATE PLAIN and
+ * its initial response; otherwise LOGIN is used (AUTHENTICATE PLAIN without the initial response if LOGIN
+ * is disabled). Credentials that need a literal wait for the server's continuation unless it supports LITERAL+.
+ * @param send - Sends a complete command.
+ * @param receive - Receives the next chunk of data.
+ * @param username - The username.
+ * @param password - The password.
+ * @param capabilities - Set to the capabilities the server announced in its response to the authentication,
+ *                       empty if it did not, so that a CAPABILITY command is only needed then.
+ * @return - Returns true if the user was authenticated, false otherwise.
+ */
+bool authenticateSession(const SessionSend &send, const SessionReceive &receive, const string &username, const string &password,
+                         string &capabilities);
+
+/**
+ * Starts a session in two round trips: the greeting is read and the authentication, SELECT and UID SEARCH are
+ * then written at once, each response is checked in order. The CAPABILITY response code of the greeting decides
+ * how the user is authenticated (as in authenticateSession) and whether ESEARCH is used.
+ * If the authentication fails, the server rejects the commands behind it, so nothing is selected.
+ * When searching, a STATUS command goes ahead of SELECT. If a status of the mailbox is cached, the session stops
+ * after it to compare the counters, and SELECT and UID SEARCH are only sent if the mailbox changed.
+ * A mailbox name that needs a literal the server has to confirm (no LITERAL+, or LITERAL- with a longer name) is
+ * sent after the continuation request, and STATUS is then left out.
+ * @param send - Sends a complete command.
+ * @param receive - Receives the next chunk of data.
+ * @param username - The username.
+ * @param password - The password.
+ * @param mailbox - The mailbox to select.
+ * @param search - If false, the session ends after SELECT (e.g. for fetch-part).
+ * @param criteria - The search criteria built by buildSearchCriteria.
+ * @param cachedStatus - The status stored by the last complete download, its uidvalidity is -1 if there is none.
+ * @param session - The capabilities, UIDVALIDITY and UIDs of the session.
+ * @return - Returns true if the mailbox was selected and searched or found unchanged, false otherwise.
+ */
+bool startSession(const SessionSend &send, const SessionReceive &receive, const string &username, const string &password,
+                  const string &mailbox, bool search, const string &criteria, const MailboxStatus &cachedStatus, SessionStart &session);
+
+#endif // SESSION_H
@@ -0,0 +1,219 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#include "transcript.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static const string TRANSCRIPT_HEADER = "imapcl-transcript 1\n";
+
+// Written in place of credentials
+static const string REDACTED = "<redacted>";
+
+static ofstream recordFile;
+static chrono::steady_clock::time_point recordStart;
+static bool redactNextLine = false;        // The next line sent continues an authentication command
+
+// One recorded chunk received from the server
+struct ReplayChunk {
+    long microseconds;
+    string data;
+};
+
+static vector<ReplayChunk> replayChunks;
+static size_t replayNext = 0;               // Index of the chunk delivered next
+static size_t replayOffset = 0;             // Bytes of that chunk delivered already
+static string replaySent;                   // All data sent in the recorded session
+static size_t replaySentOffset = 0;         // Bytes of it matched by the commands sent so far
+static bool replayRedactNextLine = false;
+static bool replayDiverged = false;         // A command differed from the recording, the replay is over
+static bool replayActive = false;
+static bool replayOriginalSpeed = false;
+static chrono::steady_clock::time_point replayStart;
+
+bool startRecording(const string &path) {
+    // The transcript holds the plaintext of every message, only the user may read it
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    bool restricted = fchmod(fd, 0600) == 0;
+    close(fd);
+    if (!restricted) {
+        return false;
+    }
+    recordFile.open(path, ios::binary | ios::trunc);
+    if (!recordFile) {
+        return false;
+    }
+    recordFile << TRANSCRIPT_HEADER;
+    recordStart = chrono::steady_clock::now();
+    return true;
+}
+
+bool recording() {
+    return recordFile.is_open();
+}
+
+static void writeRecord(char direction, string_view data) {
+    long microseconds = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - recordStart).count();
+    recordFile << direction << ' ' << microseconds << ' ' << data.size() << '\n';
+    recordFile.write(data.data(), data.size());
+    recordFile << '\n';
+}
+
+// Case-insensitive check of the command name following the tag of a command line
+static bool isCommand(string_view line, string_view name, size_t &argumentsStart) {
+    size_t nameStart = line.find(' ');
+    if (nameStart == string_view::npos || line.size() < nameStart + 1 + name.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < name.size(); i++) {
+        if (toupper(static_cast<unsigned char>(line[nameStart + 1 + i])) != name[i]) {
+            return false;
+        }
+    }
+    argumentsStart = nameStart + 1 + name.size();
+    return argumentsStart == line.size() || line[argumentsStart] == ' ' || line[argumentsStart] == '\r';
+}
+
+// Replaces the credentials of the data sent, continuation tells if the next line continues an authentication command
+static string redactSent(string_view data, bool &continuation) {
+    string redacted;
+    size_t lineStart = 0;
+    while (lineStart < data.size()) {
+        size_t eol = data.find('\n', lineStart);
+        size_t lineEnd = eol == string_view::npos ? data.size() : eol + 1;
+        string_view line = data.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd;
+        string_view content = line.substr(0, line.find_last_not_of("\r\n") + 1);
+
+        size_t argumentsStart;
+        bool login = isCommand(content, "LOGIN", argumentsStart);
+        bool authenticate = !login && isCommand(content, "AUTHENTICATE", argumentsStart);
+        if (continuation) {
+            // A literal or continuation response of the authentication command
+            redacted += REDACTED;
+            redacted += line.substr(content.size());
+        } else if (login || authenticate) {
+            // AUTHENTICATE keeps its mechanism, only the initial response is hidden
+            size_t mechanismEnd = authenticate ? content.find(' ', argumentsStart + 1) : argumentsStart;
+            if (mechanismEnd == string_view::npos) {
+                mechanismEnd = content.size();
+            }
+            redacted += content.substr(0, mechanismEnd);
+            redacted += mechanismEnd < content.size() ? " " + REDACTED : "";
+            redacted += line.substr(content.size());
+        } else {
+            redacted += line;
+            continue;
+        }
+
+        // The command goes on if it announces a literal or the SASL exchange waits for a response
+        bool literal = content.ends_with('}') && content.find('{') != string_view::npos;
+        continuation = (literal && (login || authenticate || continuation)) ||
+                       (authenticate && content.find(' ', argumentsStart + 1) == string_view::npos);
+    }
+    return redacted;
+}
+
+void recordSent(string_view data) {
+    if (!recording()) {
+        return;
+    }
+    writeRecord('S', redactSent(data, redactNextLine));
+}
+
+void recordReceived(const char *data, size_t length) {
+    if (recording()) {
+        writeRecord('R', string_view(data, length));
+    }
+}
+
+bool startReplay(const string &path, bool originalSpeed) {
+    ifstream file(path, ios::binary);
+    string content((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    if (!file || !content.starts_with(TRANSCRIPT_HEADER)) {
+        return false;
+    }
+
+    // Only the received chunks are replayed, the commands come from the client under test
+    size_t pos = TRANSCRIPT_HEADER.size();
+    while (pos < content.size()) {
+        size_t eol = content.find('\n', pos);
+        if (eol == string::npos) {
+            return false;
+        }
+        istringstream fields(content.substr(pos, eol - pos));
+        char direction;
+        long microseconds;
+        size_t length;
+        if (!(fields >> direction >> microseconds >> length) || eol + 1 + length + 1 > content.size()) {
+            return false;
+        }
+        if (direction == 'R') {
+            replayChunks.push_back({microseconds, content.substr(eol + 1, length)});
+        } else if (direction == 'S') {
+            replaySent.append(content, eol + 1, length);
+        }
+        pos = eol + 1 + length + 1;
+    }
+    replayActive = true;
+    replayOriginalSpeed = originalSpeed;
+    replayStart = chrono::steady_clock::now();
+    return true;
+}
+
+bool replaying() {
+    return replayActive;
+}
+
+bool replaySend(string_view data) {
+    if (replayDiverged) {
+        return false;
+    }
+    // The recorded data is compared as one stream, the client may split it differently into chunks
+    string redacted = redactSent(data, replayRedactNextLine);
+    if (replaySent.compare(replaySentOffset, redacted.size(), redacted) != 0) {
+        cerr << "Error: The commands differ from the recorded session at byte " << replaySentOffset << " of the data sent." << endl;
+        replayDiverged = true;
+        return false;
+    }
+    replaySentOffset += redacted.size();
+    return true;
+}
+
+bool replayFailed() {
+    return replayDiverged;
+}
+
+int replayReceive(char *buffer, size_t length) {
+    if (replayDiverged || replayNext >= replayChunks.size()) {
+        return 0;
+    }
+    const ReplayChunk &chunk = replayChunks[replayNext];
+    if (replayOriginalSpeed && replayOffset == 0) {
+        this_thread::sleep_until(replayStart + chrono::microseconds(chunk.microseconds));
+    }
+    size_t count = min(length, chunk.data.size() - replayOffset);
+    memcpy(buffer, chunk.data.data() + replayOffset, count);
+    replayOffset += count;
+    if (replayOffset == chunk.data.size()) {
+        replayNext++;
+        replayOffset = 0;
+    }
+    return count;
+}
@@ -0,0 +1,94 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#ifndef TRANSCRIPT_H
+#define TRANSCRIPT_H
+
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+/**
+ * Session transcripts (--record and --replay). A transcript holds the plaintext IMAP byte stream of one session as
+ * it passed the transport functions (sendCommand/receiveData and their BIO variants), chunk by chunk, each chunk
+ * with the time since the recording started:
+ *
+ *     imapcl-transcript 1
+ *     R <microseconds> <length>\n<data>\n       (received from the server)
+ *     S <microseconds> <length>\n<data>\n       (sent to the server, credentials redacted)
+ *
+ * Replaying delivers the received chunks with their original boundaries instead of a connection, so the parsers
+ * and the storage see exactly the recorded traffic. The commands of the client have to match the recorded ones.
+ */
+
+/**
+ * Starts recording the session to a file, replacing it.
+ * @param path - The path of the transcript.
+ * @return - Returns true if the file could be opened, false otherwise.
+ */
+bool startRecording(const string &path);
+
+/**
+ * Returns whether the session is being recorded.
+ * @return - True after a successful startRecording.
+ */
+bool recording();
+
+/**
+ * Records data sent to the server. The arguments of LOGIN and AUTHENTICATE, and the literals and continuation
+ * responses belonging to them, are replaced by "<redacted>".
+ * @param data - The data as sent.
+ */
+void recordSent(string_view data);
+
+/**
+ * Records a chunk received from the server.
+ * @param data - The received data.
+ * @param length - The number of bytes received.
+ */
+void recordReceived(const char *data, size_t length);
+
+/**
+ * Loads a transcript to be replayed instead of connecting to the server.
+ * @param path - The path of the transcript.
+ * @param originalSpeed - If true, every chunk is delivered at its recorded time since the start of the replay,
+ *                        otherwise as soon as it is asked for.
+ * @return - Returns true if the transcript could be read, false otherwise.
+ */
+bool startReplay(const string &path, bool originalSpeed);
+
+/**
+ * Returns whether the session is replayed from a transcript.
+ * @return - True after a successful startReplay.
+ */
+bool replaying();
+
+/**
+ * Checks data sent by the client against the data sent in the recorded session (after redaction), so a replay
+ * whose commands differ from the recording fails instead of delivering responses to other commands.
+ * @param data - The data as sent.
+ * @return - Returns true if the data continues the recorded data sent, false otherwise; after a mismatch the replay
+ *           is over, further sends fail and receiving returns 0.
+ */
+bool replaySend(string_view data);
+
+/**
+ * Tells whether the replay failed because the commands differ from the recording.
+ * @return - Returns true after a mismatch found by replaySend, false otherwise.
+ */
+bool replayFailed();
+
+/**
+ * Delivers the next received chunk of the transcript, or its rest if the buffer was smaller than the chunk.
+ * @param buffer - The buffer to store the data.
+ * @param length - The size of the buffer.
+ * @return - The number of bytes stored, 0 once the transcript is exhausted (the server closed the connection).
+ */
+int replayReceive(char *buffer, size_t length);
+
+#endif // TRANSCRIPT_H
@@ -0,0 +1,282 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#include "uidremap.h"
+#include "headerarchive.h"
+#include <map>
+#include <set>
+#include <strings.h>
+
+// Bytes of a stored message read to find its header fields
+const size_t MATCH_HEADER_BYTES = 65536;
+
+// Prefix of the files renamed by an unfinished remap, so they cannot collide with the files of other messages.
+// The temporary name ".remap_<new UID>_<old name>" keeps both names, so an interrupted remap can be finished or undone.
+static const string REMAP_PREFIX = ".remap_";
+
+// Prefix of the files of the previous generation no message on the server was matched with, ".stale_<old UIDVALIDITY>_<name>";
+// they are kept aside for the user, as the messages downloaded again must not mix with their stubs, parts and attachments
+static const string STALE_PREFIX = ".stale_";
+
+// Created with the new UIDVALIDITY once all files carry their temporary names, just before the new state is written;
+// an interrupted remap is finished if the state has that UIDVALIDITY already, otherwise undone
+static const string REMAP_MARKER = ".remap_renamed";
+
+// Splits "message_uid_N<suffix>", where the suffix starts with '.' or '_' (the message, its stubs, parts and attachments)
+static bool parseMessageFileName(const string &name, int &uid, string &suffix) {
+    if (!name.starts_with("message_uid_")) {
+        return false;
+    }
+    const char *end = name.data() + name.size();
+    auto [suffixStart, ec] = from_chars(name.data() + 12, end, uid);
+    if (ec != errc() || suffixStart == end || (*suffixStart != '.' && *suffixStart != '_')) {
+        return false;
+    }
+    suffix = suffixStart;
+    return true;
+}
+
+// Splits a temporary name into the new UID and the old name
+static bool parseTemporaryName(const string &name, int &newUID, string &oldName) {
+    if (!name.starts_with(REMAP_PREFIX) || name == REMAP_MARKER) {
+        return false;
+    }
+    const char *end = name.data() + name.size();
+    auto [separator, ec] = from_chars(name.data() + REMAP_PREFIX.size(), end, newUID);
+    if (ec != errc() || separator == end || *separator != '_') {
+        return false;
+    }
+    oldName = separator + 1;
+    return true;
+}
+
+// Name of a message file under a new UID
+static string renamedFile(const string &oldName, int newUID) {
+    int oldUID;
+    string suffix;
+    parseMessageFileName(oldName, oldUID, suffix);
+    return "message_uid_" + to_string(newUID) + suffix;
+}
+
+// Finishes the renames of a remap interrupted after the state of the new generation was written, otherwise restores
+// the old names
+static void recoverInterruptedRemap(const string &mailboxDir) {
+    int markerUIDValidity = -1;
+    ifstream(mailboxDir + "/" + REMAP_MARKER) >> markerUIDValidity;
+    MailboxState state;
+    bool finish = markerUIDValidity != -1 && readStateFile(mailboxDir, state) && state.uidvalidity == markerUIDValidity;
+    for (const auto &entry : fs::directory_iterator(mailboxDir)) {
+        string name = entry.path().filename().string();
+        int newUID;
+        string oldName;
+        if (parseTemporaryName(name, newUID, oldName)) {
+            error_code error;
+            fs::rename(entry.path(), mailboxDir + "/" + (finish ? renamedFile(oldName, newUID) : oldName), error);
+        }
+    }
+    syncPath(mailboxDir);
+    fs::remove(mailboxDir + "/" + REMAP_MARKER);
+}
+
+static string trimValue(string_view value) {
+    size_t start = value.find_first_not_of(" \t");
+    size_t end = value.find_last_not_of(" \t");
+    return start == string_view::npos ? "" : string(value.substr(start, end - start + 1));
+}
+
+string messageMatchKey(string_view header) {
+    string messageId, date;
+
+    // Stored messages start with an empty line before their header fields
+    size_t pos = header.starts_with("\r\n") ? 2 : header.starts_with("\n") ? 1 : 0;
+    while (pos < header.size()) {
+        size_t eol = header.find('\n', pos);
+        string_view line = header.substr(pos, eol == string_view::npos ? string_view::npos : eol - pos);
+        if (line.ends_with('\r')) {
+            line.remove_suffix(1);
+        }
+        if (line.empty()) {
+            break;                          // End of the header
+        }
+
+        // Only the first line of a field counts, stored messages keep no continuation lines
+        size_t colon = line.find(':');
+        if (colon != string_view::npos) {
+            string value = trimValue(line.substr(colon + 1));
+            if (colon == 10 && strncasecmp(line.data(), "message-id", 10) == 0 && messageId.empty()) {
+                messageId = value;
+            } else if (colon == 4 && strncasecmp(line.data(), "date", 4) == 0 && date.empty()) {
+                date = value;
+            }
+        }
+        if (eol == string_view::npos) {
+            break;
+        }
+        pos = eol + 1;
+    }
+    return messageId.empty() ? "" : messageId + " " + date;
+}
+
+// Adds a key, a key seen twice is marked ambiguous (-1) and matches nothing
+static void addKey(unordered_map<string, int> &keys, const string &key, int uid) {
+    if (key.empty()) {
+        return;
+    }
+    auto [entry, inserted] = keys.emplace(key, uid);
+    if (!inserted) {
+        entry->second = -1;
+    }
+}
+
+// Fetches the keys of all messages on the server
+static bool fetchServerKeys(const function<int(const string &)> &send, const function<int(char *, size_t)> &receive,
+                            unordered_map<string, int> &serverKeys) {
+    char buffer[65536];
+    string tag = generateTag();
+    if (send(tag + " UID FETCH 1:* (UID BODY.PEEK[HEADER.FIELDS (MESSAGE-ID DATE)])\r\n") <= 0) {
+        cerr << "Error: Failed to send UID FETCH command for message identifiers." << endl;
+        return false;
+    }
+    HeaderFetchParser parser(tag, [&](int uid, long, string_view fields) { addKey(serverKeys, messageMatchKey(fields), uid); });
+    bool complete = false;
+    while (!complete) {
+        int bytesReceived = receive(buffer, sizeof(buffer));
+        if (bytesReceived <= 0) {
+            cerr << "Error: Could not receive message identifiers from server." << endl;
+            return false;
+        }
+        complete = parser.feed(buffer, bytesReceived);
+    }
+    if (!parser.succeeded()) {
+        cerr << "Error: Server returned NO response for UID FETCH command." << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool remapMailbox(const string &outDir, const string &mailbox, const string &server, int uidvalidity,
+                  const function<int(const string &)> &send, const function<int(char *, size_t)> &receive,
+                  vector<int> &remappedUIDs) {
+    string mailboxDir = outDir + "/" + server + "/" + mailbox;
+    remappedUIDs.clear();
+    if (!fs::is_directory(mailboxDir)) {
+        return true;
+    }
+    recoverInterruptedRemap(mailboxDir);
+
+    // The state of the previous generation
+    MailboxState state;
+    if (!readStateFile(mailboxDir, state) || state.uidvalidity == uidvalidity) {
+        return true;
+    }
+
+    // Keys of the stored messages, read from the header fields at the start of their files
+    unordered_map<string, int> storedKeys;
+    vector<char> header(MATCH_HEADER_BYTES);
+    for (int uid : state.uids) {
+        ifstream messageFile(mailboxDir + "/message_uid_" + to_string(uid) + ".eml", ios::binary);
+        messageFile.read(header.data(), header.size());
+        addKey(storedKeys, messageMatchKey(string_view(header.data(), messageFile.gcount())), uid);
+    }
+
+    // Keys of all messages on the server, whatever the search criteria of this run, fetched without setting \Seen
+    unordered_map<string, int> serverKeys;
+    if (!storedKeys.empty() && !fetchServerKeys(send, receive, serverKeys)) {
+        return false;
+    }
+
+    // New UID of every stored message matched unambiguously
+    map<int, int> newUIDs;
+    for (const auto &[key, storedUID] : storedKeys) {
+        auto match = serverKeys.find(key);
+        if (storedUID != -1 && match != serverKeys.end() && match->second != -1) {
+            newUIDs[storedUID] = match->second;
+        }
+    }
+
+    // The message files and their stubs, parts and attachments are renamed in two steps, so a new name never
+    // replaces a file that still has to be renamed
+    vector<string> names;
+    for (const auto &entry : fs::directory_iterator(mailboxDir)) {
+        names.push_back(entry.path().filename().string());
+    }
+    vector<pair<string, int>> renamed;          // Temporary name, new UID
+    for (const string &name : names) {
+        int storedUID;
+        string suffix;
+        if (!parseMessageFileName(name, storedUID, suffix)) {
+            continue;
+        }
+        auto match = newUIDs.find(storedUID);
+        if (match == newUIDs.end()) {
+            // Unmatched, the new message with this UID is another one
+            error_code error;
+            fs::rename(mailboxDir + "/" + name, mailboxDir + "/" + STALE_PREFIX + to_string(state.uidvalidity) + "_" + name, error);
+            continue;
+        }
+        if (match->second == storedUID) {
+            continue;
+        }
+        string temporaryName = REMAP_PREFIX + to_string(match->second) + "_" + name;
+        error_code error;
+        fs::rename(mailboxDir + "/" + name, mailboxDir + "/" + temporaryName, error);
+        if (!error) {
+            renamed.push_back({temporaryName, match->second});
+        }
+    }
+
+    // The state of the new generation lists the remapped messages, their completeness is kept
+    set<int> remapped;
+    for (const auto &[storedUID, newUID] : newUIDs) {
+        if (storedUID == newUID && fs::exists(mailboxDir + "/message_uid_" + to_string(newUID) + ".eml")) {
+            remapped.insert(newUID);
+        }
+    }
+    for (const auto &[temporaryName, newUID] : renamed) {
+        int parsedUID;
+        string oldName;
+        parseTemporaryName(temporaryName, parsedUID, oldName);
+        if (renamedFile(oldName, newUID) == "message_uid_" + to_string(newUID) + ".eml") {
+            remapped.insert(newUID);
+        }
+    }
+    vector<int> remappedHeaderUIDs, remappedPartialUIDs;
+    for (const auto &[storedUID, newUID] : newUIDs) {
+        if (remapped.count(newUID) && state.headerUIDs.count(storedUID)) {
+            remappedHeaderUIDs.push_back(newUID);
+        }
+        if (remapped.count(newUID) && state.partialUIDs.count(storedUID)) {
+            remappedPartialUIDs.push_back(newUID);
+        }
+    }
+    sort(remappedHeaderUIDs.begin(), remappedHeaderUIDs.end());
+    sort(remappedPartialUIDs.begin(), remappedPartialUIDs.end());
+    remappedUIDs.assign(remapped.begin(), remapped.end());
+
+    // The marker names the new UIDVALIDITY; once the state of the new generation is written, a crash leaves the
+    // renames to be finished by the next run, before that they are undone
+    syncPath(mailboxDir);
+    {
+        ofstream marker(mailboxDir + "/" + REMAP_MARKER);
+        marker << uidvalidity << endl;
+    }
+    syncPath(mailboxDir + "/" + REMAP_MARKER);
+    syncPath(mailboxDir);
+    updateStateFile(outDir, mailbox, uidvalidity, remappedUIDs, server, remappedHeaderUIDs, remappedPartialUIDs);
+
+    for (const auto &[temporaryName, newUID] : renamed) {
+        int parsedUID;
+        string oldName;
+        parseTemporaryName(temporaryName, parsedUID, oldName);
+        error_code error;
+        fs::rename(mailboxDir + "/" + temporaryName, mailboxDir + "/" + renamedFile(oldName, newUID), error);
+    }
+    syncPath(mailboxDir);
+    fs::remove(mailboxDir + "/" + REMAP_MARKER);
+    return true;
+}
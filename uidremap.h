@@ -0,0 +1,48 @@
+/**************************
+ * IMAP4rev1 client 
+ * Author: Marek Joukl
+ * Date: 15.11. 2024 
+ * Login: xjoukl00
+**************************/
+
+#ifndef UIDREMAP_H
+#define UIDREMAP_H
+
+#include "utils.h"
+#include <functional>
+
+/**
+ * Recovery after a UIDVALIDITY change (server migration, rebuilt folder). Instead of downloading the whole
+ * mailbox again, the stored messages are matched with the messages on the server by their Message-ID and Date
+ * header fields, which are fetched for all messages of the mailbox with one command, whatever the search criteria
+ * of the run. The files of the matched messages (and their stubs, parts and attachments) are renamed to the new
+ * UIDs and the state is rewritten for the new UIDVALIDITY, so only the unmatched messages are downloaded. The files of
+ * the unmatched stored messages are moved aside as ".stale_<old UIDVALIDITY>_<name>". A remap interrupted by a crash
+ * is finished, or undone if not all files were renamed yet, by the next run.
+ */
+
+/**
+ * Identifies a message across UIDVALIDITY generations by its header fields.
+ * @param header - The header of the message, or the beginning of a stored message file.
+ * @return - "message-id date", or an empty string if the message has no Message-ID.
+ */
+string messageMatchKey(string_view header);
+
+/**
+ * Remaps the stored messages of a mailbox whose state belongs to an older UIDVALIDITY. Nothing is done if the
+ * state is current or missing. Messages stored header-only or partially stay marked as such under their new UID.
+ * Messages whose key is not unique, locally or on the server, are left to be downloaded again.
+ * @param outDir - Base output directory.
+ * @param mailbox - The mailbox folder.
+ * @param server - The server address.
+ * @param uidvalidity - The new UIDVALIDITY of the mailbox.
+ * @param send - Sends a complete command (plain or TLS connection).
+ * @param receive - Receives the next chunk of data.
+ * @param remappedUIDs - The new UIDs of the messages whose files were renamed.
+ * @return - Returns false on a connection or server error, the state is then left unchanged; true otherwise.
+ */
+bool remapMailbox(const string &outDir, const string &mailbox, const string &server, int uidvalidity,
+                  const function<int(const string &)> &send, const function<int(char *, size_t)> &receive,
+                  vector<int> &remappedUIDs);
+
+#endif // UIDREMAP_H
@@ -6,13 +6,21 @@
 **************************/
 
 #include "utils.h"
+#include <climits>
+#include <fcntl.h>
+#include <set>
+#include <strings.h>
 
 int commandCounter = 1;
 
 string generateTag() {
-    stringstream ss;
-    ss << "a" << setw(3) << setfill('0') << commandCounter++;
-    return ss.str();
+    // "a" and at least three digits, short enough for the string to stay inline
+    char tag[16] = {'a', '0', '0', '0'};
+    char digits[12];
+    size_t length = to_chars(digits, digits + sizeof(digits), commandCounter++).ptr - digits;
+    size_t start = length < 3 ? 4 - length : 1;
+    memcpy(tag + start, digits, length);
+    return string(tag, start + length);
 }
 
 // Function to read the authentication file and extract username and password
@@ -24,12 +32,19 @@ pair<string, string> readAuthFile(const string &authFile) {
         throw runtime_error("Unable to open authentication file: " + authFile);
     }
 
+    // The values are written as "username = value", the whitespace around them is not part of them
+    auto value = [](const string &line) {
+        size_t start = line.find_first_not_of(" \t", line.find('=') + 1);
+        size_t end = line.find_last_not_of(" \t\r");
+        return start == string::npos || end < start ? string() : line.substr(start, end - start + 1);
+    };
+
     // Read the file line by line to extract the username and password
     while (getline(file, line)) {
         if (line.find("username") != string::npos) {
-            username = line.substr(line.find('=') + 1);
+            username = value(line);
         } else if (line.find("password") != string::npos) {
-            password = line.substr(line.find('=') + 1);
+            password = value(line);
         }
     }
 
@@ -53,7 +68,7 @@ string formatOutMsg(const string &mailbox, int messageCount, bool newMessagesOnl
     return outMsg;
 }
 
-bool createDir(const string outDir, const int uidvalidity, const string mailbox, vector<int> messageUIDs, string server, bool headersOnly) {
+bool createDir(const string &outDir, const string &mailbox, const string &server) {
     string path = outDir + "/" + server + "/" + mailbox;
 
     if (!fs::exists(path)) {
@@ -64,51 +79,6 @@ bool createDir(const string outDir, const int uidvalidity, const string mailbox,
             return false;
         }
     }
-
-    // Check if state.txt already exists to merge old UIDs
-    unordered_set<int> allUIDs(messageUIDs.begin(), messageUIDs.end());
-    string stateFilePath = path + "/state.txt";
-
-    if (fs::exists(stateFilePath)) {
-        ifstream stateFile(stateFilePath);
-        string line;
-
-        // Read the existing UIDs from the state.txt file
-        while (getline(stateFile, line)) {
-            if (line.find("UIDs:") != string::npos) {
-                istringstream iss(line);
-                string key;
-                int uid;
-
-                iss >> key;  // Skip the "UIDs:" part
-                while (iss >> uid) {
-                    allUIDs.insert(uid);  // Add existing UIDs to the set
-                }
-                break;
-            }
-        }
-        stateFile.close();
-    }
-
-    // Open state.txt for writing and save UIDVALIDITY and all UIDs
-    ofstream outFile(stateFilePath);
-    if (!outFile) {
-        cerr << "Error: Could not open file to save UIDVALIDITY." << endl;
-        return false;
-    }
-
-    outFile << "HeadersOnly: " << boolalpha << headersOnly << endl;
-
-    outFile << "UIDVALIDITY: " << uidvalidity << endl;
-
-    // Write the combined list of UIDs
-    outFile << "UIDs: ";
-    for (const int uid : allUIDs) {
-        outFile << uid << " ";
-    }
-    outFile << "\n";
-
-    outFile.close();
     return true;
 }
 
@@ -127,9 +97,58 @@ void printHelp() {
     cout << "  -c certfile    File with certificates used to verify the SSL/TLS certificate presented by the server.\n";
     cout << "  -C certaddr    Directory where certificates for verifying the SSL/TLS certificate presented by the server\n";
     cout << "                 are stored. Default value is /etc/ssl/certs.\n";
+    cout << "  --ktls         With -T, let the kernel decrypt the connection (kTLS) and splice message bodies straight\n";
+    cout << "                 to the files. Falls back to the usual download if the kernel or cipher does not support it.\n";
+    cout << "  --connect-timeout MS\n";
+    cout << "                 Deadline for connecting to the server, including the TLS handshake. Default value is 10000.\n";
+    cout << "  --read-timeout MS\n";
+    cout << "                 Time the server may stay silent while a command is running, 0 disables it. Default value is 120000.\n";
+    cout << "                 A session that times out is abandoned and the programme exits with -2.\n";
+    cout << "  --fast-startup Send LOGIN, SELECT and SEARCH at once after the greeting (two round trips instead of five).\n";
     cout << "  -n             Only work with new messages (reading).\n";
+    cout << "  --search CRITERIA\n";
+    cout << "                 Download only the messages matching the IMAP SEARCH criteria, evaluated by the server, e.g.\n";
+    cout << "                 'SINCE 2024-01-01 BEFORE 2024-07-01 OR FROM alice FROM bob NOT LARGER 10000000'.\n";
     cout << "  -h             Download only the headers of messages.\n";
-    cout << "  -b MAILBOX     The name of the mailbox to work with on the server. The default value is INBOX.\n\n";
+    cout << "  --bulk-headers With -h, fetch the headers of many messages per command and store them in headers.jsonl\n";
+    cout << "                 (one JSON record per message) indexed by UID in headers.idx instead of one file per message.\n";
+    cout << "  -b MAILBOX     The name of the mailbox to work with on the server. The default value is INBOX.\n";
+    cout << "  --max-size N   Messages larger than N bytes are saved only partially and queued to be finished later.\n";
+    cout << "  --partial-size N\n";
+    cout << "                 Number of body bytes saved for partial messages. Defaults to the --max-size value.\n";
+    cout << "  --finish-partial\n";
+    cout << "                 Download the queued partial messages in full.\n";
+    cout << "  --lazy-attachments\n";
+    cout << "                 Download only the text parts of messages, attachments are saved as stubs (.stubs file).\n";
+    cout << "  --extract-attachments\n";
+    cout << "                 Save complete messages and write their attachments, decoded, next to them.\n";
+    cout << "                 With fetch-part, the downloaded part is decoded (by the server if it supports BINARY).\n";
+    cout << "  --index        Add the downloaded messages to the local full-text index of the mailbox.\n";
+    cout << "  --order ORDER  Download order of the messages: oldest (server order, default), newest or smallest.\n";
+    cout << "  --weights FILE\n";
+    cout << "                 File with lines \"UID weight\"; messages with a higher weight are downloaded first.\n";
+    cout << "  --time-budget S\n";
+    cout << "                 Stop requesting messages S seconds after the start; the rest is left for the next run.\n";
+    cout << "  --pipeline-memory MB\n";
+    cout << "                 Cap of the response data requested ahead by the fetch pipeline. Default value is 64.\n";
+    cout << "  --eol crlf|lf  Save the messages with CRLF or LF line endings. By default the data is saved as received.\n";
+    cout << "  --stats        Print the statistics of the download (pipeline depth, RTT, bandwidth, allocations with make MEMSTATS=1).\n";
+    cout << "  --mem-stats    Print the RSS peaks of each phase of the run, and the allocations and heap peaks with make MEMSTATS=1.\n";
+    cout << "  --record FILE  Record the data exchanged with the server and its timing to FILE (credentials redacted).\n";
+    cout << "  --replay FILE  Replay a recorded session instead of connecting to the server, e.g. to benchmark changes.\n";
+    cout << "  --replay-speed original|max\n";
+    cout << "                 Deliver the recorded responses at their original times or as fast as possible (default).\n\n";
+
+    cout << "Commands:\n";
+    cout << "  imapcl fetch-part server UID SECTION [options] -a auth_file -o out_dir\n";
+    cout << "                 Download a single part of a message, e.g. an attachment skipped by --lazy-attachments.\n";
+    cout << "  imapcl search server term... [-b MAILBOX] -o out_dir\n";
+    cout << "                 Print the downloaded messages containing all terms, using the index built with --index.\n";
+    cout << "                 Terms may be limited to a header field, e.g. from:alice or subject:invoice.\n";
+    cout << "  imapcl serve server [options] -a auth_file -o out_dir [--listen PORT] [--sync-interval S]\n";
+    cout << "                 Answer IMAP clients on 127.0.0.1:PORT (default 1143) read-only from the downloaded mailboxes,\n";
+    cout << "                 logging in with the credentials of auth_file. The mailbox is synced with the options given\n";
+    cout << "                 every S seconds (default 300, 0 serves the store without syncing).\n\n";
     cout << "  --help         Display this help message.\n\n";
 
 
@@ -140,17 +159,29 @@ void printHelp() {
 }
 
 
-void updateStateFile(const string &outDir, const string &mailbox, int uidvalidity, const vector<int> &uids, const string server, bool headersOnly) {
-    string stateFilePath = outDir + "/" + server + "/" + mailbox + "/state.txt";
+bool syncPath(const string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+void updateStateFile(const string &outDir, const string &mailbox, int uidvalidity, const vector<int> &uids, const string server,
+                     const vector<int> &headerUIDs, const vector<int> &partialUIDs) {
+    string mailboxDir = outDir + "/" + server + "/" + mailbox;
+    string stateFilePath = mailboxDir + "/state.txt";
 
-    ofstream stateFile(stateFilePath);
+    // The new state is written next to the old one and renamed over it, so a crash leaves one of them intact
+    string tmpFilePath = stateFilePath + ".tmp";
+    ofstream stateFile(tmpFilePath);
     if (!stateFile) {
         cerr << "Error: Could not open file to update state: " << stateFilePath << "." << endl;
         return;
     }
 
-    stateFile << "HeadersOnly: " << boolalpha << headersOnly << endl;
-
     stateFile << "UIDVALIDITY: " << uidvalidity << endl;
 
     // Write the updated UIDs
@@ -160,7 +191,299 @@ void updateStateFile(const string &outDir, const string &mailbox, int uidvalidit
     }
     stateFile << "\n";
 
+    // Write the messages saved without their body, a full run completes them
+    if (!headerUIDs.empty()) {
+        stateFile << "Headers: ";
+        for (const int &uid : headerUIDs) {
+            stateFile << uid << " ";
+        }
+        stateFile << "\n";
+    }
+
+    // Write the queue of partially saved messages
+    if (!partialUIDs.empty()) {
+        stateFile << "Partial: ";
+        for (const int &uid : partialUIDs) {
+            stateFile << uid << " ";
+        }
+        stateFile << "\n";
+    }
+
     stateFile.close();
+    if (!stateFile || !syncPath(tmpFilePath) || rename(tmpFilePath.c_str(), stateFilePath.c_str()) != 0) {
+        cerr << "Error: Could not update state: " << stateFilePath << "." << endl;
+        return;
+    }
+    syncPath(mailboxDir);
+
+    // The state now covers everything recorded in the progress journal
+    fs::remove(mailboxDir + "/journal.txt");
+}
+
+string buildStatusCommand(const string &tag, const string &mailbox, const string &capabilities) {
+    string command = tag + " STATUS ";
+    if (appendAString(command, mailbox, nonSynchronizingLiteral(capabilities, mailbox.size())) != string::npos) {
+        return "";
+    }
+    command += hasCapability(capabilities, "CONDSTORE") ? " (MESSAGES UIDNEXT UIDVALIDITY HIGHESTMODSEQ)\r\n"
+                                                        : " (MESSAGES UIDNEXT UIDVALIDITY)\r\n";
+    return command;
+}
+
+bool parseMailboxStatus(const string &response, MailboxStatus &status) {
+    size_t lineStart = response.find("* STATUS ");
+    if (lineStart == string::npos) {
+        return false;
+    }
+    string line = response.substr(lineStart, response.find("\r\n", lineStart) - lineStart);
+
+    // The attribute list is the last parenthesized list of the line, the mailbox name may be quoted
+    size_t open = line.rfind('(');
+    size_t close = line.find(')', open);
+    if (open == string::npos || close == string::npos) {
+        return false;
+    }
+    istringstream items(line.substr(open + 1, close - open - 1));
+    string name, value;
+    while (items >> name >> value) {
+        transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return toupper(c); });
+        const char *end = value.data() + value.size();
+        if (name == "MESSAGES") {
+            from_chars(value.data(), end, status.messages);
+        } else if (name == "UIDNEXT") {
+            from_chars(value.data(), end, status.uidnext);
+        } else if (name == "UIDVALIDITY") {
+            from_chars(value.data(), end, status.uidvalidity);
+        } else if (name == "HIGHESTMODSEQ") {
+            from_chars(value.data(), end, status.highestModseq);
+        }
+    }
+    return status.messages != -1 && status.uidnext != -1 && status.uidvalidity != -1;
+}
+
+bool readStatusCache(const string &outDir, const string &mailbox, const string &server, bool headersOnly, const string &criteria,
+                     MailboxStatus &status) {
+    ifstream statusFile(outDir + "/" + server + "/" + mailbox + "/status.txt");
+    string line, storedHeadersOnly, storedCriteria;
+    while (getline(statusFile, line)) {
+        istringstream fields(line);
+        string key;
+        fields >> key;
+        if (key == "HeadersOnly:") {
+            fields >> storedHeadersOnly;
+        } else if (key == "Criteria:") {
+            getline(fields >> ws, storedCriteria);
+        } else if (key == "MESSAGES:") {
+            fields >> status.messages;
+        } else if (key == "UIDNEXT:") {
+            fields >> status.uidnext;
+        } else if (key == "UIDVALIDITY:") {
+            fields >> status.uidvalidity;
+        } else if (key == "HIGHESTMODSEQ:") {
+            fields >> status.highestModseq;
+        }
+    }
+    // A status stored for another mode or other criteria says nothing about the messages this run needs
+    return storedHeadersOnly == (headersOnly ? "true" : "false") && storedCriteria == criteria && status.messages != -1 &&
+           status.uidnext != -1 && status.uidvalidity != -1;
+}
+
+void writeStatusCache(const string &outDir, const string &mailbox, const string &server, bool headersOnly, const string &criteria,
+                      const MailboxStatus &status) {
+    string statusFilePath = outDir + "/" + server + "/" + mailbox + "/status.txt";
+    string tmpFilePath = statusFilePath + ".tmp";
+    ofstream statusFile(tmpFilePath);
+    statusFile << "HeadersOnly: " << boolalpha << headersOnly << "\n";
+    statusFile << "Criteria: " << criteria << "\n";
+    statusFile << "MESSAGES: " << status.messages << "\n";
+    statusFile << "UIDNEXT: " << status.uidnext << "\n";
+    statusFile << "UIDVALIDITY: " << status.uidvalidity << "\n";
+    if (status.highestModseq != 0) {
+        statusFile << "HIGHESTMODSEQ: " << status.highestModseq << "\n";
+    }
+    statusFile.close();
+    if (!statusFile || rename(tmpFilePath.c_str(), statusFilePath.c_str()) != 0) {
+        cerr << "Warning: Could not store the mailbox status in " << statusFilePath << "." << endl;
+    }
+}
+
+bool mailboxUnchanged(const MailboxStatus &cached, const MailboxStatus &current, const string &criteria) {
+    if (current.uidvalidity == -1 || cached.uidvalidity != current.uidvalidity || cached.messages != current.messages ||
+        cached.uidnext != current.uidnext) {
+        return false;
+    }
+    return criteria == "ALL" || (current.highestModseq != 0 && cached.highestModseq == current.highestModseq);
+}
+
+bool readStateFile(const string &mailboxDir, MailboxState &state) {
+    ifstream stateFile(mailboxDir + "/state.txt");
+    if (!stateFile) {
+        return false;
+    }
+    bool legacyHeadersOnly = false;
+    string line;
+    while (getline(stateFile, line)) {
+        istringstream fields(line);
+        string key;
+        int uid;
+        fields >> key;
+        if (key == "HeadersOnly:") {
+            string value;
+            fields >> value;
+            legacyHeadersOnly = value == "true";
+        } else if (key == "UIDVALIDITY:") {
+            fields >> state.uidvalidity;
+        } else if (key == "UIDs:") {
+            while (fields >> uid) state.uids.push_back(uid);
+        } else if (key == "Headers:") {
+            while (fields >> uid) state.headerUIDs.insert(uid);
+        } else if (key == "Partial:") {
+            while (fields >> uid) state.partialUIDs.insert(uid);
+        }
+    }
+    if (legacyHeadersOnly) {
+        state.headerUIDs.insert(state.uids.begin(), state.uids.end());
+    }
+    return true;
+}
+
+// Reads a journal line by line; a torn last line (without a newline) is ignored
+static void replayJournal(const string &outDir, const string &mailbox, const string &server, int uidvalidity) {
+    string mailboxDir = outDir + "/" + server + "/" + mailbox;
+    ifstream journal(mailboxDir + "/journal.txt");
+    if (!journal) {
+        return;
+    }
+
+    int journalUIDValidity = -1;
+    string journalHeadersOnly;
+    vector<pair<int, bool>> records;            // UID, saved only partially
+    string line;
+    while (getline(journal, line) && !journal.eof()) {
+        istringstream fields(line);
+        string key;
+        int value;
+        fields >> key;
+        if (key == "HeadersOnly:") {
+            fields >> journalHeadersOnly;
+        } else if (fields >> value) {
+            if (key == "UIDVALIDITY:") {
+                journalUIDValidity = value;
+            } else if (key == "Saved:" || key == "Partial:") {
+                records.push_back({value, key == "Partial:"});
+            }
+        }
+    }
+    journal.close();
+
+    // Records of another mailbox generation are useless
+    if (journalUIDValidity != uidvalidity || records.empty()) {
+        fs::remove(mailboxDir + "/journal.txt");
+        return;
+    }
+
+    // Fold the records into the state, the download mode of the journal tells how complete they are;
+    // a state of another generation is replaced
+    MailboxState state;
+    readStateFile(mailboxDir, state);
+    set<int> uids, headerUIDs, partialUIDs;
+    if (state.uidvalidity == uidvalidity) {
+        uids.insert(state.uids.begin(), state.uids.end());
+        headerUIDs.insert(state.headerUIDs.begin(), state.headerUIDs.end());
+        partialUIDs.insert(state.partialUIDs.begin(), state.partialUIDs.end());
+    }
+    bool headersOnly = journalHeadersOnly == "true";
+    for (const auto &[uid, partial] : records) {
+        uids.insert(uid);
+        if (headersOnly) {
+            headerUIDs.insert(uid);
+        } else {
+            headerUIDs.erase(uid);
+        }
+        if (partial) {
+            partialUIDs.insert(uid);
+        } else {
+            partialUIDs.erase(uid);
+        }
+    }
+    updateStateFile(outDir, mailbox, uidvalidity, vector<int>(uids.begin(), uids.end()), server,
+                    vector<int>(headerUIDs.begin(), headerUIDs.end()), vector<int>(partialUIDs.begin(), partialUIDs.end()));
+}
+
+bool findFetchLiteralStart(string_view response, size_t &offset, size_t &length) {
+    size_t lineStart = 0;
+    while (lineStart < response.size()) {
+        size_t eol = response.find("\r\n", lineStart);
+        if (eol == string_view::npos) {
+            return false;
+        }
+        string_view line = response.substr(lineStart, eol - lineStart);
+        size_t open = line.rfind('{');
+        if (line.starts_with("* ") && line.ends_with('}') && open != string_view::npos &&
+            from_chars(line.data() + open + 1, line.data() + line.size() - 1, length).ec == errc()) {
+            offset = eol + 2;
+            return true;
+        }
+        lineStart = eol + 2;
+    }
+    return false;
+}
+
+bool findFetchLiteral(string_view response, string_view &data) {
+    size_t offset, length;
+    if (!findFetchLiteralStart(response, offset, length) || offset + length > response.size()) {
+        return false;
+    }
+    data = response.substr(offset, length);
+    return true;
+}
+
+int selectHeaderFields(string_view header, array<string_view, RFC5322_HEADER_FIELDS> &fields) {
+    static constexpr string_view names[RFC5322_HEADER_FIELDS] = {"Date: ", "From: ", "To: ", "Subject: ", "Message-Id: "};
+    int count = 0;
+    for (string_view name : names) {
+        // The first occurrence with a non-empty value up to the end of its line, like formatToRFC5322
+        for (size_t pos = header.find(name); pos != string_view::npos; pos = header.find(name, pos + 1)) {
+            size_t valueStart = pos + name.size();
+            size_t end = header.find_first_of("\r\n", valueStart);
+            if (end == string_view::npos || end == valueStart) {
+                continue;
+            }
+            if (header[end] == '\r') {
+                if (end + 1 >= header.size() || header[end + 1] != '\n') {
+                    continue;
+                }
+                end++;
+            }
+            fields[count++] = header.substr(pos, end + 1 - pos);
+            break;
+        }
+    }
+    return count;
+}
+
+static LineEnding messageLineEnding = LineEnding::Keep;
+
+void setOutputLineEnding(LineEnding eol) {
+    messageLineEnding = eol;
+}
+
+LineEnding outputLineEnding() {
+    return messageLineEnding;
+}
+
+MessagePaths::MessagePaths(const string &mailboxDir) : mailboxDir(mailboxDir) {
+    path = mailboxDir + "/message_uid_";
+    prefixLength = path.size();
+}
+
+const string &MessagePaths::message(int uid, string_view suffix) {
+    char digits[12];
+    size_t length = to_chars(digits, digits + sizeof(digits), uid).ptr - digits;
+    path.resize(prefixLength);
+    path.append(digits, length);
+    path.append(suffix);
+    return path;
 }
 
 string formatToRFC5322(const string &response, bool isHeader) {
@@ -192,47 +515,632 @@ string formatToRFC5322(const string &response, bool isHeader) {
     return formatted;
 }
 
-vector<int> checkValidity(const string &outDir, int currentUIDValidity, const string &mailbox, const vector<int> &serverUIDs, string server, bool headersOnly) {
-    int storedUIDValidity;
-    vector<int> storedUIDs;
+vector<int> checkValidity(const string &outDir, int currentUIDValidity, const string &mailbox, const vector<int> &serverUIDs, string server, bool headersOnly,
+                          bool finishPartial) {
+    // Messages saved by an interrupted run are recorded in the progress journal
+    replayJournal(outDir, mailbox, server, currentUIDValidity);
 
-    string stateFilePath = outDir + "/" + server + "/" + mailbox + "/state.txt";
-    ifstream stateFile(stateFilePath);
+    MailboxState state;
+    if (!readStateFile(outDir + "/" + server + "/" + mailbox, state) || state.uidvalidity != currentUIDValidity) {
+        // No state or UIDVALIDITY changed, download all messages
+        return serverUIDs;
+    }
 
-    if (!stateFile) {
-        // state.txt doesn't exist, treat it as a new download
-        return serverUIDs;  // Download all messages
+    // Compare the stored UIDs with serverUIDs; a full run completes the messages saved without their body,
+    // partially saved messages are queued again only on request
+    unordered_set<int> storedUIDs(state.uids.begin(), state.uids.end());
+    vector<int> newUIDs;
+    for (int uid : serverUIDs) {
+        if (!storedUIDs.count(uid) || (!headersOnly && state.headerUIDs.count(uid)) ||
+            (finishPartial && !headersOnly && state.partialUIDs.count(uid))) {
+            newUIDs.push_back(uid);
+        }
     }
-    string line;
-    while (getline(stateFile, line)) {
-        if(line.find("HeadersOnly:") != string::npos){
-            if(((line.substr(line.find(":") + 2) == "true") && (headersOnly == false)) || ((line.substr(line.find(":") + 2) == "false") && (headersOnly == true))){
-                return serverUIDs;
-            }
+    return newUIDs;
+}
+
+string parseCapabilities(const string &response) {
+    size_t pos = response.find("* CAPABILITY ");
+    if (pos != string::npos) {
+        size_t start = pos + 13;
+        return response.substr(start, response.find("\r\n", start) - start);
+    }
+
+    // Servers may also announce capabilities in a response code, e.g. "* OK [CAPABILITY IMAP4rev1 ...]"
+    pos = response.find("[CAPABILITY ");
+    if (pos != string::npos) {
+        size_t start = pos + 12;
+        return response.substr(start, response.find(']', start) - start);
+    }
+    return "";
+}
+
+bool nonSynchronizingLiteral(const string &capabilities, size_t size) {
+    return hasCapability(capabilities, "LITERAL+") || (hasCapability(capabilities, "LITERAL-") && size <= LITERAL_MINUS_LIMIT);
+}
+
+size_t appendAString(string &out, string_view value, bool nonSynchronizing) {
+    bool atom = !value.empty();
+    bool quotable = true;
+    for (unsigned char c : value) {
+        if (c == '\0' || c == '\r' || c == '\n' || c >= 0x80) {
+            quotable = false;
+        }
+        if (c <= ' ' || c >= 0x7f || strchr("(){}%*\"\\]", c)) {
+            atom = false;
         }
-        if (line.find("UIDVALIDITY:") != string::npos) {
-            storedUIDValidity = stoi(line.substr(line.find(":") + 1));  
-        } else if (line.find("UIDs:") != string::npos) {
-            istringstream uidStream(line.substr(line.find(":") + 1));
-            int uid;
-            while (uidStream >> uid) {
-                storedUIDs.push_back(uid);
+    }
+
+    if (atom) {
+        out += value;
+    } else if (quotable) {
+        out += '"';
+        for (char c : value) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
             }
+            out += c;
         }
+        out += '"';
+    } else {
+        out += '{' + to_string(value.size()) + (nonSynchronizing ? "+}\r\n" : "}\r\n");
+        size_t announcementEnd = out.size();
+        out += value;
+        return nonSynchronizing ? string::npos : announcementEnd;
     }
-    stateFile.close();
+    return string::npos;
+}
 
-    if (storedUIDValidity == currentUIDValidity) {
-        // Compare storedUIDs with serverUIDs
-        vector<int> newUIDs;
-        for (int uid : serverUIDs) {
-            if (find(storedUIDs.begin(), storedUIDs.end(), uid) == storedUIDs.end()) {
-                newUIDs.push_back(uid);
+// Search keys without an argument
+static const unordered_set<string> SEARCH_FLAG_KEYS = {"ALL", "ANSWERED", "DELETED", "DRAFT", "FLAGGED", "NEW", "OLD", "RECENT", "SEEN",
+                                                        "UNANSWERED", "UNDELETED", "UNDRAFT", "UNFLAGGED", "UNSEEN"};
+// Search keys followed by a string, a date or a number
+static const unordered_set<string> SEARCH_STRING_KEYS = {"BCC", "BODY", "CC", "FROM", "SUBJECT", "TEXT", "TO", "KEYWORD", "UNKEYWORD"};
+static const unordered_set<string> SEARCH_DATE_KEYS = {"BEFORE", "ON", "SINCE", "SENTBEFORE", "SENTON", "SENTSINCE"};
+static const unordered_set<string> SEARCH_NUMBER_KEYS = {"LARGER", "SMALLER"};
+
+// Converts a date given as d-Mon-yyyy or yyyy-mm-dd to the IMAP form d-Mon-yyyy
+static bool formatSearchDate(const string &value, string &date) {
+    static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    int day, month = 0, year;
+    char monthName[4] = {}, dash1, dash2, extra;
+    istringstream iso(value);
+    if (iso >> year >> dash1 >> month >> dash2 >> day && !(iso >> extra) && dash1 == '-' && dash2 == '-' && value.size() == 10) {
+        // yyyy-mm-dd
+    } else if (sscanf(value.c_str(), "%2d-%3c-%4d%c", &day, monthName, &year, &extra) == 3) {
+        for (int i = 0; i < 12; i++) {
+            if (strcasecmp(monthName, months[i]) == 0) {
+                month = i + 1;
             }
         }
-        return newUIDs;
     } else {
-        // UIDVALIDITY changed, download all messages
-        return serverUIDs;
+        return false;
+    }
+    if (month < 1 || month > 12 || day < 1 || day > 31 || year < 1000 || year > 9999) {
+        return false;
+    }
+    date = to_string(day) + "-" + months[month - 1] + "-" + to_string(year);
+    return true;
+}
+
+// Splits the criteria given by the user into words, quoted strings (unquoted, marked true) and parentheses
+static bool tokenizeSearchCriteria(string_view text, vector<pair<string, bool>> &tokens) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+        char c = text[pos];
+        if (isspace(static_cast<unsigned char>(c))) {
+            pos++;
+        } else if (c == '(' || c == ')') {
+            tokens.push_back({string(1, c), false});
+            pos++;
+        } else if (c == '"') {
+            string value;
+            for (pos++; pos < text.size() && text[pos] != '"'; pos++) {
+                if (text[pos] == '\\' && pos + 1 < text.size()) {
+                    pos++;
+                }
+                value += text[pos];
+            }
+            if (pos++ >= text.size()) {
+                return false;
+            }
+            tokens.push_back({value, true});
+        } else {
+            size_t end = text.find_first_of(" \t\r\n()\"", pos);
+            end = end == string_view::npos ? text.size() : end;
+            tokens.push_back({string(text.substr(pos, end - pos)), false});
+            pos = end;
+        }
+    }
+    return true;
+}
+
+// Appends one search key with its arguments, nested keys of NOT, OR and parentheses are appended recursively
+static bool appendSearchKey(const vector<pair<string, bool>> &tokens, size_t &pos, string &out, bool &utf8) {
+    if (pos >= tokens.size()) {
+        return false;
+    }
+    const auto &[token, quoted] = tokens[pos++];
+    string key = token;
+    transform(key.begin(), key.end(), key.begin(), ::toupper);
+
+    // String arguments are sent as atoms or quoted strings; UTF-8 strings need CHARSET UTF-8 (quoted UTF-8 is accepted
+    // by the common servers and by IMAP4rev2, a literal would need the server's consent before it is sent)
+    auto appendString = [&](bool atomOnly) {
+        if (pos >= tokens.size() || (atomOnly && tokens[pos].second)) {
+            return false;
+        }
+        const string &value = tokens[pos++].first;
+        if (value.find_first_of(string("\r\n\0", 3)) != string::npos) {
+            return false;
+        }
+        out += ' ';
+        if (any_of(value.begin(), value.end(), [](char c) { return static_cast<unsigned char>(c) >= 0x80; })) {
+            utf8 = true;
+            out += '"';
+            for (char c : value) {
+                out += c == '"' || c == '\\' ? string("\\") + c : string(1, c);
+            }
+            out += '"';
+        } else {
+            appendAString(out, value, false);
+        }
+        return true;
+    };
+
+    if (!quoted && key == "(") {
+        out += '(';
+        bool first = true;
+        while (pos < tokens.size() && !(tokens[pos].first == ")" && !tokens[pos].second)) {
+            out += first ? "" : " ";
+            first = false;
+            if (!appendSearchKey(tokens, pos, out, utf8)) {
+                return false;
+            }
+        }
+        if (first || pos++ >= tokens.size()) {
+            return false;
+        }
+        out += ')';
+        return true;
+    }
+    if (quoted) {
+        return false;
+    }
+    if (SEARCH_FLAG_KEYS.count(key)) {
+        out += key;
+        return true;
+    }
+    if (SEARCH_STRING_KEYS.count(key)) {
+        out += key;
+        return appendString(key.ends_with("KEYWORD"));
+    }
+    if (key == "HEADER") {
+        out += key;
+        return appendString(false) && appendString(false);
+    }
+    if (SEARCH_DATE_KEYS.count(key) || SEARCH_NUMBER_KEYS.count(key) || key == "UID") {
+        if (pos >= tokens.size() || tokens[pos].second) {
+            return false;
+        }
+        const string &value = tokens[pos++].first;
+        string argument = value;
+        unsigned long number;
+        bool valid;
+        if (SEARCH_DATE_KEYS.count(key)) {
+            valid = formatSearchDate(value, argument);
+        } else if (SEARCH_NUMBER_KEYS.count(key)) {
+            valid = !value.empty() && from_chars(value.data(), value.data() + value.size(), number).ptr == value.data() + value.size();
+        } else {
+            valid = !value.empty() && value.find_first_not_of("0123456789:,*") == string::npos;
+        }
+        out += key + " " + argument;
+        return valid;
+    }
+    if (key == "NOT") {
+        out += "NOT ";
+        return appendSearchKey(tokens, pos, out, utf8);
+    }
+    if (key == "OR") {
+        out += "OR ";
+        if (!appendSearchKey(tokens, pos, out, utf8)) {
+            return false;
+        }
+        out += ' ';
+        return appendSearchKey(tokens, pos, out, utf8);
+    }
+
+    // A message sequence set
+    if (!key.empty() && key.find_first_not_of("0123456789:,*") == string::npos) {
+        out += key;
+        return true;
+    }
+    return false;
+}
+
+bool buildSearchCriteria(const string &userCriteria, bool newMessagesOnly, string &criteria) {
+    vector<pair<string, bool>> tokens;
+    if (!tokenizeSearchCriteria(userCriteria, tokens)) {
+        cerr << "Error: Invalid search criteria: unterminated quoted string." << endl;
+        return false;
+    }
+
+    // The keys are ANDed, so the user criteria simply follow UNSEEN
+    string keys = newMessagesOnly ? "UNSEEN" : "";
+    bool utf8 = false;
+    size_t pos = 0;
+    while (pos < tokens.size()) {
+        size_t keyStart = pos;
+        keys += keys.empty() ? "" : " ";
+        if (!appendSearchKey(tokens, pos, keys, utf8)) {
+            cerr << "Error: Invalid search criteria near \"" << tokens[min(keyStart, tokens.size() - 1)].first << "\"." << endl;
+            return false;
+        }
+    }
+    criteria = (utf8 ? "CHARSET UTF-8 " : "") + (keys.empty() ? string("ALL") : keys);
+    return true;
+}
+
+bool hasCapability(const string &capabilities, const string &capability) {
+    istringstream capStream(capabilities);
+    string token;
+    while (capStream >> token) {
+        if (token.size() == capability.size() &&
+            equal(token.begin(), token.end(), capability.begin(),
+                  [](char a, char b) { return toupper(a) == toupper(b); })) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parseSequenceSet(string_view set, vector<int> &uids, size_t maxCount) {
+    const char *pos = set.data();
+    const char *end = set.data() + set.size();
+
+    while (pos < end) {
+        // Parsed wider than the UIDs, so a range up to INT_MAX cannot overflow the loop
+        long long first, last;
+        auto [ptr, ec] = from_chars(pos, end, first);
+        if (ec != errc()) {
+            return false;
+        }
+        last = first;
+
+        // A range "a:b" may be given in either order
+        if (ptr < end && *ptr == ':') {
+            auto [rangeEnd, rangeEc] = from_chars(ptr + 1, end, last);
+            if (rangeEc != errc()) {
+                return false;
+            }
+            ptr = rangeEnd;
+        }
+        if (first > last) {
+            swap(first, last);
+        }
+        if (first < 1 || last > INT_MAX || static_cast<size_t>(last - first + 1) > maxCount - min(maxCount, uids.size())) {
+            return false;
+        }
+        for (long long uid = first; uid <= last; ++uid) {
+            uids.push_back(static_cast<int>(uid));
+        }
+
+        if (ptr < end && *ptr != ',') {
+            return false;
+        }
+        pos = ptr + 1;
+    }
+    return true;
+}
+
+vector<string> buildSequenceSets(vector<int> uids, size_t maxLength) {
+    vector<string> sets;
+    string current;
+    sort(uids.begin(), uids.end());
+
+    for (size_t i = 0; i < uids.size();) {
+        // Extend the run of consecutive UIDs as far as possible
+        size_t j = i;
+        while (j + 1 < uids.size() && uids[j + 1] <= uids[j] + 1) {
+            ++j;
+        }
+        string range = uids[i] == uids[j] ? to_string(uids[i]) : to_string(uids[i]) + ":" + to_string(uids[j]);
+
+        if (!current.empty() && current.size() + range.size() + 1 > maxLength) {
+            sets.push_back(current);
+            current.clear();
+        }
+        current += (current.empty() ? "" : ",") + range;
+        i = j + 1;
+    }
+    if (!current.empty()) {
+        sets.push_back(current);
+    }
+    return sets;
+}
+
+void parseMessageSizes(const string &response, unordered_map<int, long> &sizes) {
+    size_t lineStart = 0;
+
+    while (lineStart < response.size()) {
+        size_t lineEnd = response.find("\r\n", lineStart);
+        if (lineEnd == string::npos) {
+            lineEnd = response.size();
+        }
+        string_view line(response.data() + lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 2;
+
+        size_t uidPos = line.find("UID ");
+        size_t sizePos = line.find("RFC822.SIZE ");
+        if (!line.starts_with("* ") || uidPos == string_view::npos || sizePos == string_view::npos) {
+            continue;
+        }
+
+        int uid;
+        long size;
+        const char *end = line.data() + line.size();
+        if (from_chars(line.data() + uidPos + 4, end, uid).ec == errc() &&
+            from_chars(line.data() + sizePos + 12, end, size).ec == errc()) {
+            sizes[uid] = size;
+        }
+    }
+}
+
+bool extractFetchLiteral(const string &response, const string &item, string &data) {
+    size_t pos = response.find(item + " ");
+    if (pos == string::npos) {
+        return false;
+    }
+    pos += item.size() + 1;
+
+    if (response.compare(pos, 3, "NIL") == 0) {
+        data.clear();
+        return true;
+    }
+    if (pos < response.size() && response[pos] == '"') {
+        size_t end = response.find('"', pos + 1);
+        if (end == string::npos) {
+            return false;
+        }
+        data = response.substr(pos + 1, end - pos - 1);
+        return true;
+    }
+
+    // Literal "{n}\r\n" followed by n bytes, BINARY uses "~{n}"
+    if (pos < response.size() && response[pos] == '~') {
+        ++pos;
+    }
+    size_t length;
+    if (pos >= response.size() || response[pos] != '{' ||
+        from_chars(response.data() + pos + 1, response.data() + response.size(), length).ec != errc()) {
+        return false;
+    }
+    size_t start = response.find("}\r\n", pos);
+    if (start == string::npos || start + 3 + length > response.size()) {
+        return false;
+    }
+    data = response.substr(start + 3, length);
+    return true;
+}
+
+bool hasTaggedCompletion(const string &response, const string &tag, size_t &scanPos) {
+    while (scanPos < response.size()) {
+        size_t eol = response.find("\r\n", scanPos);
+        if (eol == string::npos) {
+            return false;
+        }
+
+        string_view line(response.data() + scanPos, eol - scanPos);
+        scanPos = eol + 2;
+        if (line.size() > tag.size() && line.starts_with(tag) && line[tag.size()] == ' ') {
+            return true;
+        }
+
+        // Skip the literal data announced at the end of the line ("{123}")
+        if (line.ends_with('}')) {
+            size_t open = line.rfind('{');
+            size_t literalLength = 0;
+            if (open != string_view::npos &&
+                from_chars(line.data() + open + 1, line.data() + line.size() - 1, literalLength).ec == errc()) {
+                scanPos += literalLength;
+            }
+        }
+    }
+    return false;
+}
+
+long parseMessageCount(string_view response) {
+    for (size_t pos = response.find(" EXISTS\r\n"); pos != string_view::npos; pos = response.find(" EXISTS\r\n", pos + 1)) {
+        size_t lineStart = response.rfind("\r\n", pos);
+        lineStart = lineStart == string_view::npos ? 0 : lineStart + 2;
+        long count;
+        if (pos < lineStart + 3 || !response.substr(lineStart).starts_with("* ")) {
+            continue;
+        }
+        auto [numberEnd, ec] = from_chars(response.data() + lineStart + 2, response.data() + pos, count);
+        if (ec == errc() && numberEnd == response.data() + pos) {
+            return count;
+        }
+    }
+    return -1;
+}
+
+SearchResponseParser::SearchResponseParser(const string &tag, long messageCount)
+    : tag(tag), maxUIDs(messageCount < 0 ? MAX_SEARCH_UIDS : messageCount) {}
+
+bool SearchResponseParser::succeeded() const {
+    return status == "OK" && !invalid;
+}
+
+bool SearchResponseParser::resultInvalid() const {
+    return invalid;
+}
+
+bool SearchResponseParser::feed(const char *data, size_t length) {
+    pending.append(data, length);
+    string_view in(pending);
+    size_t pos = 0;
+    bool waiting = false;
+
+    while (!waiting && state != State::Done) {
+        switch (state) {
+        case State::LineStart: {
+            string_view rest = in.substr(pos);
+            size_t eol = rest.find("\r\n");
+
+            // Wait until the line is long enough to tell what kind of response it is
+            if (eol == string_view::npos && rest.size() < max<size_t>(32, tag.size() + 1)) {
+                waiting = true;
+            } else if (rest.starts_with("* ") && eol != string_view::npos && rest.substr(0, eol).ends_with(" EXISTS")) {
+                // Messages that arrived since SELECT may be in the result
+                long count = parseMessageCount(rest.substr(0, eol + 2));
+                maxUIDs = max(maxUIDs, count < 0 ? size_t(0) : static_cast<size_t>(count));
+                state = State::SkipLine;
+            } else if (rest.starts_with("* SEARCH")) {
+                pos += 8;
+                state = State::SearchList;
+            } else if (rest.starts_with("* ESEARCH")) {
+                state = State::ESearchHeader;
+            } else if (rest.starts_with(tag) && rest[tag.size()] == ' ') {
+                if (eol == string_view::npos) {
+                    waiting = true;
+                } else {
+                    string_view result = rest.substr(tag.size() + 1, eol - tag.size() - 1);
+                    status = string(result.substr(0, result.find(' ')));
+                    pos += eol + 2;
+                    state = State::Done;
+                }
+            } else {
+                state = State::SkipLine;
+            }
+            break;
+        }
+        case State::SearchList: {
+            // "* SEARCH 1 2 3 ..." - numbers separated by spaces, possibly split across chunks
+            while (pos < in.size() && state == State::SearchList) {
+                char c = in[pos];
+                if (c == ' ') {
+                    ++pos;
+                } else if (isdigit(static_cast<unsigned char>(c))) {
+                    size_t tokenEnd = pos;
+                    while (tokenEnd < in.size() && isdigit(static_cast<unsigned char>(in[tokenEnd]))) {
+                        ++tokenEnd;
+                    }
+                    if (tokenEnd == in.size()) {
+                        break;
+                    }
+                    if (!parseSequenceSet(in.substr(pos, tokenEnd - pos), uids, maxUIDs)) {
+                        if (!invalid) {
+                            cerr << "Error: The server sent an invalid search result or more UIDs than the mailbox holds." << endl;
+                        }
+                        invalid = true;
+                        state = State::SkipLine;
+                    }
+                    pos = tokenEnd;
+                } else {
+                    // End of line or trailing data such as "(MODSEQ 123)"
+                    state = State::SkipLine;
+                }
+            }
+            waiting = state == State::SearchList;
+            break;
+        }
+        case State::ESearchHeader: {
+            // "* ESEARCH (TAG "a003") UID ALL 1:5,9" - the header before the set is short
+            string_view rest = in.substr(pos);
+            size_t eol = rest.find("\r\n");
+            size_t allPos = rest.find(" ALL ");
+            if (allPos != string_view::npos && (eol == string_view::npos || allPos < eol)) {
+                pos += allPos + 5;
+                state = State::ESearchSet;
+            } else if (eol != string_view::npos) {
+                state = State::SkipLine;   // No matching messages
+            } else {
+                waiting = true;
+            }
+            break;
+        }
+        case State::ESearchSet: {
+            while (pos < in.size() && state == State::ESearchSet) {
+                char c = in[pos];
+                if (c == ',') {
+                    ++pos;
+                } else if (isdigit(static_cast<unsigned char>(c))) {
+                    size_t tokenEnd = pos;
+                    while (tokenEnd < in.size() && (isdigit(static_cast<unsigned char>(in[tokenEnd])) || in[tokenEnd] == ':')) {
+                        ++tokenEnd;
+                    }
+                    if (tokenEnd == in.size()) {
+                        break;
+                    }
+                    if (!parseSequenceSet(in.substr(pos, tokenEnd - pos), uids, maxUIDs)) {
+                        if (!invalid) {
+                            cerr << "Error: The server sent an invalid search result or more UIDs than the mailbox holds." << endl;
+                        }
+                        invalid = true;
+                        state = State::SkipLine;
+                    }
+                    pos = tokenEnd;
+                } else {
+                    state = State::SkipLine;
+                }
+            }
+            waiting = state == State::ESearchSet;
+            break;
+        }
+        case State::SkipLine: {
+            size_t eol = in.find("\r\n", pos);
+            if (eol == string_view::npos) {
+                // Keep a trailing '\r' so the CRLF is still recognised after the next chunk
+                pos = (!in.empty() && in.back() == '\r') ? in.size() - 1 : in.size();
+                waiting = true;
+            } else {
+                pos = eol + 2;
+                state = State::LineStart;
+            }
+            break;
+        }
+        case State::Done:
+            break;
+        }
+    }
+
+    pending.erase(0, pos);
+    return state == State::Done;
+}
+
+ProgressJournal::ProgressJournal(const string &dir, int uidvalidity, bool headersOnly) : dir(dir) {
+    // Earlier records were folded into the state by checkValidity, the journal starts empty
+    fd = open((dir + "/journal.txt").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        cerr << "Warning: Could not open the progress journal in " << dir << "." << endl;
+        return;
+    }
+    string header = "UIDVALIDITY: " + to_string(uidvalidity) + "\nHeadersOnly: " + (headersOnly ? "true" : "false") + "\n";
+    if (write(fd, header.data(), header.size()) != static_cast<ssize_t>(header.size()) || fsync(fd) != 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+ProgressJournal::~ProgressJournal() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool ProgressJournal::record(int uid, bool partial, const string &messagePath) {
+    if (fd < 0) {
+        return false;
+    }
+    // The message and its directory entry have to be on disk before the record claims so
+    if (!syncPath(messagePath) || !syncPath(dir)) {
+        return false;
     }
+    char line[32];
+    size_t prefixLength = partial ? 9 : 7;
+    memcpy(line, partial ? "Partial: " : "Saved: ", prefixLength);
+    char *end = to_chars(line + prefixLength, line + sizeof(line) - 1, uid).ptr;
+    *end++ = '\n';
+    return write(fd, line, end - line) == end - line && fsync(fd) == 0;
 }
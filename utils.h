@@ -14,9 +14,16 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <unordered_set>
+#include <unordered_map>
 #include <sstream>
 #include <regex>
 #include <filesystem>
+#include <charconv>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <cstring>
+#include "codec.h"
 
 using namespace std;
 namespace fs = std::filesystem;
@@ -45,44 +52,358 @@ pair<string, string> readAuthFile(const string &authFile);
 string formatOutMsg(const string &mailbox, int messageCount, bool newMessagesOnly);
 
 /**
- * Creates a directory structure and stores UIDVALIDITY and UIDs in a state file.
+ * Creates the directory structure for the mailbox. Downloaded UIDs are recorded by ProgressJournal
+ * as the messages are saved, and in the state file by updateStateFile at the end of the run.
  * @param outDir - Base output directory specified by the user.
- * @param uidvalidity - The UIDVALIDITY value of the selected mailbox.
  * @param mailbox - The mailbox folder to create inside the output directory.
- * @param messageUIDs - A set of UIDs to store the current state (can be empty if not tracking).
+ * @param server - The server address used to differentiate between different server states.
  * @return - Returns true if successful, false otherwise.
  */
-bool createDir(const string outDir, const int uidvalidity, const string mailbox, vector<int> messageUIDs, string server, bool headersOnly);
+bool createDir(const string &outDir, const string &mailbox, const string &server);
 
 /**
  * @brief Prints the help message with usage instructions for the IMAP client.
  */
 void printHelp();
 
+/**
+ * Flushes a file or directory to disk.
+ * @param path - The path of the file or directory.
+ * @return - Returns true if the data reached the disk, false otherwise.
+ */
+bool syncPath(const string &path);
+
 /**
  * Updates the state file with the latest UIDVALIDITY and UIDs.
+ * The file is replaced atomically and the progress journal it supersedes is removed.
  * @param outDir - Base output directory specified by the user.
  * @param mailbox - The mailbox folder to update inside the output directory.
  * @param uidvalidity - The UIDVALIDITY value of the selected mailbox.
  * @param uids - The updated list of UIDs in the current mailbox.
+ * @param headerUIDs - UIDs of messages that were saved without their body (-h) and are completed by a full run.
+ * @param partialUIDs - UIDs of messages that were saved only partially and still have to be finished.
+ */
+void updateStateFile(const string &outDir, const string &mailbox, int uidvalidity, const vector<int> &uids, const string server,
+                     const vector<int> &headerUIDs, const vector<int> &partialUIDs = {});
+
+/**
+ * Messages of a mailbox recorded in its state file, with the completeness of each of them.
+ */
+struct MailboxState {
+    int uidvalidity = -1;                   // -1 if there is no state
+    vector<int> uids;                       // All stored messages
+    unordered_set<int> headerUIDs;          // Stored without their body (-h)
+    unordered_set<int> partialUIDs;         // Stored only partially (--max-size)
+};
+
+/**
+ * Reads the state file of a mailbox directory. A state written before the completeness was tracked per message
+ * ("HeadersOnly: true") marks all of its messages as stored without their body.
+ * @param mailboxDir - The mailbox directory.
+ * @param state - The messages recorded in the state.
+ * @return - Returns true if the state file exists, false otherwise.
+ */
+bool readStateFile(const string &mailboxDir, MailboxState &state);
+
+/**
+ * Counters of a mailbox reported by STATUS. MESSAGES and UIDNEXT move whenever messages are added or expunged,
+ * HIGHESTMODSEQ (CONDSTORE, RFC 7162) also whenever flags change.
+ */
+struct MailboxStatus {
+    long messages = -1;
+    long uidnext = -1;
+    long uidvalidity = -1;                  // -1 if the status is not known
+    unsigned long long highestModseq = 0;   // 0 if the server does not support CONDSTORE
+};
+
+/**
+ * Builds the STATUS command asking for the counters of a mailbox.
+ * @param tag - The tag of the command.
+ * @param mailbox - The mailbox name.
+ * @param capabilities - The capabilities of the server; with CONDSTORE, HIGHESTMODSEQ is asked for as well.
+ * @return - The command including CRLF, or an empty string if the name needs a literal the server has to confirm
+ *           first; the status is only a shortcut, so it is not asked for then.
+ */
+string buildStatusCommand(const string &tag, const string &mailbox, const string &capabilities);
+
+/**
+ * Parses the "* STATUS mailbox (...)" response.
+ * @param response - The raw server response.
+ * @param status - The counters of the mailbox.
+ * @return - Returns true if MESSAGES, UIDNEXT and UIDVALIDITY were found, false otherwise.
+ */
+bool parseMailboxStatus(const string &response, MailboxStatus &status);
+
+/**
+ * Reads the mailbox status stored by the last complete download of the mailbox (status.txt).
+ * @param outDir - Base output directory.
+ * @param mailbox - The mailbox folder.
+ * @param server - The server address.
+ * @param headersOnly - The download mode of this run.
+ * @param criteria - The search criteria of this run.
+ * @param status - The stored counters.
+ * @return - Returns true if a status was stored by a run with the same mode and criteria, false otherwise.
+ */
+bool readStatusCache(const string &outDir, const string &mailbox, const string &server, bool headersOnly, const string &criteria,
+                     MailboxStatus &status);
+
+/**
+ * Stores the mailbox status after every message matching the criteria was downloaded (status.txt).
+ * @param outDir - Base output directory.
+ * @param mailbox - The mailbox folder.
+ * @param server - The server address.
+ * @param headersOnly - The download mode of this run.
+ * @param criteria - The search criteria of this run.
+ * @param status - The counters reported by the server before the mailbox was searched.
+ */
+void writeStatusCache(const string &outDir, const string &mailbox, const string &server, bool headersOnly, const string &criteria,
+                      const MailboxStatus &status);
+
+/**
+ * Decides whether a mailbox can be skipped because nothing it holds changed since its status was stored.
+ * Criteria other than ALL may depend on flags, so they need an unchanged HIGHESTMODSEQ as well.
+ * @param cached - The status stored by readStatusCache.
+ * @param current - The status reported by the server now.
+ * @param criteria - The search criteria of this run.
+ * @return - Returns true if the mailbox needs no SELECT, false otherwise.
  */
-void updateStateFile(const string &outDir, const string &mailbox, int uidvalidity, const vector<int> &uids, const string server, bool headersOnly);
+bool mailboxUnchanged(const MailboxStatus &cached, const MailboxStatus &current, const string &criteria);
 
 // Function to format from raw IMAP response to RFC 5322 format
 string formatToRFC5322(const string &response, bool isHeader);
 
+// Number of header fields kept by formatToRFC5322 (Date, From, To, Subject, Message-Id)
+const int RFC5322_HEADER_FIELDS = 5;
+
+/**
+ * Finds where the first literal of a FETCH response starts, before its data has been received completely.
+ * @param response - The raw server response, possibly incomplete.
+ * @param offset - The offset of the literal data in the response.
+ * @param length - The length of the literal announced by the server.
+ * @return - Returns true if the literal was announced, false otherwise.
+ */
+bool findFetchLiteralStart(string_view response, size_t &offset, size_t &length);
+
+/**
+ * Finds the first literal of a FETCH response without copying it.
+ * @param response - The raw server response.
+ * @param data - The view the literal data is stored to.
+ * @return - Returns true if a complete literal was found, false otherwise.
+ */
+bool findFetchLiteral(string_view response, string_view &data);
+
+/**
+ * Selects the header lines kept by formatToRFC5322 as views of the header, in the same order.
+ * @param header - The header data.
+ * @param fields - The array the selected lines (including their line ends) are stored to.
+ * @return - The number of selected lines.
+ */
+int selectHeaderFields(string_view header, array<string_view, RFC5322_HEADER_FIELDS> &fields);
+
+/**
+ * Sets the line endings the message files are saved with (--eol).
+ * @param eol - The line ending, LineEnding::Keep saves the data as received.
+ */
+void setOutputLineEnding(LineEnding eol);
+
+/**
+ * Returns the line endings the message files are saved with.
+ * @return - The line ending set by setOutputLineEnding.
+ */
+LineEnding outputLineEnding();
+
+/**
+ * Builds the paths of the message files of one mailbox directory. The directory prefix is computed once
+ * and the path buffer is reused, so building a path does not allocate.
+ */
+class MessagePaths {
+public:
+    explicit MessagePaths(const string &mailboxDir);
+
+    // The mailbox directory
+    const string &dir() const { return mailboxDir; }
+
+    // Path of "message_uid_<uid><suffix>", valid until the next call
+    const string &message(int uid, string_view suffix = ".eml");
+
+private:
+    string mailboxDir;
+    string path;
+    size_t prefixLength;
+};
+
 /**
  * Checks the stored UIDVALIDITY and UIDs against the current server state to determine which messages should be downloaded.
  * If the state file doesn't exist, it treats the entire mailbox as new and downloads all messages.
  * If the UIDVALIDITY matches, it compares the stored UIDs with the server UIDs to identify any new messages.
  * If the UIDVALIDITY has changed, it treats the mailbox as having a new state and downloads all messages.
+ * Messages recorded in the progress journal of an interrupted run are first folded into the state file.
  * @param outDir - Base output directory where state information is stored.
  * @param currentUIDValidity - The current UIDVALIDITY value of the selected mailbox.
  * @param mailbox - The mailbox folder to check for state information.
  * @param serverUIDs - The current set of UIDs retrieved from the server for comparison.
+ * Partially saved messages are treated as downloaded unless finishPartial is set, in which case they are returned again.
  * @param server - The server address used to differentiate between different server states.
+ * @param finishPartial - If true, partially saved messages are returned so they can be downloaded in full.
  * @return - A vector of UIDs that need to be downloaded. Returns an empty vector if no new messages need to be downloaded.
  */
-vector<int> checkValidity(const string &outDir, int currentUIDValidity, const string &mailbox, const vector<int> &serverUIDs, string server, bool headersOnly);
+vector<int> checkValidity(const string &outDir, int currentUIDValidity, const string &mailbox, const vector<int> &serverUIDs, string server, bool headersOnly,
+                          bool finishPartial = false);
+
+/**
+ * Extracts the capability list from a "* CAPABILITY" response or a "[CAPABILITY ...]" response code.
+ * @param response - The raw server response.
+ * @return - The space separated capability list, or an empty string if none was found.
+ */
+string parseCapabilities(const string &response);
+
+// Longest literal that may be sent without waiting if the server supports LITERAL- (RFC 7888)
+const size_t LITERAL_MINUS_LIMIT = 4096;
+
+/**
+ * Tells whether a literal may be sent without waiting for the server's continuation request.
+ * @param capabilities - The capabilities of the server.
+ * @param size - The size of the literal.
+ * @return - Returns true if the server supports LITERAL+, or LITERAL- and the literal is small enough.
+ */
+bool nonSynchronizingLiteral(const string &capabilities, size_t size);
+
+/**
+ * Appends a string argument of a command (RFC 3501 astring): as an atom if possible, as a quoted string if it
+ * contains special characters, and as a literal if it contains CR, LF, NUL or 8-bit characters.
+ * @param out - The command being built.
+ * @param value - The argument.
+ * @param nonSynchronizing - If true, a literal is written in the non-synchronizing form "{n+}" (LITERAL+).
+ * @return - The offset in out just after the announcement of a synchronizing literal, up to which the command has
+ *           to be sent before the server's continuation request, or string::npos if there is none.
+ */
+size_t appendAString(string &out, string_view value, bool nonSynchronizing);
+
+/**
+ * Validates IMAP SEARCH criteria given by the user (--search) and builds the criteria of the UID SEARCH command.
+ * The keys are upper-cased, dates may also be given as yyyy-mm-dd, string arguments are quoted as needed
+ * (UTF-8 strings add CHARSET UTF-8) and UNSEEN is added for -n. Supported keys: the flag keys (SEEN, FLAGGED, ...),
+ * BCC/BODY/CC/FROM/SUBJECT/TEXT/TO string, HEADER field string, KEYWORD/UNKEYWORD flag, BEFORE/ON/SINCE and
+ * SENTBEFORE/SENTON/SENTSINCE date, LARGER/SMALLER n, UID set, sequence sets, NOT key, OR key key and parentheses.
+ * @param userCriteria - The criteria given by the user, empty for all messages.
+ * @param newMessagesOnly - If true, only unseen messages match.
+ * @param criteria - The criteria for the command, e.g. "UNSEEN SINCE 1-Jan-2024 FROM alice".
+ * @return - Returns true if the criteria are valid, false otherwise (an error is printed).
+ */
+bool buildSearchCriteria(const string &userCriteria, bool newMessagesOnly, string &criteria);
+
+/**
+ * Checks whether the server advertised the given capability (case-insensitive).
+ * @param capabilities - The capability list returned by parseCapabilities.
+ * @param capability - The capability to look for (e.g. "ESEARCH").
+ * @return - Returns true if the capability is present, false otherwise.
+ */
+bool hasCapability(const string &capabilities, const string &capability);
+
+/**
+ * Expands an IMAP sequence-set (e.g. "1:4,7,9:10") and appends the numbers to the vector.
+ * @param set - The sequence-set to expand.
+ * @param uids - The vector the expanded numbers are appended to.
+ * @param maxCount - The most numbers the vector may hold, e.g. the number of messages in the mailbox.
+ * @return - Returns true if the set is well formed and fits, false otherwise.
+ */
+bool parseSequenceSet(string_view set, vector<int> &uids, size_t maxCount);
+
+// Bound of a search result when the number of messages in the mailbox is not known
+const size_t MAX_SEARCH_UIDS = 1 << 24;
+
+/**
+ * Reads the number of messages in the mailbox from the "* N EXISTS" response of SELECT.
+ * @param response - The SELECT response.
+ * @return - The number of messages, -1 if the response does not tell it.
+ */
+long parseMessageCount(string_view response);
+
+/**
+ * Compresses UIDs into IMAP sequence-sets (e.g. "1:4,7"), split so that no set exceeds the given length.
+ * @param uids - The UIDs to compress.
+ * @param maxLength - The maximum length of one sequence-set, keeps command lines within server limits.
+ * @return - A vector of sequence-sets covering all UIDs.
+ */
+vector<string> buildSequenceSets(vector<int> uids, size_t maxLength = 4000);
+
+/**
+ * Parses the RFC822.SIZE items of a UID FETCH response.
+ * @param response - The raw server response.
+ * @param sizes - Map the sizes are stored to, keyed by UID.
+ */
+void parseMessageSizes(const string &response, unordered_map<int, long> &sizes);
+
+/**
+ * Extracts the data of a FETCH response item, e.g. the literal following "BODY[1]".
+ * Literals ("{n}" and the BINARY "~{n}"), quoted strings and NIL are supported.
+ * @param response - The raw server response.
+ * @param item - The item name as returned by the server, e.g. "BODY[2.1]".
+ * @param data - The string the item data is stored to.
+ * @return - Returns true if the item was found, false otherwise.
+ */
+bool extractFetchLiteral(const string &response, const string &item, string &data);
+
+/**
+ * Checks whether a growing response buffer already contains the tagged completion line.
+ * Literals announced by the server are skipped, so message data cannot end the response early.
+ * @param response - The buffered server response.
+ * @param tag - The tag of the command the response belongs to.
+ * @param scanPos - Offset where scanning resumes; updated so that repeated calls stay linear.
+ * @return - Returns true once the tagged completion line has been received.
+ */
+bool hasTaggedCompletion(const string &response, const string &tag, size_t &scanPos);
+
+/**
+ * Incremental parser for UID SEARCH responses (RFC 3501 "* SEARCH" and RFC 4731 "* ESEARCH").
+ * Chunks are fed as they are received and UIDs are parsed on the fly, so the result size is not limited
+ * by any buffer and the whole response never has to be held in memory. A result with more UIDs than the mailbox
+ * holds messages (counting the EXISTS responses that arrive with it) fails, so a range such as "1:4294967295"
+ * cannot exhaust the memory.
+ */
+class SearchResponseParser {
+public:
+    // messageCount is the number of messages in the selected mailbox, -1 if not known (MAX_SEARCH_UIDS then)
+    explicit SearchResponseParser(const string &tag, long messageCount = -1);
+
+    // Feeds the next received chunk, returns true once the tagged completion line has been parsed
+    bool feed(const char *data, size_t length);
+
+    // True if the server completed the command with OK and the result was valid
+    bool succeeded() const;
+
+    // True if the result was malformed or held more UIDs than the mailbox (already reported)
+    bool resultInvalid() const;
+
+    vector<int> uids;                       // UIDs collected so far
+
+private:
+    enum class State { LineStart, SearchList, ESearchHeader, ESearchSet, SkipLine, Done };
+
+    State state = State::LineStart;
+    string tag;
+    size_t maxUIDs;                         // Most UIDs the result may hold
+    bool invalid = false;                   // The result was malformed or too large
+    string status;                          // OK, NO or BAD from the tagged line
+    string pending;                         // Unparsed tail of the previous chunk
+};
+
+/**
+ * Append-only journal of the messages saved in the current run (journal.txt in the mailbox directory).
+ * A UID is recorded only after its message file is on disk, so an interrupted run can be resumed
+ * exactly where it stopped; checkValidity replays the journal and updateStateFile retires it.
+ */
+class ProgressJournal {
+public:
+    ProgressJournal(const string &dir, int uidvalidity, bool headersOnly);
+    ~ProgressJournal();
+
+    // Flushes the message file and records its UID, returns false if the record is not durable
+    bool record(int uid, bool partial, const string &messagePath);
+
+private:
+    string dir;
+    int fd = -1;
+};
 
 #endif // UTILS_H
\ No newline at end of file